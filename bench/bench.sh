@@ -0,0 +1,116 @@
+#!/bin/bash
+# Loopback benchmark: client_epoll source(s) -> proxy under test -> server_epoll sink
+# Every point of the sweep runs REPEATS times with fresh processes, one CSV row per run on stdout.
+#
+# Settings (environment):
+#   MODES       comma separated proxies under test, "none" connects the source straight to the sink
+#               (default "none,proxy,proxy -u,no_buf,no_buf -s")
+#   SEND_SIZES  client send()/server recv() sizes in bytes (default: the BUFFER_SIZE values of main_client.c)
+#   RING_SIZES  proxy circular buffer capacities in bytes (-b), only swept for proxy modes
+#   STREAMS     parallel client connections, no_buf only relays one
+#   REPEATS     runs per point
+#   DURATION    seconds each client sends
+#   SEND_MODE   client send mode (-m): copy, zerocopy, sendfile or splice (default copy)
+#   RATE        pace every stream to this many Mbit/s (-R), unset sends as fast as possible
+#
+# Columns: throughput summed over the streams as received by the sink (decimal Gbps), CPU time
+# of the proxy process and p99 residence time of upstream bytes inside the proxy (proxy only).
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PROXY_DIR=$ROOT/proxy_kernel
+IPERF_DIR=$ROOT/iperf_epoll
+
+MODES=${MODES:-"none,proxy,proxy -u,no_buf,no_buf -s"}
+SEND_SIZES=${SEND_SIZES:-"8192 16384 32768 65536 131072 524288 1048576 2097152"}
+RING_SIZES=${RING_SIZES:-"65536 146000 1048576"}
+STREAMS=${STREAMS:-"1 4"}
+REPEATS=${REPEATS:-3}
+DURATION=${DURATION:-5}
+SEND_MODE=${SEND_MODE:-copy}
+RATE_ARGS=${RATE:+-R $RATE}
+
+PROXY_PORT=1234   # PROXY_PORT of proxy.h and no_buf.c
+SINK_PORT=5678    # REMOTE_PORT of proxy.h and no_buf.c
+
+LOGS=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$LOGS"' EXIT
+
+# Wait until a TCP port on loopback accepts connections
+wait_listen(){
+    for i in $(seq 50); do
+        ss -ltn "sport = :$1" | grep -q LISTEN && return 0
+        sleep 0.1
+    done
+    echo "Nothing listening on port $1" >&2
+    return 1
+}
+
+# run_point <mode> <send size> <ring size> <streams> <repeat>
+run_point(){
+    local mode=$1 send=$2 ring=$3 streams=$4 rep=$5 target=$SINK_PORT proxy_pid=""
+    rm -f "$LOGS"/*
+
+    stdbuf -oL "$IPERF_DIR/server_epoll" -B 127.0.0.1 -p $SINK_PORT -l "$send" > "$LOGS/sink.log" 2>&1 &
+    local sink_pid=$!
+    wait_listen $SINK_PORT || return
+
+    case "$mode" in
+        none)
+            ;;
+        proxy*)
+            "$PROXY_DIR/proxy" -i 0 -b "$ring" ${mode#proxy} > "$LOGS/proxy.log" 2>&1 &
+            proxy_pid=$!
+            target=$PROXY_PORT
+            ;;
+        no_buf*)
+            "$PROXY_DIR/no_buf" -i 0 ${mode#no_buf} > "$LOGS/proxy.log" 2>&1 &
+            proxy_pid=$!
+            target=$PROXY_PORT
+            ;;
+    esac
+    [ -n "$proxy_pid" ] && { wait_listen $PROXY_PORT || return; }
+
+    local clients=()
+    for s in $(seq "$streams"); do
+        "$IPERF_DIR/client_epoll" -c 127.0.0.1 -p $target -B 127.0.0.1 -b 0 -l "$send" -t "$DURATION" -m "$SEND_MODE" $RATE_ARGS \
+            > "$LOGS/client$s.log" 2>&1 &
+        clients+=($!)
+    done
+    wait "${clients[@]}"
+
+    # Let the sink see every close before stopping it, then collect the proxy report
+    sleep 0.5
+    if [ -n "$proxy_pid" ]; then
+        kill -INT $proxy_pid 2>/dev/null
+        wait $proxy_pid
+    fi
+    kill $sink_pid
+    wait $sink_pid 2>/dev/null
+
+    local gbps cpu p99
+    gbps=$(awk '/Rate:/ { sum += $6 } END { printf "%.3f", sum * 1.073741824 }' "$LOGS/sink.log")
+    cpu=$(awk '/^CPU:/ { gsub(",", ""); printf "%.3f", $3 + $6 }' "$LOGS/proxy.log" 2>/dev/null)
+    p99=$(awk '/^UpStream Residence:/ { for(i=1;i<=NF;i++) if($i == "p99:") print $(i+1) }' "$LOGS/proxy.log" 2>/dev/null)
+    echo "$mode,$send,$ring,$streams,$rep,$gbps,$cpu,$p99"
+}
+
+make -s -C "$PROXY_DIR" >&2 && make -s -C "$IPERF_DIR" >&2 || exit 1
+
+echo "mode,send_size,ring_size,streams,repeat,gbps,proxy_cpu_s,residence_p99_us"
+IFS=',' read -ra mode_list <<< "$MODES"
+for mode in "${mode_list[@]}"; do
+    rings=$RING_SIZES
+    [[ "$mode" == proxy* ]] || rings="-"
+    for send in $SEND_SIZES; do
+        for ring in $rings; do
+            for streams in $STREAMS; do
+                if [[ "$mode" == no_buf* && $streams -gt 1 ]]; then
+                    continue
+                fi
+                for rep in $(seq "$REPEATS"); do
+                    run_point "$mode" "$send" "$ring" "$streams" "$rep"
+                done
+            done
+        done
+    done
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -8,9 +9,22 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include "tune.h"
+#include "hist.h"
+#include "tcpinfo.h"
 
 #define MAX_EVENTS 10
 #define EPOLL_TIMEOUT_MILLIS 30000
@@ -30,196 +44,960 @@
 #define CLIENT_PORT 6201
 #define DURATION 10
 #define FREQUENCY 10
-#define MAX_SAMPLES DURATION * FREQUENCY
+#define ZEROCOPY_DRAIN_MILLIS 1000   // Wait for the last MSG_ZEROCOPY completions before reporting
+#define PACING_MAX_TICKS 1000        // Token bucket refills per TCP_INFO sample, bounds the timer rate
+#define TCPINFO_MAX_SAMPLES (1 << 22) // Bound of the -L ring, sized for the whole test below it
 
-unsigned long long total_data_sent = 0;
-int sample_counter = 0;
+/*How the payload reaches the socket (-m)*/
+enum send_mode{
+    SEND_COPY,                        // send() copies the buffer into the socket
+    SEND_ZEROCOPY,                    // send(MSG_ZEROCOPY) pins the buffer, completions come on the error queue
+    SEND_SENDFILE,                    // sendfile() from the payload file
+    SEND_SPLICE,                      // splice() from the payload file through a pipe
+};
+const char *send_mode_names[] = { "copy", "zerocopy", "sendfile", "splice" };
 
-uint32_t previous_reordering = 0;
-uint32_t previous_retransmits = 0;
+/*How a target rate (-R) is enforced (-K)*/
+enum pacing{
+    PACING_BUCKET,                    // Token bucket refilled on the sampling timer, sends stop when it is empty
+    PACING_FQ,                        // SO_MAX_PACING_RATE, paced by the kernel (fq qdisc or TCP internal pacing)
+};
+const char *pacing_names[] = { "bucket", "fq" };
 
-void print_tcp_info(int sockfd) {
+/*One TCP connection to the server*/
+struct stream_info{
+    int id;
+    int fd;
+    struct sockaddr_in addr;          // Local address, for the report
+    unsigned long long bytes_sent;
+    unsigned long long sends;
+    unsigned long long zerocopy_sends;     // Successful MSG_ZEROCOPY sends, each gets one completion
+    unsigned long long zerocopy_completed;
+    unsigned long long zerocopy_copied;    // Completions the kernel served by copying (e.g. loopback)
+    uint32_t previous_reordering;
+    uint32_t previous_total_retrans;
+    struct tcp_info info;             // Last TCP_INFO sample
+    unsigned long long interval_start; // bytes_sent at the start of the rate interval
+    double tokens;                    // Bytes the token bucket allows to send
+    int paused;                       // EPOLLOUT removed until the bucket is refilled or optmem is freed
+    int optmem_wait;                  // Paused by a zerocopy ENOBUFS until a completion is reaped
+    char *message;                    // Round-trip mode: message sent, followed by the echo being received
+    int unsent;                       // Bytes of the current message the socket did not take yet
+    int backlog;                      // Messages waiting for the current one to be sent, stamped when they start
+    int blocked;                      // EPOLLOUT watched besides EPOLLIN until the unsent bytes are taken
+    int received;                     // Bytes of the current echo received
+    unsigned long long round_trips;
+    latency_hist rtt;                 // Round-trip times in ns
+};
+
+/*Send thread, drives the streams with id % sender_count == its id*/
+struct sender{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int timer_fd;
+    int cpu;                          // CPU the thread is pinned to, -1 when not pinned
+    int sample_counter;
+    int ticks;                        // Timer expirations since the last sample, several per sample when pacing
+    int payload_pipe[2];              // splice() needs a pipe between the file and the socket
+    size_t pipe_pending;              // Payload left in the pipe by a short splice, goes to the next stream sent to
+};
+
+enum send_mode send_mode = SEND_COPY;
+char *buffer = NULL;                  // Payload of copy and zerocopy sends, shared read only by every thread
+int buffer_size = BUFFER_SIZE;
+int payload_fd = -1;                  // Payload file of sendfile/splice, a memfd unless -F is given
+int max_samples = 0;
+struct sockaddr_in server_addr, client_addr;
+const tune_profile *profile = NULL;
+struct stream_info *streams = NULL;
+int stream_count = 1;
+int sender_count = 1;
+double target_rate = 0;               // Bits per second per stream, 0 sends as fast as possible
+enum pacing pacing = PACING_BUCKET;
+int burst_size = 0;                   // Token bucket depth in bytes, defaults to the buffer size
+int ticks_per_sample = 1;             // Timer expirations per TCP_INFO sample
+double tick_tokens = 0;               // Bytes added to the bucket per timer expiration
+int message_size = 0;                 // Round-trip mode (-E): bytes per timestamped message, 0 for bulk sending
+int outstanding = 1;                  // Messages in flight per stream
+const char *tcpinfo_path = NULL;      // -L: TCP_INFO log, sampled off the send threads instead of printed
+tcpinfo_sampler sampler;
+
+/* Sample TCP_INFO of a stream and print it as a CSV line
+ * Arguments:
+ *   struct stream_info *s - stream to sample
+ *   int sample_counter    - samples taken so far, the time column
+ * Return Value:
+ *   None
+ */
+void print_tcp_info(struct stream_info *s, int sample_counter) {
     struct tcp_info info;
     socklen_t info_len = sizeof(info);
-    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
-        printf("%.3f,%u,%u,%u,%u,%u,%u,%u\n",sample_counter/(FREQUENCY*1.0),
+    if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+        char prefix[16] = "";
+        if(stream_count > 1){ // Keep the single stream output unchanged
+            snprintf(prefix, sizeof(prefix), "%d,", s->id);
+        }
+        printf("%s%.3f,%u,%u,%u,%u,%u,%u,%u\n",prefix,sample_counter/(FREQUENCY*1.0),
                                       info.tcpi_snd_cwnd, 
                                       info.tcpi_unacked,
-                                      info.tcpi_reordering - previous_reordering, 
-                                      info.tcpi_retransmits - previous_retransmits, 
+                                      info.tcpi_reordering - s->previous_reordering, 
+                                      info.tcpi_total_retrans - s->previous_total_retrans, 
                                       info.tcpi_lost,
                                       info.tcpi_rtt,
                                       info.tcpi_ca_state);
 
-        previous_reordering = info.tcpi_reordering;
-        previous_retransmits = info.tcpi_retransmits;  
+        s->previous_reordering = info.tcpi_reordering;
+        s->previous_total_retrans = info.tcpi_total_retrans; // tcpi_retransmits is not cumulative
+        s->info = info;
     } else {
         perror("Failed to get TCP info");
     }
 }
 
-int main(){
-    int client_fd = 0;
-    struct sockaddr_in server_addr,client_addr;
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 'A', BUFFER_SIZE);
+/* Open the file sendfile() and splice() read the payload from
+ * Arguments:
+ *   const char *path - file holding at least len bytes, NULL for a memfd filled with 'A' like the send buffer
+ *   size_t len       - bytes sent per call
+ * Return Value:
+ *   0 on success
+ *   -1 on error (reported on stderr)
+ */
+int payload_open(const char *path, size_t len){
+    if(path != NULL){
+        struct stat st;
+        payload_fd = open(path, O_RDONLY);
+        if(payload_fd < 0 || fstat(payload_fd, &st) != 0){
+            perror("Failed to Open the Payload File");
+            return -1;
+        }
+        if((size_t)st.st_size < len){
+            fprintf(stderr, "Payload File %s Is Shorter than the %zu B Sends\n", path, len);
+            return -1;
+        }
+    }
+    else{
+        char block[4096];
+        memset(block, 'A', sizeof(block));
+        payload_fd = memfd_create("iperf_payload", 0);
+        if(payload_fd < 0){
+            perror("Failed to Create the Payload memfd");
+            return -1;
+        }
+        for(size_t off = 0; off < len;){
+            ssize_t n = write(payload_fd, block, len - off < sizeof(block) ? len - off : sizeof(block));
+            if(n <= 0){
+                perror("Failed to Fill the Payload memfd");
+                return -1;
+            }
+            off += n;
+        }
+    }
+    return 0;
+}
 
-    /*Create client Socket*/
-    client_fd = socket(AF_INET,SOCK_STREAM,0);
-    if(client_fd < 0){
-        perror("Failed to Create Socket for Client");
+/* Stop or resume waiting for a stream to become writable
+ * Arguments:
+ *   struct sender *w      - thread driving the stream
+ *   struct stream_info *s - stream
+ *   int paused            - 1 once the token bucket is empty or optmem is exhausted, 0 to resume
+ * Return Value:
+ *   None
+ */
+void stream_pause(struct sender *w, struct stream_info *s, int paused){
+    struct epoll_event client_event;
+    client_event.events = paused ? 0 : EPOLLOUT; // EPOLLERR still reports zerocopy completions
+    client_event.data.ptr = s;
+    if(epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, s->fd, &client_event) != 0){
+        perror("Failed to Update Client Socket Events");
         exit(EXIT_FAILURE);
     }
+    s->paused = paused;
+}
 
-    server_addr.sin_family=AF_INET;
-    server_addr.sin_port=htons(SERVER_PORT);
-    if (inet_pton(AF_INET, SERVER_IP, &(server_addr.sin_addr)) <= 0) {
-        perror("Failed to convert IP address");
+/* Reap the MSG_ZEROCOPY completions queued on the socket error queue
+ * Arguments:
+ *   struct stream_info *s - stream with SO_ZEROCOPY set
+ * Return Value:
+ *   0 once the error queue is empty
+ *   -1 when it holds a real socket error, errno is set to it
+ */
+int zerocopy_reap(struct stream_info *s){
+    while(1){
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+            if(cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR){
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if(serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+                errno = serr.ee_errno;
+                return -1;
+            }
+            unsigned int completed = serr.ee_data - serr.ee_info + 1; // Notifications cover ranges of sends
+            s->zerocopy_completed += completed;
+            if(serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                s->zerocopy_copied += completed;
+            }
+        }
+    }
+}
+
+/* Send one buffer worth of payload with the selected mode
+ * Arguments:
+ *   struct sender *w      - thread sending, owns the splice pipe
+ *   struct stream_info *s - connected stream
+ *   size_t len            - bytes to send, at most buffer_size
+ * Return Value:
+ *   Bytes sent (possibly fewer than len)
+ *   0 when the socket buffer is full (EPOLLOUT reports when to retry) or a zerocopy send ran out of
+ *   optmem (the stream is paused until a completion is reaped)
+ *   -1 on error
+ * Note: the buffer is never modified, so pages pinned by zerocopy sends stay valid
+ */
+ssize_t transmit(struct sender *w, struct stream_info *s, size_t len){
+    ssize_t sent = -1;
+    off_t offset = 0;
+    s->sends++;
+    switch(send_mode){
+        case SEND_COPY:
+            sent = send(s->fd, buffer, len, 0);
+            break;
+        case SEND_ZEROCOPY:
+            sent = send(s->fd, buffer, len, MSG_ZEROCOPY);
+            if(sent >= 0){
+                s->zerocopy_sends++;
+            }
+            else if(errno == ENOBUFS){ // Too many sends pinned, wait for completions
+                if(zerocopy_reap(s) != 0){
+                    return -1;
+                }
+                if(s->zerocopy_completed == s->zerocopy_sends){ // Nothing left to free optmem
+                    errno = ENOBUFS;
+                    return -1;
+                }
+                s->optmem_wait = 1; // EPOLLOUT would fire right away, EPOLLERR reports the completions
+                stream_pause(w, s, 1);
+                return 0;
+            }
+            break;
+        case SEND_SENDFILE:
+            sent = sendfile(s->fd, payload_fd, &offset, len);
+            break;
+        case SEND_SPLICE:
+            if(w->pipe_pending == 0){ // Refill the pipe only once the last pass was drained
+                sent = splice(payload_fd, &offset, w->payload_pipe[1], NULL, len, SPLICE_F_MOVE);
+                if(sent <= 0){
+                    return -1;
+                }
+                w->pipe_pending = sent;
+            }
+            sent = splice(w->payload_pipe[0], NULL, s->fd, NULL, len < w->pipe_pending ? len : w->pipe_pending,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(sent > 0){
+                w->pipe_pending -= sent;
+            }
+            break;
+    }
+    if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return 0;
+    }
+    return sent;
+}
+
+/* Send the unsent part of the current message of a round-trip stream, then the messages queued behind it
+ * Arguments:
+ *   struct sender *w      - thread driving the stream
+ *   struct stream_info *s - connected stream
+ * Return Value:
+ *   0 on success, EPOLLOUT is watched while the socket buffer is full and removed once everything is sent
+ *   -1 on error
+ */
+int message_flush(struct sender *w, struct stream_info *s){
+    struct epoll_event client_event;
+    int blocked = 0;
+    while(s->unsent > 0 || s->backlog > 0){
+        if(s->unsent == 0){ // Stamped when it starts, the time it waited behind the previous one is not counted
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint64_t ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+            memcpy(s->message, &ns, sizeof(ns));
+            s->unsent = message_size;
+            s->backlog--;
+        }
+        ssize_t sent = send(s->fd, s->message + message_size - s->unsent, s->unsent, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                return -1;
+            }
+            blocked = 1;
+            break;
+        }
+        s->unsent -= sent;
+        s->bytes_sent += sent;
+        s->sends++;
+    }
+    if(blocked != s->blocked){
+        client_event.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        client_event.data.ptr = s;
+        if(epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, s->fd, &client_event) != 0){
+            return -1;
+        }
+        s->blocked = blocked;
+    }
+    return 0;
+}
+
+/* Send a message stamped with the current time on a round-trip stream
+ * Arguments:
+ *   struct sender *w      - thread driving the stream
+ *   struct stream_info *s - connected stream
+ * Return Value:
+ *   0 on success, the message is queued behind one the socket did not fully take yet
+ *   -1 on error
+ */
+int message_send(struct sender *w, struct stream_info *s){
+    s->backlog++;
+    if(s->unsent > 0){ // message_flush() continues on EPOLLOUT
+        return 0;
+    }
+    return message_flush(w, s);
+}
+
+/* Receive the echoes of a round-trip stream, record their round-trip time and send a message for each
+ * Arguments:
+ *   struct sender *w      - thread driving the stream
+ *   struct stream_info *s - connected stream
+ * Return Value:
+ *   0 once no more bytes are queued
+ *   -1 on error or when the server closed the connection
+ */
+int message_receive(struct sender *w, struct stream_info *s){
+    char *echo = s->message + message_size;
+    while(1){
+        ssize_t n = recv(s->fd, echo + s->received, message_size - s->received, MSG_DONTWAIT);
+        if(n == 0){
+            errno = ECONNRESET;
+            return -1;
+        }
+        if(n < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        s->received += n;
+        if(s->received < message_size){
+            continue;
+        }
+        /*Echoes come back in order, each starts with the time its message was sent*/
+        struct timespec now;
+        uint64_t sent_ns;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        memcpy(&sent_ns, echo, sizeof(sent_ns));
+        hist_record(&s->rtt, now.tv_sec * 1000000000ULL + now.tv_nsec - sent_ns, 1);
+        s->round_trips++;
+        s->received = 0;
+        if(message_send(w, s) != 0){
+            return -1;
+        }
+    }
+}
+
+/* Print the per stream lines when there are several, the totals, the send mode counters and the process CPU time
+ * Arguments:
+ *   double seconds - duration of the test
+ * Return Value:
+ *   None
+ * Note: waits for the last zerocopy completions of every stream
+ */
+void print_send_stats(double seconds){
+    unsigned long long total_data_sent = 0, sends = 0;
+    unsigned long long zerocopy_sends = 0, zerocopy_completed = 0, zerocopy_copied = 0, round_trips = 0;
+    static latency_hist rtt; // Too large for the stack
+    struct rusage usage;
+
+    printf("\n");
+    for(int i=0;i<stream_count;i++){
+        struct stream_info *s = &streams[i];
+        socklen_t info_len = sizeof(s->info);
+        getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &s->info, &info_len); // Not sampled by the send threads with -L
+        if(send_mode == SEND_ZEROCOPY){
+            struct pollfd pfd = { .fd = s->fd, .events = 0 }; // POLLERR is always reported
+            for(int waited = 0; s->zerocopy_completed < s->zerocopy_sends && waited < ZEROCOPY_DRAIN_MILLIS; waited += 10){
+                if(poll(&pfd, 1, 10) > 0 && zerocopy_reap(s) != 0){
+                    break;
+                }
+            }
+        }
+        total_data_sent += s->bytes_sent;
+        sends += s->sends;
+        zerocopy_sends += s->zerocopy_sends;
+        zerocopy_completed += s->zerocopy_completed;
+        zerocopy_copied += s->zerocopy_copied;
+        round_trips += s->round_trips;
+        hist_merge(&rtt, &s->rtt);
+        if(stream_count > 1){
+            double gb = s->bytes_sent/(1024*1024*1024.0);
+            printf("[%3d] %s:%d, Data Sent: %lf GB, Rate: %lf Gbps, Retransmits: %u, Rtt: %u us\n",
+                    s->id, inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port), gb, (gb*8)/seconds,
+                    s->info.tcpi_total_retrans, s->info.tcpi_rtt);
+            if(message_size > 0){
+                char label[32];
+                snprintf(label, sizeof(label), "[%3d] Round Trip: ", s->id);
+                hist_print(label, &s->rtt);
+            }
+        }
+    }
+    double gb = total_data_sent/(1024*1024*1024.0);
+    double rate = (gb*8)/seconds;
+    printf("%sTotal Data Sent: %lf GB, Rate: %lf Gbps\n", stream_count > 1 ? "[SUM] " : "", gb, rate);
+
+    printf("Send Mode: %s, Bytes Sent: %llu, Sends: %llu\n", send_mode_names[send_mode], total_data_sent, sends);
+    if(getrusage(RUSAGE_SELF, &usage) == 0){
+        double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        printf("CPU: User: %.3f s, System: %.3f s, Utilization: %.1f%%\n", user, sys,
+                seconds > 0 ? (user + sys) * 100 / seconds : 0.0);
+    }
+    if(message_size > 0){
+        printf("Round Trips: %llu, Rate: %.0f/s, Message Size: %d B, Outstanding: %d per Stream\n",
+                round_trips, round_trips / seconds, message_size, outstanding);
+        hist_print("Round Trip: ", &rtt);
+    }
+    if(send_mode == SEND_ZEROCOPY){
+        printf("Zerocopy Sends: %llu, Completions: %llu, Zero-Copied: %llu, Copied: %llu, Pending: %llu\n",
+                zerocopy_sends, zerocopy_completed, zerocopy_completed - zerocopy_copied, zerocopy_copied,
+                zerocopy_sends - zerocopy_completed);
+    }
+}
+
+/* Refill the token buckets of a thread's streams
+ * Arguments:
+ *   struct sender *w       - thread
+ *   uint64_t expirations   - timer expirations since the last refill
+ * Return Value:
+ *   None
+ */
+void sender_refill(struct sender *w, uint64_t expirations){
+    double depth = burst_size > tick_tokens ? burst_size : tick_tokens;
+    for(int i=w->id;i<stream_count;i+=sender_count){
+        struct stream_info *s = &streams[i];
+        s->tokens += expirations * tick_tokens;
+        if(s->tokens > depth){ // Unused time is not saved up beyond one burst
+            s->tokens = depth;
+        }
+        if(s->paused && !s->optmem_wait && s->tokens >= 1){
+            stream_pause(w, s, 0);
+        }
+    }
+}
+
+/* Print the rate each stream of a thread achieved over the last second against the target
+ * Arguments:
+ *   struct sender *w - thread
+ * Return Value:
+ *   None
+ */
+void print_interval_rates(struct sender *w){
+    double end = w->sample_counter / (FREQUENCY * 1.0);
+    for(int i=w->id;i<stream_count;i+=sender_count){
+        struct stream_info *s = &streams[i];
+        double mbps = (s->bytes_sent - s->interval_start) * 8 / 1e6;
+        printf("[%3d] %.1f-%.1f s: Rate: %.3f Mbps, Target: %.3f Mbps (%.1f%%)\n", s->id, end - 1, end,
+                mbps, target_rate / 1e6, mbps * 1e8 / target_rate);
+        s->interval_start = s->bytes_sent;
+    }
+}
+
+/* Open a stream to the server
+ * Arguments:
+ *   struct stream_info *s - stream to open (zeroed)
+ *   int id                - stream number, also the offset of its port in the client port range
+ * Return Value:
+ *   None, exits the process on error
+ * Note: the socket is non-blocking so a stream with a full send buffer does not stall the others of its thread
+ */
+void stream_open(struct stream_info *s, int id){
+    struct sockaddr_in local = client_addr;
+    socklen_t local_len = sizeof(local), err_len = sizeof(int);
+    struct pollfd pfd;
+    int one = 1, err = 0;
+
+    s->id = id;
+    s->fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
+    if(s->fd < 0){
+        perror("Failed to Create Socket for Client");
         exit(EXIT_FAILURE);
     }
-    
-    client_addr.sin_family=AF_INET;
-    client_addr.sin_port=htons(CLIENT_PORT);
-    if (inet_pton(AF_INET, CLIENT_IP, &(client_addr.sin_addr)) <= 0) {
-        perror("Failed to convert IP address");
+    tune_apply(s->fd, profile); // Before connect() so the window scale covers the buffers
+    if(send_mode == SEND_ZEROCOPY && setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0){
+        perror("Failed to Enable SO_ZEROCOPY");
+        exit(EXIT_FAILURE);
+    }
+    if(target_rate > 0 && pacing == PACING_FQ){
+        double bytes_per_second = target_rate / 8;
+        int err;
+        if(bytes_per_second < ~0U){
+            unsigned int rate = bytes_per_second;
+            err = setsockopt(s->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+        }
+        else{ // Rates above 4 GB/s need the 64 bit form
+            unsigned long rate = bytes_per_second;
+            err = setsockopt(s->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+        }
+        if(err != 0){
+            perror("Failed to Set SO_MAX_PACING_RATE");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->tokens = burst_size > tick_tokens ? burst_size : tick_tokens; // Start with a full bucket
+    if(message_size > 0){
+        s->message = calloc(2, message_size);
+        if(s->message == NULL){
+            perror("Failed to Allocate Messages");
+            exit(EXIT_FAILURE);
+        }
+        memset(s->message, 'A', message_size);
+    }
+    if(ntohs(client_addr.sin_port) != 0){ // One port of the range per stream, 0 leaves every port ephemeral
+        local.sin_port = htons(ntohs(client_addr.sin_port) + id);
+    }
+    if(bind(s->fd,(const struct sockaddr*)&local,sizeof(struct sockaddr_in))<0){
+        perror("Failed to Bind to Client");
+        exit(EXIT_FAILURE);
+    }
+    if(connect(s->fd,(const struct sockaddr*)&server_addr,sizeof(struct sockaddr_in))<0){
+        err = errno;
+        pfd.fd = s->fd;
+        pfd.events = POLLOUT;
+        while(err == EINPROGRESS){ // Wait for the handshake, it is bounded by the kernel SYN retries
+            if(poll(&pfd, 1, -1) > 0){
+                getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            }
+            else if(errno != EINTR){
+                err = errno;
+            }
+        }
+    }
+    if(err != 0){
+        errno = err;
+        perror("Failed to Connect to the Server");
         exit(EXIT_FAILURE);
     }
+    getsockname(s->fd, (struct sockaddr*)&s->addr, &local_len);
+    tcpinfo_watch(&sampler, s->fd, 0, id);
+}
 
+/* Create the epoll instance, timer and splice pipe of a send thread and register its streams
+ * Arguments:
+ *   struct sender *w - thread to set up
+ *   int id           - thread number, it drives the streams with id % sender_count == id
+ *   int cpu          - CPU to pin the thread to, -1 for none
+ * Return Value:
+ *   None, exits the process on error
+ */
+void sender_init(struct sender *w, int id, int cpu){
+    memset(w, 0, sizeof(struct sender));
+    w->id = id;
+    w->cpu = cpu;
+    w->payload_pipe[0] = w->payload_pipe[1] = -1;
 
     /*Creating epoll fd*/
-    int epoll_fd = epoll_create1(0);
-    if(epoll_fd == -1){
+    w->epoll_fd = epoll_create1(0);
+    if(w->epoll_fd == -1){
         perror("Failed to create epoll file descriptor\n");
         exit(EXIT_FAILURE);
     }
-    
-    /*Registering socket fd to epoll*/
-    struct epoll_event client_event; 
-    client_event.events = EPOLLOUT;
-    client_event.data.fd = client_fd;
-   
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event)!=0){
-        perror("Failed to Register Client Socket FD to Epoll");
-        close(client_fd);
-        close(epoll_fd);
-        exit(EXIT_FAILURE);
+
+    /*Registering socket fds to epoll*/
+    for(int i=id;i<stream_count;i+=sender_count){
+        struct epoll_event client_event;
+        client_event.events = message_size > 0 ? EPOLLIN : EPOLLOUT; // Round trips send as echoes arrive
+        client_event.data.ptr = &streams[i];
+        if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, streams[i].fd, &client_event)!=0){
+            perror("Failed to Register Client Socket FD to Epoll");
+            exit(EXIT_FAILURE);
+        }
     }
-    
-    int timer_fd = timerfd_create(CLOCK_REALTIME, 0);
 
+    w->timer_fd = timerfd_create(CLOCK_REALTIME, 0);
     struct epoll_event timer_event = {};
     //Configuring Event for Fd created
     timer_event.events=EPOLLIN | EPOLLET; //Edge Trigger Mode
-    timer_event.data.fd = timer_fd;
+    timer_event.data.ptr = NULL;
 
     //Registered timerfd to epfd for monitoring
-    if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,timer_fd,&timer_event)==-1)
+    if(w->timer_fd < 0 || epoll_ctl(w->epoll_fd,EPOLL_CTL_ADD,w->timer_fd,&timer_event)==-1)
     {
         perror("Failed to Register TimerFD to Epoll");
-	    close(client_fd);
-	    close(timer_fd);
-	    close(epoll_fd);
         exit(EXIT_FAILURE);
     }
 
-    struct timespec now = {};
-    //Get Current Epoch Time
-    if (clock_gettime(CLOCK_REALTIME, &(now)) == -1){
-        perror("Error in getting Clock");
-        close(client_fd);
-	    close(timer_fd);
-	    close(epoll_fd);
-        exit(EXIT_FAILURE);
+    if(send_mode == SEND_SPLICE){
+        if(pipe(w->payload_pipe) != 0){
+            perror("Failed to Create the Splice Pipe");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(w->payload_pipe[1], F_SETPIPE_SZ, buffer_size); // Best effort, transmit() splices at most the pipe size per pass
+    }
+}
+
+/*Event loop of one send thread, returns once the duration has elapsed*/
+void *sender_run(void *arg){
+    struct sender *w = arg;
+
+    if(w->cpu >= 0){
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(err != 0){
+            fprintf(stderr, "Failed to Pin Send Thread %d to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+        }
     }
 
     struct itimerspec timer_expiry = {};
     //Configuring Duration of timer
     timer_expiry.it_value.tv_sec = 0;
-    timer_expiry.it_value.tv_nsec = (1000000000.0/FREQUENCY);
+    timer_expiry.it_value.tv_nsec = (1000000000.0/FREQUENCY/ticks_per_sample);
     timer_expiry.it_interval.tv_sec = 0;
-    timer_expiry.it_interval.tv_nsec = (1000000000.0/FREQUENCY);
+    timer_expiry.it_interval.tv_nsec = (1000000000.0/FREQUENCY/ticks_per_sample);
 
-    if (timerfd_settime(timer_fd, 0, &timer_expiry,NULL) == -1)
+    if (timerfd_settime(w->timer_fd, 0, &timer_expiry,NULL) == -1)
     {
         perror("Failed to Start the Timer");
-        close(client_fd);
-	    close(timer_fd);
-	    close(epoll_fd);
-        exit(EXIT_FAILURE);
-
-    }
-    //printf("Registered client_fd and timer_fd to Epoll Successfully\n");
-    if(bind(client_fd,(const struct sockaddr*)&client_addr,sizeof(struct sockaddr_in))<0){
-        perror("Failed to Bind to Client");
         exit(EXIT_FAILURE);
     }
-
-    if(connect(client_fd,(const struct sockaddr*)&server_addr,sizeof(struct sockaddr_in))<0){
-        perror("Failed to Connect to the Server");
-        close(client_fd);
-	    close(timer_fd);
-	    close(epoll_fd);
-        exit(EXIT_FAILURE);
+    for(int j=w->id;message_size>0 && j<stream_count;j+=sender_count){
+        for(int k=0;k<outstanding;k++){
+            if(message_send(w, &streams[j]) != 0){
+                perror("Cannot Send any more Data to the Server");
+                exit(EXIT_FAILURE);
+            }
+        }
     }
-    printf("Time\tCwnd\tUnack\tReorder\tRetx\tLost\tRtt\tCA\n");
 
     /*Poll For Packets*/
     int event_count= 0;
     struct epoll_event events[MAX_EVENTS];
     while(1)
     {
-        event_count = epoll_wait(epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
+        event_count = epoll_wait(w->epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
         if(event_count == -1){
             perror("Error waiting for the evet");
         }
         for(int i=0;i<event_count;i++)
         {
-            int fd = events[i].data.fd;
-            if(fd==timer_fd)
+            struct stream_info *s = events[i].data.ptr;
+            if(s == NULL) // Timer
             {
-                uint64_t expirations;
-                read(timer_fd, &expirations, sizeof(expirations)); // Read to re-arm the timer
-                sample_counter++;
-                if(sample_counter==MAX_SAMPLES){
-                    print_tcp_info(client_fd);
-                    close(client_fd);
-                    close(timer_fd);
-                    close(epoll_fd);
-                    double gb = total_data_sent/(1024*1024*1024.0);
-                    double rate = (gb*8)/DURATION;
-                    printf("\nTotal Data Sent: %lf GB, Rate: %lf Gbps\n",gb,rate);
-                    return 0;
+                uint64_t expirations = 0;
+                read(w->timer_fd, &expirations, sizeof(expirations)); // Read to re-arm the timer
+                if(target_rate > 0 && pacing == PACING_BUCKET){
+                    sender_refill(w, expirations);
                 }
-                else{
-                    print_tcp_info(client_fd);
+                w->ticks += expirations;
+                if(w->ticks < ticks_per_sample){
+                    continue;
+                }
+                w->ticks = 0;
+                w->sample_counter++;
+                for(int j=w->id;tcpinfo_path==NULL && j<stream_count;j+=sender_count){
+                    print_tcp_info(&streams[j], w->sample_counter);
+                }
+                if(target_rate > 0 && w->sample_counter % FREQUENCY == 0){
+                    print_interval_rates(w);
+                }
+                if(w->sample_counter==max_samples){
+                    return NULL;
                 }
-                
             }
-            else if(fd==client_fd)
+            else if(message_size > 0)
             {
+                if(((events[i].events & EPOLLOUT) && message_flush(w, s) != 0) || message_receive(w, s) != 0){
+                    perror("Round Trip Failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else
+            {
+                if(send_mode == SEND_ZEROCOPY && (events[i].events & EPOLLERR) && !(events[i].events & EPOLLHUP) &&
+                   zerocopy_reap(s) == 0)
+                {
+                    events[i].events &= ~EPOLLERR; // Only completions were queued
+                    if(s->optmem_wait){
+                        s->optmem_wait = 0;
+                        if(target_rate == 0 || pacing != PACING_BUCKET || s->tokens >= 1){
+                            stream_pause(w, s, 0);
+                        }
+                    }
+                }
                 if((events[i].events & EPOLLHUP) || (events[i].events & EPOLLERR))
                 {
-                    close(client_fd);
-                    close(timer_fd);
-                    close(epoll_fd);
                     perror("Error on Server FD");
                     exit(EXIT_FAILURE);
                 }
-                else{
-                     int sent = send(client_fd, buffer, BUFFER_SIZE, 0);
-                     if(sent<=0){
+                else if((events[i].events & EPOLLOUT) && !s->paused){
+                     size_t len = buffer_size;
+                     if(target_rate > 0 && pacing == PACING_BUCKET && s->tokens < len){
+                        len = s->tokens;
+                     }
+                     int sent = transmit(w, s, len);
+                     if(sent<0){ // 0 only from a zerocopy send waiting for completions
                         perror("Cannot Send any more Data to the Server");
                         break;
                      }
-                     total_data_sent +=sent;
+                     s->bytes_sent +=sent;
+                     if(target_rate > 0 && pacing == PACING_BUCKET){
+                        s->tokens -= sent;
+                        if(s->tokens < 1){
+                            stream_pause(w, s, 1);
+                        }
+                     }
                 }
             }
         }
     }
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    const char *server_ip = SERVER_IP, *client_ip = CLIENT_IP;
+    int server_port = SERVER_PORT, client_port = CLIENT_PORT;
+    int duration = DURATION, first_cpu = -1, tcpinfo_hz = TCPINFO_HZ, opt;
+    const char *profile_path = NULL, *profile_name = NULL, *payload_path = NULL;
+    while((opt = getopt(argc, argv, "c:p:B:b:l:t:f:T:m:F:P:w:a:R:K:S:E:O:L:I:")) != -1){
+        switch(opt){
+            case 'c':
+                server_ip = optarg;
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'B':
+                client_ip = optarg;
+                break;
+            case 'b':
+                client_port = atoi(optarg);
+                break;
+            case 'l':
+                buffer_size = atoi(optarg);
+                break;
+            case 't':
+                duration = atoi(optarg);
+                break;
+            case 'f':
+                profile_path = optarg;
+                break;
+            case 'T':
+                profile_name = optarg;
+                break;
+            case 'm':
+                for(send_mode = SEND_COPY; send_mode <= SEND_SPLICE; send_mode++){
+                    if(strcmp(optarg, send_mode_names[send_mode]) == 0){
+                        break;
+                    }
+                }
+                if(send_mode > SEND_SPLICE){
+                    fprintf(stderr, "Unknown Send Mode \"%s\", Expected copy, zerocopy, sendfile or splice\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'F':
+                payload_path = optarg;
+                break;
+            case 'P':
+                stream_count = atoi(optarg);
+                break;
+            case 'w':
+                sender_count = atoi(optarg);
+                if(sender_count <= 0){
+                    sender_count = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'a':
+                first_cpu = atoi(optarg);
+                break;
+            case 'R':
+                target_rate = atof(optarg) * 1e6;
+                break;
+            case 'K':
+                if(strcmp(optarg, "bucket") == 0){
+                    pacing = PACING_BUCKET;
+                }
+                else if(strcmp(optarg, "fq") == 0){
+                    pacing = PACING_FQ;
+                }
+                else{
+                    fprintf(stderr, "Unknown Pacing \"%s\", Expected bucket or fq\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                burst_size = atoi(optarg);
+                break;
+            case 'E':
+                message_size = atoi(optarg);
+                if(message_size < (int)sizeof(uint64_t)){
+                    fprintf(stderr, "Messages Carry an %zu B Timestamp, Use -E %zu or More\n", sizeof(uint64_t), sizeof(uint64_t));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'O':
+                outstanding = atoi(optarg);
+                break;
+            case 'L':
+                tcpinfo_path = optarg;
+                break;
+            case 'I':
+                tcpinfo_hz = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c server_ip] [-p server_port] [-B client_ip] [-b client_port] [-l buffer_size] [-t seconds]\n"
+                                "          [-f profile_file -T profile] [-m copy|zerocopy|sendfile|splice] [-F payload_file]\n"
+                                "          [-P streams] [-w threads] [-a cpu] [-R mbps [-K bucket|fq] [-S burst_bytes]]\n"
+                                "          [-E message_size [-O outstanding]] [-L tcpinfo_log [-I hz]]\n"
+                                "  defaults: %s:%d from %s:%d, %d B sends for %d s (client_port 0 picks an ephemeral port)\n"
+                                "  -f/-T apply a socket tuning profile, [name] sections of \"option = value\" lines\n"
+                                "  -m send mode: copy (send), zerocopy (SO_ZEROCOPY + MSG_ZEROCOPY), sendfile or splice\n"
+                                "     from the payload file, by default a memfd filled like the send buffer\n"
+                                "  -P parallel streams, stream i binds client_port + i (default 1)\n"
+                                "  -w send threads the streams are spread over, 0 for one per online CPU (default 1)\n"
+                                "  -a pin send thread i to CPU cpu + i\n"
+                                "  -R pace every stream to mbps (decimal Mbit/s), the achieved rate is reported each second\n"
+                                "  -K pacing: bucket (default) is a token bucket refilled on the sampling timer,\n"
+                                "     fq sets SO_MAX_PACING_RATE and lets the kernel pace (fq qdisc or TCP internal pacing)\n"
+                                "  -S token bucket depth, the largest burst sent at once (default buffer_size)\n"
+                                "  -E round-trip mode against server_epoll -e: send timestamped messages of message_size bytes,\n"
+                                "     one more for every echo received, and report the round-trip percentiles\n"
+                                "  -O messages in flight per stream in round-trip mode (default 1)\n"
+                                "  -L sample TCP_INFO from a separate thread instead of printing it every %d ms, the samples\n"
+                                "     are written at exit as CSV, or raw records when the name ends in .bin\n"
+                                "  -I TCP_INFO samples per second and stream with -L (default %d)\n",
+                                argv[0], SERVER_IP, SERVER_PORT, CLIENT_IP, CLIENT_PORT, BUFFER_SIZE, DURATION,
+                                1000 / FREQUENCY, TCPINFO_HZ);
+                exit(EXIT_FAILURE);
+        }
+    }
+    profile = tune_select(profile_path, profile_name);
+    tune_print("", profile);
+    max_samples = duration * FREQUENCY;
+    buffer = malloc(buffer_size);
+    if(buffer == NULL || buffer_size <= 0 || max_samples <= 0 || stream_count <= 0){
+        fprintf(stderr, "Invalid buffer size, duration or stream count\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, 'A', buffer_size);
+    if((send_mode == SEND_SENDFILE || send_mode == SEND_SPLICE) && payload_open(payload_path, buffer_size) != 0){
+        exit(EXIT_FAILURE);
+    }
+    if(message_size > 0 && (send_mode != SEND_COPY || target_rate > 0 || outstanding <= 0)){
+        fprintf(stderr, "Round-Trip Mode Sends with send(), Without Pacing, and Needs at Least One Message in Flight\n");
+        exit(EXIT_FAILURE);
+    }
+    if(sender_count > stream_count){
+        sender_count = stream_count;
+    }
+    if(burst_size <= 0){
+        burst_size = buffer_size;
+    }
+    if(target_rate > 0 && pacing == PACING_BUCKET){
+        /*Refill at least once per burst so a refill fits in the bucket, within PACING_MAX_TICKS per sample*/
+        double sample_seconds = 1.0 / FREQUENCY;
+        ticks_per_sample = ceil(sample_seconds / (burst_size * 8 / target_rate));
+        if(ticks_per_sample > PACING_MAX_TICKS){
+            ticks_per_sample = PACING_MAX_TICKS;
+        }
+        tick_tokens = target_rate / 8 * sample_seconds / ticks_per_sample;
+    }
+    if(target_rate > 0){
+        printf("Pacing: %s, Target: %.3f Mbps per Stream", pacing_names[pacing], target_rate / 1e6);
+        if(pacing == PACING_BUCKET){
+            printf(", Burst: %d B, Refill: %.0f B every %.0f us", burst_size, tick_tokens, 1e6 / FREQUENCY / ticks_per_sample);
+        }
+        printf("\n");
+    }
+
+    server_addr.sin_family=AF_INET;
+    server_addr.sin_port=htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &(server_addr.sin_addr)) <= 0) {
+        perror("Failed to convert IP address");
+        exit(EXIT_FAILURE);
+    }
+    
+    client_addr.sin_family=AF_INET;
+    client_addr.sin_port=htons(client_port);
+    if (inet_pton(AF_INET, client_ip, &(client_addr.sin_addr)) <= 0) {
+        perror("Failed to convert IP address");
+        exit(EXIT_FAILURE);
+    }
+
+    if(tcpinfo_path != NULL){
+        /*Room for every sample of the test, each stream sampled tcpinfo_hz times a second, plus a second*/
+        unsigned long long capacity = tcpinfo_hz > 0 ? (unsigned long long)tcpinfo_hz * (duration + 1) * stream_count : 0;
+        if(tcpinfo_start(&sampler, tcpinfo_hz, capacity < TCPINFO_MAX_SAMPLES ? capacity : TCPINFO_MAX_SAMPLES) != 0){
+            exit(EXIT_FAILURE);
+        }
+    }
+    streams = calloc(stream_count, sizeof(struct stream_info));
+    struct sender *senders = calloc(sender_count, sizeof(struct sender));
+    if(streams == NULL || senders == NULL){
+        perror("Failed to Allocate Streams");
+        exit(EXIT_FAILURE);
+    }
+    for(int i=0;i<stream_count;i++){
+        stream_open(&streams[i], i);
+    }
+    int online = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int i=0;i<sender_count;i++){
+        sender_init(&senders[i], i, first_cpu >= 0 ? (first_cpu + i) % online : -1);
+    }
+    if(tcpinfo_path == NULL){
+        printf("%sTime\tCwnd\tUnack\tReorder\tRetx\tLost\tRtt\tCA\n", stream_count > 1 ? "Stream\t" : "");
+    }
+
+    for(int i=1;i<sender_count;i++){
+        if(pthread_create(&senders[i].thread, NULL, sender_run, &senders[i]) != 0){
+            perror("Failed to Start Send Thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sender_run(&senders[0]);
+    for(int i=1;i<sender_count;i++){
+        pthread_join(senders[i].thread, NULL);
+    }
+    print_send_stats(duration);
+    for(int i=0;i<stream_count;i++){
+        tcpinfo_unwatch(&sampler, streams[i].fd);
+    }
+    if(tcpinfo_path != NULL){
+        tcpinfo_stop(&sampler, tcpinfo_path);
+    }
+
     /*Making sure all FDs are closed*/
-    close(client_fd);
-    close(timer_fd);
-    /*Closing Epoll FD*/
-    close(epoll_fd);
+    for(int i=0;i<stream_count;i++){
+        close(streams[i].fd);
+        free(streams[i].message);
+    }
+    for(int i=0;i<sender_count;i++){
+        close(senders[i].timer_fd);
+        /*Closing Epoll FD*/
+        close(senders[i].epoll_fd);
+        if(senders[i].payload_pipe[0] >= 0){
+            close(senders[i].payload_pipe[0]);
+            close(senders[i].payload_pipe[1]);
+        }
+    }
+    free(senders);
+    free(streams);
+    free(buffer);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -8,196 +9,455 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <linux/tcp.h>
+#include <errno.h>
+#include <pthread.h>
+#include "tune.h"
 
-#define MAX_EVENTS 10
+#define MAX_EVENTS 64
 #define EPOLL_TIMEOUT_MILLIS 30000
-#define MAX_CLIENTS 25
+#define LISTEN_BACKLOG 1024
 #define BUFFER_SIZE 131072
+#define ZEROCOPY_MAP_SIZE (2 << 20)   // Receive window mapped per client in zerocopy mode, whole pages
 
 #define SERVER_IP "10.10.2.2"
 #define SERVER_PORT 5201
 
+/*One client stream, reached from its epoll event through data.ptr*/
 struct client_info{
     int fd;
     struct sockaddr_in addr;
     struct timespec start_time;
     unsigned long long bytes_received;
+    struct client_info *next_free;    // Closed records are kept for the next client
+    void *zc_addr;                    // TCP_ZEROCOPY_RECEIVE mapping, NULL when receiving with recv()
+    unsigned long long zc_mapped;     // Bytes of bytes_received mapped instead of discarded
+    char *echo_buffer;                // Echo mode: bytes received but not yet sent back, kept with the record
+    int echo_len;
+    int echo_off;                     // Already sent back
 };
 
-struct client_info client_history[MAX_CLIENTS];
-int next_client_id = 0;
+/*How received bytes are consumed (-z)*/
+enum sink_mode{
+    SINK_COPY,                        // recv() into the thread buffer
+    SINK_TRUNC,                       // recv(MSG_TRUNC), the kernel discards without copying
+    SINK_ZEROCOPY,                    // Pages mapped with TCP_ZEROCOPY_RECEIVE, unmappable bytes discarded
+};
+const char *sink_mode_names[] = { "copy", "trunc", "zerocopy" };
 
+/*Receive thread with its own SO_REUSEPORT listener, epoll instance and receive buffer*/
+struct sink_worker{
+    int id;
+    pthread_t thread;
+    int server_fd;
+    int epoll_fd;
+    char *buffer;
+    struct client_info *free_clients;
+    int active_clients;
+};
 
-int get_index_from_fd(int fd){
-    int index=0;
-    for(;index<next_client_id;index++){
-        if(client_history[index].fd==fd){
-            break;
-        }
-    }
-    if(index==next_client_id)
-    {
-        return -1;
-    }
-    return index;
-}
+struct sockaddr_in server_addr;
+const tune_profile *profile = NULL;
+int buffer_size = BUFFER_SIZE;
+enum sink_mode sink_mode = SINK_COPY;
+int echo = 0;                         // Send every byte back instead of sinking it (-e)
 
-void stats(int client_id){
-    printf("Stats for connection from %s:%d\n",
-            inet_ntoa(client_history[client_id].addr.sin_addr),
-            ntohs(client_history[client_id].addr.sin_port));
-    
+void stats(struct client_info *client){
     struct timespec now = {};
     //Get Current Epoch Time
     if (clock_gettime(CLOCK_REALTIME, &(now)) == -1){
         perror("Error Getting Current Time in Stats");
         return;
     }
-    
-    double time_taken = now.tv_sec - client_history[client_id].start_time.tv_sec;
-    double mb = client_history[client_id].bytes_received/ (1024*1024*1024.0);
-    printf("Data Transfered: %lf GB, Rate: %lf Gbps, Duration: %lf s\n",
+
+    double time_taken = (now.tv_sec - client->start_time.tv_sec) +
+                        (now.tv_nsec - client->start_time.tv_nsec) / 1e9;
+    double mb = client->bytes_received/ (1024*1024*1024.0);
+    /*Single call so the lines of concurrent receive threads do not interleave*/
+    printf("Stats for connection from %s:%d\n"
+           "Data Transfered: %lf GB, Rate: %lf Gbps, Duration: %lf s\n",
+            inet_ntoa(client->addr.sin_addr),ntohs(client->addr.sin_port),
             mb,(mb*8)/(time_taken),time_taken);
 }
 
-int main(){
-    int server_fd = 0;
-    struct sockaddr_in server_addr;
+/*Report the first zerocopy fallback only, every client would hit the same one*/
+void zerocopy_fallback(const char *msg){
+    static int reported = 0;
+    if(!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)){
+        perror(msg);
+    }
+}
+
+/*Map a receive window on a client socket, the client is discarded with MSG_TRUNC when it cannot be mapped*/
+void zerocopy_open(struct client_info *client){
+    client->zc_addr = mmap(NULL, ZEROCOPY_MAP_SIZE, PROT_READ, MAP_SHARED, client->fd, 0);
+    if(client->zc_addr == MAP_FAILED){
+        client->zc_addr = NULL;
+        zerocopy_fallback("TCP_ZEROCOPY_RECEIVE Unavailable, Discarding with MSG_TRUNC");
+    }
+}
+
+/*Receive without copying into user space
+  Returns the bytes consumed, 0 on EOF, -1 with errno set (EAGAIN once drained)*/
+ssize_t sink_recv(struct sink_worker *w, struct client_info *client){
+    if(client->zc_addr != NULL){
+        struct tcp_zerocopy_receive zc;
+        socklen_t zc_len = sizeof(zc);
+        memset(&zc, 0, sizeof(zc));
+        zc.address = (uintptr_t)client->zc_addr;
+        zc.length = ZEROCOPY_MAP_SIZE; // Pages mapped by the previous call are replaced
+        if(getsockopt(client->fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len) != 0){
+            zerocopy_fallback("TCP_ZEROCOPY_RECEIVE Failed, Discarding with MSG_TRUNC");
+            munmap(client->zc_addr, ZEROCOPY_MAP_SIZE);
+            client->zc_addr = NULL;
+        }
+        else if(zc.err != 0){
+            errno = zc.err;
+            return -1;
+        }
+        else if(zc.length > 0 || zc.recv_skip_hint > 0){
+            ssize_t consumed = zc.length;
+            client->zc_mapped += zc.length;
+            if(zc.recv_skip_hint > 0){ // Bytes not on whole pages, MSG_TRUNC never copies so the length may exceed the buffer
+                ssize_t skipped = recv(client->fd, w->buffer, zc.recv_skip_hint, MSG_TRUNC);
+                if(skipped > 0){
+                    consumed += skipped;
+                }
+            }
+            return consumed;
+        }
+        // Nothing queued: the recv() below reports EAGAIN or EOF
+    }
+    return recv(client->fd, w->buffer, buffer_size, sink_mode == SINK_COPY ? 0 : MSG_TRUNC);
+}
 
-    /*Create Server Socket*/
-    server_fd = socket(AF_INET,SOCK_STREAM,0);
+/*Create a non-blocking listener on server_addr, every receive thread binds its own*/
+int listener_open(){
+    int server_fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
     if(server_fd < 0){
         perror("Failed to Create Socket for Server");
         exit(EXIT_FAILURE);
     }
 
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("setsockopt failed");
         exit(EXIT_FAILURE);
     }
 
-    server_addr.sin_family=AF_INET;
-    server_addr.sin_port=htons(SERVER_PORT);
-    if (inet_pton(AF_INET, SERVER_IP, &(server_addr.sin_addr)) <= 0) {
-        perror("Failed to convert IP address");
-        exit(EXIT_FAILURE);
-    }
-
     if(bind(server_fd,(const struct sockaddr*)&server_addr,sizeof(struct sockaddr_in))<0){
         perror("Failed to Bind to Server");
         exit(EXIT_FAILURE);
     }
-    
-    if(listen(server_fd,1) != 0){
+    tune_apply(server_fd, profile); // Inherited by accepted sockets
+
+    if(listen(server_fd,LISTEN_BACKLOG) != 0){
         perror("Listen Failure");
         exit(EXIT_FAILURE);
     }
-    printf("Waiting for the Client Connection...\n");
-    
-    /*Creating epoll fd*/
-    int epoll_fd = epoll_create1(0);
-    if(epoll_fd == -1){
-        perror("Failed to create epoll file descriptor\n");
-        exit(EXIT_FAILURE);
+    return server_fd;
+}
+
+/*Accept every pending client, records of closed clients are reused*/
+void accept_clients(struct sink_worker *w){
+    while(1){
+        struct sockaddr_in client_addr;
+        memset(&client_addr, 0, sizeof(client_addr));
+        socklen_t client_addr_size = sizeof(client_addr);
+        int client_fd = accept4(w->server_fd,(struct sockaddr*)&client_addr,&client_addr_size,SOCK_NONBLOCK);
+        if(client_fd<0)
+        {
+            if(errno == ECONNABORTED || errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                perror("Server Failed to Accept the Client Connection");
+            }
+            return;
+        }
+        tune_apply(client_fd, profile);
+
+        struct client_info *client = w->free_clients;
+        if(client != NULL){
+            w->free_clients = client->next_free;
+        }
+        else if((client = malloc(sizeof(struct client_info))) == NULL){
+            perror("Failed to Allocate Client Record");
+            close(client_fd);
+            continue;
+        }
+        char *echo_buffer = client->echo_buffer;
+        memset(client, 0, sizeof(struct client_info));
+        client->echo_buffer = echo_buffer;
+        if(echo && client->echo_buffer == NULL && (client->echo_buffer = malloc(buffer_size)) == NULL){
+            perror("Failed to Allocate Echo Buffer");
+            close(client_fd);
+            free(client);
+            continue;
+        }
+        client->fd = client_fd;
+        memcpy(&client->addr, &client_addr, sizeof(client_addr));
+        if(sink_mode == SINK_ZEROCOPY){
+            zerocopy_open(client);
+        }
+        printf("New connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        clock_gettime(CLOCK_REALTIME, &(client->start_time));
+
+        struct epoll_event client_event;
+        client_event.events = EPOLLIN | EPOLLET; // Drained until EAGAIN on every event
+        if(echo){
+            client_event.events |= EPOLLOUT; // Resumes an echo the send buffer had no room for
+        }
+        client_event.data.ptr = client;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event) == -1) {
+            perror("Error Adding Client Socket to Epoll");
+            if(client->zc_addr != NULL){
+                munmap(client->zc_addr, ZEROCOPY_MAP_SIZE);
+            }
+            close(client_fd);
+            client->next_free = w->free_clients;
+            w->free_clients = client;
+            continue;
+        }
+        w->active_clients++;
     }
-    /*Registering socket fd to epoll*/
-    struct epoll_event server_event; 
-    server_event.events = EPOLLIN;
-    server_event.data.fd = server_fd;
-   
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &server_event)!=0){
-        perror("Failed to Register Server Socket FD to Epoll");
-        close(server_fd);
-        close(epoll_fd);
-        exit(EXIT_FAILURE);
+}
+
+/*Close a client after EOF (bytes_received 0) or an error, report it and keep its record for the next one*/
+void close_client(struct sink_worker *w, struct client_info *client, ssize_t bytes_received){
+    if (bytes_received == 0) {
+        printf("Connection closed by client\n");
+    } else {
+        perror("Error receiving data for client\n");
     }
+    close(client->fd); // Also removes it from the epoll instance
+    stats(client);
+    if(sink_mode != SINK_COPY){
+        printf("Sink: %s, Mapped: %llu B, Discarded: %llu B\n", client->zc_addr != NULL ? "zerocopy" : "trunc",
+                client->zc_mapped, client->bytes_received - client->zc_mapped);
+    }
+    if(client->zc_addr != NULL){
+        munmap(client->zc_addr, ZEROCOPY_MAP_SIZE);
+    }
+    client->next_free = w->free_clients;
+    w->free_clients = client;
+    w->active_clients--;
+}
 
-    printf("Registered server_fd to Epoll Successfully\n");
+/*Read a client until EAGAIN, closes it on EOF or error*/
+void receive_client(struct sink_worker *w, struct client_info *client){
+    while(1){
+        ssize_t bytes_received = sink_recv(w, client);
+        if(bytes_received > 0){
+            client->bytes_received += bytes_received;
+            continue;
+        }
+        if(bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(bytes_received < 0 && errno == EINTR){
+            continue;
+        }
+        close_client(w, client, bytes_received);
+        return;
+    }
+}
+
+/*Send a client its bytes back until either direction would block, closes it on EOF or error*/
+void echo_client(struct sink_worker *w, struct client_info *client){
+    while(1){
+        if(client->echo_off < client->echo_len){
+            ssize_t sent = send(client->fd, client->echo_buffer + client->echo_off,
+                                client->echo_len - client->echo_off, MSG_NOSIGNAL);
+            if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                return; // EPOLLOUT resumes, reading waits so the client feels the back pressure
+            }
+            if(sent < 0 && errno != EINTR){
+                close_client(w, client, sent);
+                return;
+            }
+            client->echo_off += sent > 0 ? sent : 0;
+            continue;
+        }
+        ssize_t bytes_received = recv(client->fd, client->echo_buffer, buffer_size, 0);
+        if(bytes_received > 0){
+            client->bytes_received += bytes_received;
+            client->echo_len = bytes_received;
+            client->echo_off = 0;
+            continue;
+        }
+        if(bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(bytes_received < 0 && errno == EINTR){
+            continue;
+        }
+        close_client(w, client, bytes_received);
+        return;
+    }
+}
+
+/*Event loop of one receive thread*/
+void *sink_worker_run(void *arg){
+    struct sink_worker *w = arg;
 
     /*Poll For Packets*/
     int event_count= 0;
     struct epoll_event events[MAX_EVENTS];
     while(1)
     {
-        event_count = epoll_wait(epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
+        event_count = epoll_wait(w->epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
         if(event_count == -1){
-            perror("Error waiting for the evet");
+            if(errno != EINTR){
+                perror("Error waiting for the evet");
+            }
+            continue;
         }
         for(int i=0;i<event_count;i++)
         {
-            int fd = events[i].data.fd;
-            if(fd==server_fd)
+            struct client_info *client = events[i].data.ptr;
+            if(client == NULL) // Listener
             {
                 if((events[i].events & EPOLLHUP) || (events[i].events & EPOLLERR))
                 {
-                    close(server_fd);
-                    close(epoll_fd);
                     perror("Error on Server FD");
                     exit(EXIT_FAILURE);
                 }
-                else{
-                    struct sockaddr_in client_addr;
-                    memset(&client_addr, 0, sizeof(client_addr));
-                    socklen_t client_addr_size = sizeof(client_addr);
-                    int client_fd = accept(server_fd,(struct sockaddr*)&client_addr,&client_addr_size);
-                    if(client_fd<0)
-                    {
-                        perror("Server Failed to Accept the Client Connection");
-                        continue;
-                    } 
-                    client_history[next_client_id].fd = client_fd;
-                    memcpy(&client_history[next_client_id].addr, &client_addr, sizeof(client_addr));
-                    printf("New connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-                    
-                    if (clock_gettime(CLOCK_REALTIME, &(client_history[next_client_id].start_time)) == -1){
-                        perror("Error in getting Clock");
-                        close(client_fd);
-                        continue;
-                    }
-
-                    struct epoll_event client_event;
-                    client_event.events = EPOLLIN | EPOLLET;
-                    client_event.data.fd = client_fd;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event) == -1) {
-                        perror("Error Adding Client Socket to Epoll");
-                        close(client_fd);
-                        continue;
-                    }
-                    client_history[next_client_id].bytes_received = 0; 
-                    next_client_id++;
-                }
+                accept_clients(w);
+            }
+            else if(echo){
+                echo_client(w, client);
             }
             else{
-                int client_id = get_index_from_fd(fd);
-                if(client_id==-1){
-                    perror("Client Record Missing for this FD");
-                    continue;
+                receive_client(w, client);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*Create the listener, epoll instance and receive buffer of a thread*/
+void sink_worker_init(struct sink_worker *w, int id){
+    memset(w, 0, sizeof(struct sink_worker));
+    w->id = id;
+    w->server_fd = listener_open();
+    w->buffer = malloc(buffer_size); // One per thread, reused by all of its clients
+    if(w->buffer == NULL){
+        fprintf(stderr, "Invalid buffer size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*Creating epoll fd*/
+    w->epoll_fd = epoll_create1(0);
+    if(w->epoll_fd == -1){
+        perror("Failed to create epoll file descriptor\n");
+        exit(EXIT_FAILURE);
+    }
+    /*Registering socket fd to epoll*/
+    struct epoll_event server_event;
+    server_event.events = EPOLLIN;
+    server_event.data.ptr = NULL;
+    if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->server_fd, &server_event)!=0){
+        perror("Failed to Register Server Socket FD to Epoll");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]){
+    const char *server_ip = SERVER_IP;
+    int server_port = SERVER_PORT, thread_count = 1, flag;
+    const char *profile_path = NULL, *profile_name = NULL;
+    while((flag = getopt(argc, argv, "B:p:l:f:T:w:z:e")) != -1){
+        switch(flag){
+            case 'B':
+                server_ip = optarg;
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'l':
+                buffer_size = atoi(optarg);
+                break;
+            case 'f':
+                profile_path = optarg;
+                break;
+            case 'T':
+                profile_name = optarg;
+                break;
+            case 'z':
+                if(strcmp(optarg, "trunc") == 0){
+                    sink_mode = SINK_TRUNC;
                 }
-                char buffer[BUFFER_SIZE];
-                int bytes_received = recv(fd, buffer, BUFFER_SIZE, 0);
-                if (bytes_received <= 0) {
-                    if (bytes_received == 0) {
-                        printf("Connection closed by client\n");
-                    } else {
-                        perror("Error receiving data for client\n");
-
-                    }
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-                    close(fd);
-                    stats(client_id);
-                    memset(&(client_history[client_id]), 0, sizeof(struct client_info));
-                } else {
-                    client_history[client_id].bytes_received += bytes_received;
+                else if(strcmp(optarg, "zerocopy") == 0){
+                    sink_mode = SINK_ZEROCOPY;
                 }
-            }
+                else{
+                    fprintf(stderr, "Unknown Sink Mode \"%s\", Expected zerocopy or trunc\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                echo = 1;
+                break;
+            case 'w':
+                thread_count = atoi(optarg);
+                if(thread_count <= 0){
+                    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-B server_ip] [-p server_port] [-l buffer_size] [-f profile_file -T profile] [-w threads]\n"
+                                "       [-z zerocopy|trunc | -e]\n"
+                                "  defaults: %s:%d, %d B receives\n"
+                                "  -f/-T apply a socket tuning profile, [name] sections of \"option = value\" lines\n"
+                                "  -w receive threads with their own listener, 0 for one per online CPU (default 1)\n"
+                                "  -z count bytes without copying them: zerocopy maps the payload with TCP_ZEROCOPY_RECEIVE\n"
+                                "     (bytes off page boundaries and unsupported sockets fall back to trunc),\n"
+                                "     trunc discards in the kernel with recv(MSG_TRUNC)\n"
+                                "  -e echo every byte back to the client, for the round-trip mode of client_epoll (-E)\n",
+                                argv[0], SERVER_IP, SERVER_PORT, BUFFER_SIZE);
+                exit(EXIT_FAILURE);
         }
     }
-    
-    /*Making sure all FDs are closed*/
-    close(server_fd);
+    profile = tune_select(profile_path, profile_name);
+    tune_print("", profile);
+    if(echo && sink_mode != SINK_COPY){
+        fprintf(stderr, "-e Echoes the Bytes Received, It Cannot Be Combined with -z\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Sink Mode: %s\n", echo ? "echo" : sink_mode_names[sink_mode]);
+    if(buffer_size <= 0){
+        fprintf(stderr, "Invalid buffer size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_family=AF_INET;
+    server_addr.sin_port=htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &(server_addr.sin_addr)) <= 0) {
+        perror("Failed to convert IP address");
+        exit(EXIT_FAILURE);
+    }
+
+    /*Every thread listens on the same port, the kernel spreads the clients across them*/
+    struct sink_worker *workers = calloc(thread_count, sizeof(struct sink_worker));
+    if(workers == NULL){
+        perror("Failed to Allocate Receive Threads");
+        exit(EXIT_FAILURE);
+    }
+    for(int i=0;i<thread_count;i++){
+        sink_worker_init(&workers[i], i);
+    }
+    printf("Waiting for the Client Connection...\n");
+    printf("Registered server_fd to Epoll Successfully\n");
 
-    /*Closing Epoll FD*/
-    close(epoll_fd);
+    for(int i=1;i<thread_count;i++){
+        if(pthread_create(&workers[i].thread, NULL, sink_worker_run, &workers[i]) != 0){
+            perror("Failed to Start Receive Thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sink_worker_run(&workers[0]); // Serves until the process is killed
     return 0;
 }
@@ -1,5 +1,82 @@
+#define _GNU_SOURCE
 #include "cbuf.h"
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+/* CLOCK_MONOTONIC time in nanoseconds */
+static unsigned long long cb_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Timestamp a push for residence times
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t n            - bytes pushed
+ * Return Value:
+ *   None
+ */
+static void cb_mark_push(circular_buffer *cb, size_t n){
+    if (cb->residence == NULL || n == 0){
+        return;
+    }
+    cb->pushed += n;
+    if (cb->mark_cnt == CB_MARKS){ // Out of marks: the newest one covers these bytes too (overestimates them)
+        cb->marks[(cb->mark_head + CB_MARKS - 1) % CB_MARKS].end = cb->pushed;
+        return;
+    }
+    cb_mark *m = &cb->marks[(cb->mark_head + cb->mark_cnt) % CB_MARKS];
+    m->end = cb->pushed;
+    m->ns = cb_now_ns();
+    cb->mark_cnt++;
+}
+
+/* Record the residence time of popped bytes, one histogram update per push they came from
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t n            - bytes popped
+ * Return Value:
+ *   None
+ */
+static void cb_mark_pop(circular_buffer *cb, size_t n){
+    if (cb->residence == NULL || n == 0){
+        return;
+    }
+    unsigned long long now = cb_now_ns();
+    unsigned long long popped = cb->popped + n;
+    while (cb->mark_cnt > 0 && cb->popped < popped){
+        cb_mark *m = &cb->marks[cb->mark_head];
+        unsigned long long upto = MIN(m->end, popped);
+        hist_record(cb->residence, now - m->ns, upto - cb->popped);
+        cb->popped = upto;
+        if (upto == m->end){ // Push fully popped
+            cb->mark_head = (cb->mark_head + 1) % CB_MARKS;
+            cb->mark_cnt--;
+        }
+    }
+    cb->popped = popped;
+}
+
+/* Enable or disable residence time recording
+ * Arguments:
+ *   circular_buffer *cb    - reference to the circular buffer (should be empty)
+ *   latency_hist *residence - histogram fed on every pop, NULL to disable
+ * Return Value:
+ *   None
+ */
+void cb_residence_init(circular_buffer *cb, latency_hist *residence){
+    cb->residence = residence;
+    cb->pushed = 0;
+    cb->popped = 0;
+    cb->mark_head = 0;
+    cb->mark_cnt = 0;
+}
 
 /* Initialize the circular buffer
  * Arguments:
@@ -18,8 +95,256 @@ int cb_init(circular_buffer *cb, size_t capacity){
     cb->sidx = 0;
     cb->eidx = 0;
     cb->full = 0;
+    cb->mirror = 0;
+    cb->max_cap = capacity;
+    cb->pool = NULL;
+    cb->chunks = NULL;
+    cb->reserved = 0;
+    cb_residence_init(cb, NULL);
+
+    return CB_SUCCESS;
+}
+
+/* Initialize the circular buffer with the mirror-mapped backend
+ * The same memory is mapped twice back-to-back, so a span starting anywhere
+ * in the first mapping can run past its end into the second one.
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t capacity     - requested capacity, rounded up to a multiple of page size
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error
+ */
+int cb_init_mirror(circular_buffer *cb, size_t capacity){
+    size_t page = sysconf(_SC_PAGESIZE);
+    capacity = ((capacity + page - 1) / page) * page;
+
+    int fd = memfd_create("circular_buffer", MFD_CLOEXEC);
+    if (fd < 0){
+        return CB_MEMORY_ERROR;
+    }
+    if (ftruncate(fd, capacity) != 0){
+        close(fd);
+        return CB_MEMORY_ERROR;
+    }
+
+    // Reserve twice the address space, then map the memfd over both halves
+    void *base = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED){
+        close(fd);
+        return CB_MEMORY_ERROR;
+    }
+    if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED){
+        munmap(base, 2 * capacity);
+        close(fd);
+        return CB_MEMORY_ERROR;
+    }
+    close(fd); // Mappings keep the memory alive
+
+    cb->buffer = base;
+    cb->sidx = 0;
+    cb->eidx = 0;
+    cb->full = 0;
+    cb->mirror = 1;
     cb->max_cap = capacity;
+    cb->pool = NULL;
+    cb->chunks = NULL;
+    cb->reserved = 0;
+    cb_residence_init(cb, NULL);
+
+    return CB_SUCCESS;
+}
+
+/* Initialize the circular buffer with the pooled backend
+ * No memory is held up front: CB_CHUNK_SIZE chunks are taken from the pool as
+ * data backs up and given back as soon as the data in them has been popped.
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t capacity     - requested capacity, rounded up to a multiple of CB_CHUNK_SIZE
+ *   cb_pool *pool       - pool initialized by cb_pool_init(), used by this thread only
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error
+ */
+int cb_init_pooled(circular_buffer *cb, size_t capacity, cb_pool *pool){
+    size_t chunks = (capacity + CB_CHUNK_SIZE - 1) / CB_CHUNK_SIZE;
+    cb->chunks = calloc(MAX(chunks, 1), sizeof(void *));
+    if (cb->chunks == NULL){
+        return CB_MEMORY_ERROR;
+    }
+
+    cb->buffer = NULL;
+    cb->sidx = 0;
+    cb->eidx = 0;
+    cb->full = 0;
+    cb->mirror = 0;
+    cb->max_cap = MAX(chunks, 1) * CB_CHUNK_SIZE;
+    cb->pool = pool;
+    cb->reserved = 0;
+    cb_residence_init(cb, NULL);
+
+    return CB_SUCCESS;
+}
+
+/* Take a chunk from the pool
+ * Arguments:
+ *   cb_pool *pool - pool to take from
+ * Return Value:
+ *   Chunk of CB_CHUNK_SIZE bytes
+ *   NULL with errno set to ENOBUFS when the slab is exhausted, the buffer stops growing
+ */
+static void *cb_chunk_get(cb_pool *pool){
+    if (pool->free_cnt == 0){
+        pool->exhausted++;
+        errno = ENOBUFS;
+        return NULL;
+    }
+    void *chunk = pool->free_chunks[--pool->free_cnt];
+    pool->in_use++;
+    if (pool->in_use > pool->peak){
+        pool->peak = pool->in_use;
+    }
+    return chunk;
+}
+
+/* Give a chunk back to the pool it was taken from
+ * Arguments:
+ *   cb_pool *pool - pool the chunk came from
+ *   void *chunk   - chunk returned by cb_chunk_get()
+ * Return Value:
+ *   None
+ */
+static void cb_chunk_put(cb_pool *pool, void *chunk){
+    pool->in_use--;
+    pool->free_chunks[pool->free_cnt++] = chunk;
+}
+
+/* Check whether a circular range of the buffer overlaps a chunk
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t chunk        - chunk index
+ *   size_t start        - first index of the range
+ *   size_t len          - length of the range (at most max_cap)
+ * Return Value:
+ *   1 when they overlap, 0 otherwise
+ */
+static int cb_range_in_chunk(circular_buffer *cb, size_t chunk, size_t start, size_t len){
+    size_t chunk_start = chunk * CB_CHUNK_SIZE;
+    if (len == 0){
+        return 0;
+    }
+    return (chunk_start + cb->max_cap - start) % cb->max_cap < len ||
+           (start + cb->max_cap - chunk_start) % cb->max_cap < CB_CHUNK_SIZE;
+}
+
+/* Return the chunks of a pooled circular buffer holding neither data nor reserved free space
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ * Return Value:
+ *   None
+ */
+static void cb_trim(circular_buffer *cb){
+    size_t used_cp = cb_used_cp(cb);
+    for (size_t i = 0; i < cb->max_cap / CB_CHUNK_SIZE; i++){
+        if (cb->chunks[i] != NULL &&
+            !cb_range_in_chunk(cb, i, cb->sidx, used_cp) &&
+            !cb_range_in_chunk(cb, i, cb->eidx, cb->reserved)){
+            cb_chunk_put(cb->pool, cb->chunks[i]);
+            cb->chunks[i] = NULL;
+        }
+    }
+}
+
+/* Release the memory held by the circular buffer
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ * Return Value:
+ *   None
+ */
+void cb_destroy(circular_buffer *cb){
+    if (cb->pool != NULL){
+        for (size_t i = 0; i < cb->max_cap / CB_CHUNK_SIZE; i++){
+            if (cb->chunks[i] != NULL){
+                cb_chunk_put(cb->pool, cb->chunks[i]);
+            }
+        }
+        free(cb->chunks);
+    }
+    else if (cb->mirror){
+        munmap(cb->buffer, 2 * cb->max_cap);
+    }
+    else{
+        free(cb->buffer);
+    }
+    cb->buffer = NULL;
+    cb->sidx = 0;
+    cb->eidx = 0;
+    cb->full = 0;
+    cb->mirror = 0;
+    cb->max_cap = 0;
+    cb->pool = NULL;
+    cb->chunks = NULL;
+    cb->reserved = 0;
+    cb->residence = NULL;
+}
+
+/* Change the capacity of the circular buffer, keeping its data and backend
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer (no span from cb_peek_free()/cb_peek_data() may be in use)
+ *   size_t capacity     - new capacity, rounded up like the backend's init function does
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error (the buffer is left unchanged)
+ *   CB_OVERFLOW_ERROR when the buffered data does not fit the new capacity
+ */
+int cb_resize(circular_buffer *cb, size_t capacity){
+    circular_buffer resized;
+    int ret;
+    if (cb->pool != NULL){
+        ret = cb_init_pooled(&resized, capacity, cb->pool);
+    }
+    else if (cb->mirror){
+        ret = cb_init_mirror(&resized, capacity);
+    }
+    else{
+        ret = cb_init(&resized, capacity);
+    }
+    if (ret != CB_SUCCESS){
+        return ret;
+    }
+
+    size_t used_cp = cb_used_cp(cb);
+    if (used_cp > resized.max_cap){
+        cb_destroy(&resized);
+        return CB_OVERFLOW_ERROR;
+    }
 
+    /*Data is copied without timestamps, the marks move over unchanged*/
+    size_t pos = cb->sidx, left = used_cp;
+    while (left > 0){
+        size_t len = MIN(left, cb->max_cap - pos);
+        void *src = cb->buffer + pos;
+        if (cb->pool != NULL){ // Spans end at chunk boundaries
+            len = MIN(len, CB_CHUNK_SIZE - pos % CB_CHUNK_SIZE);
+            src = cb->chunks[pos / CB_CHUNK_SIZE] + pos % CB_CHUNK_SIZE;
+        }
+        if (cb_push_back(&resized, src, len) != CB_SUCCESS){
+            cb_destroy(&resized);
+            return CB_MEMORY_ERROR;
+        }
+        pos = (pos + len) % cb->max_cap;
+        left -= len;
+    }
+    resized.residence = cb->residence;
+    resized.pushed = cb->pushed;
+    resized.popped = cb->popped;
+    memcpy(resized.marks, cb->marks, sizeof(cb->marks));
+    resized.mark_head = cb->mark_head;
+    resized.mark_cnt = cb->mark_cnt;
+
+    cb_destroy(cb);
+    *cb = resized;
     return CB_SUCCESS;
 }
 
@@ -51,6 +376,20 @@ long cb_free_cp(circular_buffer *cb){
     return free_cp;
 }
 
+/* Check whether data can be added now, a pooled buffer also needs a chunk to put it in
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ * Return Value:
+ *   1 when cb_peek_free() offers at least one span
+ *   0 when the buffer is full or its pool is exhausted
+ */
+int cb_can_push(circular_buffer *cb){
+    if (cb_free_cp(cb) == 0){
+        return 0;
+    }
+    return cb->pool == NULL || cb->chunks[cb->eidx / CB_CHUNK_SIZE] != NULL || cb->pool->free_cnt > 0;
+}
+
 /* Add data onto the end of the circular buffer
  * Arguments:
  *   circular_buffer *cb - reference to the circular buffer
@@ -58,7 +397,7 @@ long cb_free_cp(circular_buffer *cb){
  *   unsigned int in_sz  - size (in bytes) of data source buffer
  * Return Value:
  *   CB_SUCCESS on success
- *   CB_OVERFLOW_ERROR on error
+ *   CB_OVERFLOW_ERROR when the data does not fit or the pool has too few free chunks, nothing is added
  */
 int cb_push_back(circular_buffer *cb, const void *buf, unsigned int in_sz){
     size_t free_cp = cb_free_cp(cb);
@@ -66,6 +405,43 @@ int cb_push_back(circular_buffer *cb, const void *buf, unsigned int in_sz){
         return CB_OVERFLOW_ERROR;
     }
 
+    if (cb->mirror){ // Added data is always contiguous in the mirror mapping
+        memcpy(cb->buffer + cb->eidx, buf, in_sz);
+        cb_commit_push(cb, in_sz);
+        return CB_SUCCESS;
+    }
+
+    if (cb->pool != NULL){ // Copy span by span, chunks are taken as the spans reach them
+        struct iovec iov[2];
+        size_t done = 0, missing = 0, idx = cb->eidx;
+        for (size_t left = in_sz; left > 0;){ // Nothing is copied unless the pool backs all of it
+            size_t len = MIN(left, CB_CHUNK_SIZE - idx % CB_CHUNK_SIZE);
+            missing += cb->chunks[idx / CB_CHUNK_SIZE] == NULL;
+            idx = (idx + len) % cb->max_cap;
+            left -= len;
+        }
+        if (missing > cb->pool->free_cnt){
+            cb->pool->exhausted++;
+            return CB_OVERFLOW_ERROR;
+        }
+        while (done < in_sz){
+            int iovcnt = cb_peek_free(cb, iov);
+            if (iovcnt == 0){
+                cb_commit_push(cb, 0);
+                return CB_MEMORY_ERROR;
+            }
+            size_t n = 0;
+            for (int i = 0; i < iovcnt && done + n < in_sz; i++){
+                size_t len = MIN(iov[i].iov_len, in_sz - done - n);
+                memcpy(iov[i].iov_base, buf + done + n, len);
+                n += len;
+            }
+            cb_commit_push(cb, n);
+            done += n;
+        }
+        return CB_SUCCESS;
+    }
+
     if (cb->sidx <= cb->eidx){ // Added data may not be continguous in circular buffer
         size_t tail_cp = cb->max_cap - cb->eidx;
         if (in_sz <= tail_cp){ // Added data is continguous in circular buffer
@@ -89,6 +465,7 @@ int cb_push_back(circular_buffer *cb, const void *buf, unsigned int in_sz){
     if(free_cp == in_sz){ // Check if circular buffer is now full
         cb->full = 1;
     }
+    cb_mark_push(cb, in_sz);
 
     return CB_SUCCESS;
 }
@@ -109,6 +486,30 @@ long cb_pop_front(circular_buffer *cb, void *buf, unsigned int max_sz){
         return osz;
     }
 
+    if (cb->mirror){ // Popped data is always contiguous in the mirror mapping
+        osz = MIN(max_sz, cb_used_cp(cb));
+        memcpy(buf, cb->buffer + cb->sidx, osz);
+        cb_commit_pop(cb, osz);
+        return osz;
+    }
+
+    if (cb->pool != NULL){ // Copy span by span, drained chunks go back to the pool
+        struct iovec iov[2];
+        int iovcnt;
+        osz = 0;
+        while (osz < max_sz && (iovcnt = cb_peek_data(cb, iov)) > 0){
+            size_t n = 0;
+            for (int i = 0; i < iovcnt && osz + n < max_sz; i++){
+                size_t len = MIN(iov[i].iov_len, max_sz - osz - n);
+                memcpy(buf + osz + n, iov[i].iov_base, len);
+                n += len;
+            }
+            cb_commit_pop(cb, n);
+            osz += n;
+        }
+        return osz;
+    }
+
     if (cb->sidx < cb->eidx){ // Popped data is contiguous in circular buffer
         osz = MIN(max_sz, cb->max_cap - cb_free_cp(cb));
         memcpy(buf, cb->buffer + cb->sidx, osz);
@@ -130,10 +531,202 @@ long cb_pop_front(circular_buffer *cb, void *buf, unsigned int max_sz){
         }
         cb->full=0; // Circular buffer no longer full since data must have been popped
     }
+    cb_mark_pop(cb, osz);
 
     return osz;
 }
 
+/* Get amount of data currently held in the circular buffer
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ * Return Value:
+ *   Used capacity (in bytes)
+ */
+long cb_used_cp(circular_buffer *cb){
+    return cb->max_cap - cb_free_cp(cb);
+}
+
+/* Describe the free region of the circular buffer without modifying it
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   struct iovec iov[2] - filled with the free span(s), in write order
+ * Return Value:
+ *   Number of spans filled (0 when full or the pool is exhausted, 2 when the free region wraps)
+ */
+int cb_peek_free(circular_buffer *cb, struct iovec iov[2]){
+    size_t free_cp = cb_free_cp(cb);
+    if (free_cp == 0){
+        return 0;
+    }
+
+    if (cb->pool != NULL){ // Spans end at chunk boundaries, at most one chunk is taken per call
+        int iovcnt = 0, taken = 0;
+        size_t idx = cb->eidx;
+        cb->reserved = 0;
+        while (iovcnt < 2 && cb->reserved < free_cp){
+            size_t chunk = idx / CB_CHUNK_SIZE, offset = idx % CB_CHUNK_SIZE;
+            if (cb->chunks[chunk] == NULL){
+                if (taken || (cb->chunks[chunk] = cb_chunk_get(cb->pool)) == NULL){
+                    break;
+                }
+                taken = 1;
+            }
+            iov[iovcnt].iov_base = cb->chunks[chunk] + offset;
+            iov[iovcnt].iov_len = MIN(CB_CHUNK_SIZE - offset, free_cp - cb->reserved);
+            cb->reserved += iov[iovcnt].iov_len;
+            idx = (idx + iov[iovcnt].iov_len) % cb->max_cap;
+            iovcnt++;
+        }
+        return iovcnt;
+    }
+
+    size_t tail_cp = cb->max_cap - cb->eidx;
+    iov[0].iov_base = cb->buffer + cb->eidx;
+    if (cb->mirror || cb->sidx > cb->eidx || free_cp <= tail_cp){ // Free region is contiguous
+        iov[0].iov_len = free_cp;
+        return 1;
+    }
+    iov[0].iov_len = tail_cp; // Free region wraps around end of buffer
+    iov[1].iov_base = cb->buffer;
+    iov[1].iov_len = free_cp - tail_cp;
+    return 2;
+}
+
+/* Mark bytes written into the spans from cb_peek_free() as valid data
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t n            - bytes written (must not exceed the free capacity)
+ * Return Value:
+ *   None
+ */
+void cb_commit_push(circular_buffer *cb, size_t n){
+    if (cb->pool != NULL){ // Chunks taken for space that was not filled go back
+        size_t reserved = cb->reserved;
+        cb->reserved = 0;
+        if (n < reserved){
+            cb_mark_push(cb, n);
+            cb->eidx = (cb->eidx + n) % cb->max_cap;
+            cb->full = (n > 0 && cb->eidx == cb->sidx);
+            cb_trim(cb);
+            return;
+        }
+    }
+    if (n == 0){
+        return;
+    }
+    cb_mark_push(cb, n);
+    cb->eidx = (cb->eidx + n) % cb->max_cap;
+    if (cb->eidx == cb->sidx){ // Check if circular buffer is now full
+        cb->full = 1;
+    }
+}
+
+/* Describe the filled region of the circular buffer without modifying it
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   struct iovec iov[2] - filled with the data span(s), in read order
+ * Return Value:
+ *   Number of spans filled (0 when empty, 2 when the data wraps)
+ */
+int cb_peek_data(circular_buffer *cb, struct iovec iov[2]){
+    size_t used_cp = cb_used_cp(cb);
+    if (used_cp == 0){
+        return 0;
+    }
+
+    if (cb->pool != NULL){ // Spans end at chunk boundaries
+        int iovcnt = 0;
+        size_t idx = cb->sidx, len = 0;
+        while (iovcnt < 2 && len < used_cp){
+            size_t chunk = idx / CB_CHUNK_SIZE, offset = idx % CB_CHUNK_SIZE;
+            iov[iovcnt].iov_base = cb->chunks[chunk] + offset;
+            iov[iovcnt].iov_len = MIN(CB_CHUNK_SIZE - offset, used_cp - len);
+            len += iov[iovcnt].iov_len;
+            idx = (idx + iov[iovcnt].iov_len) % cb->max_cap;
+            iovcnt++;
+        }
+        return iovcnt;
+    }
+
+    size_t tail_cp = cb->max_cap - cb->sidx;
+    iov[0].iov_base = cb->buffer + cb->sidx;
+    if (cb->mirror || used_cp <= tail_cp){ // Data is contiguous
+        iov[0].iov_len = used_cp;
+        return 1;
+    }
+    iov[0].iov_len = tail_cp; // Data wraps around end of buffer
+    iov[1].iov_base = cb->buffer;
+    iov[1].iov_len = used_cp - tail_cp;
+    return 2;
+}
+
+/* Consume bytes from the spans returned by cb_peek_data()
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   size_t n            - bytes consumed (must not exceed the used capacity)
+ * Return Value:
+ *   None
+ */
+void cb_commit_pop(circular_buffer *cb, size_t n){
+    if (n == 0){
+        return;
+    }
+    size_t old_sidx = cb->sidx;
+    cb_mark_pop(cb, n);
+    cb->sidx = (cb->sidx + n) % cb->max_cap;
+    cb->full = 0;
+    if (cb->pool != NULL && (cb->sidx / CB_CHUNK_SIZE != old_sidx / CB_CHUNK_SIZE || cb->sidx == cb->eidx)){
+        cb_trim(cb); // A chunk was drained
+    }
+}
+
+/* Read from a file descriptor directly into the free region of the circular buffer
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   int fd              - file descriptor to read from
+ * Return Value:
+ *   Data read (in bytes) on success
+ *   0 on end of file
+ *   -1 on error with errno set (ENOBUFS when the circular buffer is full or its pool is exhausted)
+ */
+long cb_recv_from_fd(circular_buffer *cb, int fd){
+    struct iovec iov[2];
+    int iovcnt = cb_peek_free(cb, iov);
+    if (iovcnt == 0){
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t n = readv(fd, iov, iovcnt);
+    int saved_errno = errno;
+    cb_commit_push(cb, n > 0 ? n : 0); // Also returns the chunk reserved for a read that got nothing
+    errno = saved_errno;
+    return n;
+}
+
+/* Write the data of the circular buffer directly to a file descriptor
+ * Arguments:
+ *   circular_buffer *cb - reference to the circular buffer
+ *   int fd              - file descriptor to write to
+ * Return Value:
+ *   Data written (in bytes) on success, only these bytes are removed
+ *   0 when the circular buffer is empty
+ *   -1 on error with errno set
+ */
+long cb_send_to_fd(circular_buffer *cb, int fd){
+    struct iovec iov[2];
+    int iovcnt = cb_peek_data(cb, iov);
+    if (iovcnt == 0){
+        return 0;
+    }
+
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n > 0){
+        cb_commit_pop(cb, n);
+    }
+    return n;
+}
+
 /* Print debug information about the circular buffer
  * Arguments:
  *   circular_buffer *cb - reference to the circular buffer
@@ -146,3 +739,300 @@ void print_cb_status(circular_buffer *cb){
            cb->sidx, cb->eidx, cb->full, cb->max_cap);
     return;
 }
+
+/* Preallocate the chunk slab of a pool
+ * Arguments:
+ *   cb_pool *pool - reference to the pool
+ *   size_t size   - slab size (in bytes), rounded down to a multiple of CB_CHUNK_SIZE
+ *   int hugepages - try to back the slab with huge pages first
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error
+ * Note: the slab is populated up front so the data path never faults it in
+ */
+int cb_pool_init(cb_pool *pool, size_t size, int hugepages){
+    memset(pool, 0, sizeof(cb_pool));
+    pool->chunks = size / CB_CHUNK_SIZE;
+    pool->len = pool->chunks * CB_CHUNK_SIZE;
+    if (pool->chunks == 0){ // Buffers could never hold any data
+        errno = EINVAL;
+        return CB_MEMORY_ERROR;
+    }
+
+    pool->slab = MAP_FAILED;
+    if (hugepages){
+        pool->slab = mmap(NULL, pool->len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        pool->hugepages = (pool->slab != MAP_FAILED);
+    }
+    if (pool->slab == MAP_FAILED){
+        pool->slab = mmap(NULL, pool->len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    }
+    if (pool->slab == MAP_FAILED){
+        pool->slab = NULL;
+        return CB_MEMORY_ERROR;
+    }
+
+    pool->free_chunks = malloc(pool->chunks * sizeof(void *));
+    if (pool->free_chunks == NULL){
+        munmap(pool->slab, pool->len);
+        pool->slab = NULL;
+        return CB_MEMORY_ERROR;
+    }
+    for (size_t i = 0; i < pool->chunks; i++){ // Lowest addresses are handed out first
+        pool->free_chunks[i] = pool->slab + (pool->chunks - 1 - i) * CB_CHUNK_SIZE;
+    }
+    pool->free_cnt = pool->chunks;
+
+    return CB_SUCCESS;
+}
+
+/* Release the slab of a pool, all its buffers must have been destroyed
+ * Arguments:
+ *   cb_pool *pool - reference to the pool
+ * Return Value:
+ *   None
+ */
+void cb_pool_destroy(cb_pool *pool){
+    if (pool->slab != NULL){
+        munmap(pool->slab, pool->len);
+    }
+    free(pool->free_chunks);
+    memset(pool, 0, sizeof(cb_pool));
+}
+
+/* Sleep until *addr no longer holds val, a wake up is sent or 100 ms passed
+ * Arguments:
+ *   uint32_t *addr - futex word
+ *   uint32_t val   - value observed before deciding to sleep
+ * Return Value:
+ *   None
+ * Note: spsc_close() does not change the index words, the timeout bounds how
+ *       long a wake up racing with the close can be missed
+ */
+static void futex_wait(uint32_t *addr, uint32_t val){
+    struct timespec timeout = { 0, 100000000 };
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
+
+/* Wake the thread sleeping on a futex word
+ * Arguments:
+ *   uint32_t *addr - futex word
+ * Return Value:
+ *   None
+ */
+static void futex_wake(uint32_t *addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Amount of data between two SPSC indices
+ * Arguments:
+ *   spsc_buffer *rb    - reference to the SPSC buffer
+ *   uint32_t head, tail - indices in [0, 2*max_cap)
+ * Return Value:
+ *   Used capacity (in bytes)
+ */
+static uint32_t spsc_used(spsc_buffer *rb, uint32_t head, uint32_t tail){
+    return (head >= tail) ? head - tail : head + 2 * rb->max_cap - tail;
+}
+
+/* Initialize the SPSC buffer
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ *   size_t capacity - maximum capacity (at most 1 GB)
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error
+ */
+int spsc_init(spsc_buffer *rb, size_t capacity){
+    memset(rb, 0, sizeof(spsc_buffer));
+    if (capacity == 0 || capacity > (1U << 30)){
+        return CB_MEMORY_ERROR;
+    }
+    rb->buffer = malloc(capacity);
+    if (rb->buffer == NULL){
+        return CB_MEMORY_ERROR;
+    }
+    rb->max_cap = capacity;
+    return CB_SUCCESS;
+}
+
+/* Release the memory held by the SPSC buffer
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer (neither side may still use it)
+ * Return Value:
+ *   None
+ */
+void spsc_destroy(spsc_buffer *rb){
+    free(rb->buffer);
+    rb->buffer = NULL;
+}
+
+/* Describe the free region of the SPSC buffer (producer side)
+ * Arguments:
+ *   spsc_buffer *rb     - reference to the SPSC buffer
+ *   struct iovec iov[2] - filled with the free span(s), in write order
+ * Return Value:
+ *   Number of spans filled (0 when full)
+ */
+int spsc_peek_free(spsc_buffer *rb, struct iovec iov[2]){
+    uint32_t head = rb->head; // Only the producer writes head
+    uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE); // Consumer is done with popped bytes
+    uint32_t free_cp = rb->max_cap - spsc_used(rb, head, tail);
+    if (free_cp == 0){
+        return 0;
+    }
+
+    uint32_t pos = (head >= rb->max_cap) ? head - rb->max_cap : head;
+    uint32_t tail_cp = rb->max_cap - pos;
+    iov[0].iov_base = rb->buffer + pos;
+    if (free_cp <= tail_cp){
+        iov[0].iov_len = free_cp;
+        return 1;
+    }
+    iov[0].iov_len = tail_cp;
+    iov[1].iov_base = rb->buffer;
+    iov[1].iov_len = free_cp - tail_cp;
+    return 2;
+}
+
+/* Publish bytes written into the spans from spsc_peek_free() (producer side)
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ *   size_t n        - bytes written
+ * Return Value:
+ *   None
+ */
+void spsc_commit_push(spsc_buffer *rb, size_t n){
+    uint32_t head = rb->head + n;
+    if (head >= 2 * rb->max_cap){
+        head -= 2 * rb->max_cap;
+    }
+    // Release the data to the consumer, seq_cst orders it before the waiting check
+    __atomic_store_n(&rb->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rb->consumer_waiting, __ATOMIC_SEQ_CST)){
+        futex_wake(&rb->head);
+    }
+}
+
+/* Describe the filled region of the SPSC buffer (consumer side)
+ * Arguments:
+ *   spsc_buffer *rb     - reference to the SPSC buffer
+ *   struct iovec iov[2] - filled with the data span(s), in read order
+ * Return Value:
+ *   Number of spans filled (0 when empty)
+ */
+int spsc_peek_data(spsc_buffer *rb, struct iovec iov[2]){
+    uint32_t tail = rb->tail; // Only the consumer writes tail
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE); // Producer's data is visible
+    uint32_t used_cp = spsc_used(rb, head, tail);
+    if (used_cp == 0){
+        return 0;
+    }
+
+    uint32_t pos = (tail >= rb->max_cap) ? tail - rb->max_cap : tail;
+    uint32_t tail_cp = rb->max_cap - pos;
+    iov[0].iov_base = rb->buffer + pos;
+    if (used_cp <= tail_cp){
+        iov[0].iov_len = used_cp;
+        return 1;
+    }
+    iov[0].iov_len = tail_cp;
+    iov[1].iov_base = rb->buffer;
+    iov[1].iov_len = used_cp - tail_cp;
+    return 2;
+}
+
+/* Release bytes consumed from the spans of spsc_peek_data() (consumer side)
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ *   size_t n        - bytes consumed
+ * Return Value:
+ *   None
+ */
+void spsc_commit_pop(spsc_buffer *rb, size_t n){
+    uint32_t tail = rb->tail + n;
+    if (tail >= 2 * rb->max_cap){
+        tail -= 2 * rb->max_cap;
+    }
+    __atomic_store_n(&rb->tail, tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rb->producer_waiting, __ATOMIC_SEQ_CST)){
+        futex_wake(&rb->tail);
+    }
+}
+
+/* Block the producer until the SPSC buffer has free space
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ * Return Value:
+ *   0 when space is available
+ *   -1 when the buffer was closed
+ */
+int spsc_wait_free(spsc_buffer *rb){
+    while (1){
+        if (__atomic_load_n(&rb->closed, __ATOMIC_ACQUIRE)){
+            return -1;
+        }
+        uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_SEQ_CST);
+        if (spsc_used(rb, rb->head, tail) < rb->max_cap){
+            return 0;
+        }
+        // Announce, then re-check so a pop between the check and the sleep is not missed
+        __atomic_store_n(&rb->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rb->tail, __ATOMIC_SEQ_CST) == tail &&
+            !__atomic_load_n(&rb->closed, __ATOMIC_SEQ_CST)){
+            futex_wait(&rb->tail, tail);
+        }
+        __atomic_store_n(&rb->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Block the consumer until the SPSC buffer holds data
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ * Return Value:
+ *   0 when data is available (data pushed before a close is still delivered)
+ *   -1 when the buffer is empty and was closed
+ */
+int spsc_wait_data(spsc_buffer *rb){
+    while (1){
+        uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_SEQ_CST);
+        if (spsc_used(rb, head, rb->tail) > 0){
+            return 0;
+        }
+        if (__atomic_load_n(&rb->closed, __ATOMIC_ACQUIRE)){
+            return -1;
+        }
+        __atomic_store_n(&rb->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rb->head, __ATOMIC_SEQ_CST) == head &&
+            !__atomic_load_n(&rb->closed, __ATOMIC_SEQ_CST)){
+            futex_wait(&rb->head, head);
+        }
+        __atomic_store_n(&rb->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Get amount of data currently held in the SPSC buffer, from any thread
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ * Return Value:
+ *   Used capacity (in bytes), a snapshot that may be stale by the time it is used
+ */
+size_t spsc_used_cp(spsc_buffer *rb){
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    return spsc_used(rb, head, tail);
+}
+
+/* Close the SPSC buffer and wake both sides
+ * Arguments:
+ *   spsc_buffer *rb - reference to the SPSC buffer
+ * Return Value:
+ *   None
+ */
+void spsc_close(spsc_buffer *rb){
+    __atomic_store_n(&rb->closed, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&rb->head);
+    futex_wake(&rb->tail);
+}
@@ -4,27 +4,104 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include "hist.h"
 
 #define CB_SUCCESS           0  /* Circular buffer operation was successful */
 #define CB_MEMORY_ERROR      1  /* Failed to allocate memory */
 #define CB_OVERFLOW_ERROR    2  /* Circular buffer is full - cannot push more items */
 #define CB_EMPTY_ERROR       3  /* Circular buffer is empty - cannot pop more items */
 
+#define CB_CACHE_LINE       64  /* Alignment keeping producer and consumer indices apart */
+#define CB_CHUNK_SIZE    65536  /* Allocation unit of pooled circular buffers */
+#define CB_MARKS            32  /* Push timestamps kept for residence times, older pushes merge when exceeded */
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+/* Preallocated slab of CB_CHUNK_SIZE chunks backing pooled circular buffers.
+ * Not thread-safe, each thread owning circular buffers uses its own pool.
+ */
+typedef struct cb_pool {
+    void *slab;                   // Every chunk handed out, buffers stop growing once all are in use
+    size_t len;                   // Size of the slab mapping
+    void **free_chunks;           // Stack of free slab chunks
+    size_t free_cnt;
+    size_t chunks;                // Chunks in the slab
+    size_t in_use;                // Chunks held by buffers
+    size_t peak;                  // Highest in_use seen
+    unsigned long long exhausted; // Chunk requests refused because the slab was exhausted
+    unsigned char hugepages;      // Whether the slab is backed by huge pages
+} cb_pool;
+
+/* Time a push completed, covering the pushed bytes up to end */
+typedef struct cb_mark {
+    unsigned long long end;   // Value of circular_buffer.pushed after the push
+    unsigned long long ns;    // CLOCK_MONOTONIC time of the push
+} cb_mark;
+
 typedef struct circular_buffer {
     void *buffer;         // Pointer to beginning of the allocated buffer
     size_t sidx;          // Starting index of the circular buffer
     size_t eidx;          // Ending index of the circular buffer (Note: no valid data at this index)
     size_t max_cap;       // Maximum capacity of the circular buffer
     unsigned char full;   // Whether the circular buffer is full (Note: "sidx == eidx" would otherwise be ambiguous)
+    unsigned char mirror; // Whether buffer is mapped twice back-to-back (any span is contiguous)
+    cb_pool *pool;        // Pool the chunks come from, NULL unless the buffer is pooled
+    void **chunks;        // Pooled only: chunk backing each CB_CHUNK_SIZE slice, NULL while unused
+    size_t reserved;      // Pooled only: free bytes offered by the last cb_peek_free(), kept backed until committed
+    latency_hist *residence;  // Receives the time popped bytes spent in the buffer, NULL disables timestamps
+    unsigned long long pushed;   // Bytes ever pushed, positions of the marks
+    unsigned long long popped;   // Bytes ever popped and recorded to residence
+    cb_mark marks[CB_MARKS];     // Pushes not fully popped yet, oldest at mark_head
+    unsigned mark_head, mark_cnt;
 } circular_buffer;
 
+/* Single-producer/single-consumer variant, safe with one reader thread and one writer thread.
+ * Indices run over [0, 2*max_cap) so "full" and "empty" need no shared flag.
+ */
+typedef struct spsc_buffer {
+    uint32_t head __attribute__((aligned(CB_CACHE_LINE))); // Written by the producer only
+    uint32_t producer_waiting;                             // Producer sleeps on tail
+    uint32_t tail __attribute__((aligned(CB_CACHE_LINE))); // Written by the consumer only
+    uint32_t consumer_waiting;                             // Consumer sleeps on head
+    void *buffer __attribute__((aligned(CB_CACHE_LINE)));  // Read-only after init
+    uint32_t max_cap;
+    uint32_t closed;      // Set by either side, no more data will be pushed or popped
+} spsc_buffer;
+
 int cb_init(circular_buffer *cb, size_t capacity);
+int cb_init_mirror(circular_buffer *cb, size_t capacity);
+int cb_init_pooled(circular_buffer *cb, size_t capacity, cb_pool *pool);
+void cb_destroy(circular_buffer *cb);
+int cb_resize(circular_buffer *cb, size_t capacity);
 long cb_free_cp(circular_buffer *cb);
+int cb_can_push(circular_buffer *cb);
 int cb_push_back(circular_buffer *cb, const void *buf, unsigned int in_sz);
 long cb_pop_front(circular_buffer *cb, void *buf, unsigned int max_sz);
+long cb_used_cp(circular_buffer *cb);
+int cb_peek_free(circular_buffer *cb, struct iovec iov[2]);
+void cb_commit_push(circular_buffer *cb, size_t n);
+int cb_peek_data(circular_buffer *cb, struct iovec iov[2]);
+void cb_commit_pop(circular_buffer *cb, size_t n);
+long cb_recv_from_fd(circular_buffer *cb, int fd);
+long cb_send_to_fd(circular_buffer *cb, int fd);
 void print_cb_status(circular_buffer *cb);
+void cb_residence_init(circular_buffer *cb, latency_hist *residence);
+
+int cb_pool_init(cb_pool *pool, size_t size, int hugepages);
+void cb_pool_destroy(cb_pool *pool);
+
+int spsc_init(spsc_buffer *rb, size_t capacity);
+void spsc_destroy(spsc_buffer *rb);
+int spsc_peek_free(spsc_buffer *rb, struct iovec iov[2]);
+void spsc_commit_push(spsc_buffer *rb, size_t n);
+int spsc_peek_data(spsc_buffer *rb, struct iovec iov[2]);
+void spsc_commit_pop(spsc_buffer *rb, size_t n);
+int spsc_wait_free(spsc_buffer *rb);
+int spsc_wait_data(spsc_buffer *rb);
+size_t spsc_used_cp(spsc_buffer *rb);
+void spsc_close(spsc_buffer *rb);
 
 #endif
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cbuf.h"
+
+/* Push/pop throughput of the circular buffer backends
+ * Usage: cbuf_bench [seconds per case]
+ * Every case pushes one chunk and pops it again, so the copy cost dominates:
+ *   contiguous - capacity is a multiple of the chunk size, no span ever wraps
+ *   wrapping   - the empty buffer is rewound so every chunk straddles the end of the buffer
+ * GB/s counts the bytes moved through the buffer (each byte is copied twice).
+ */
+
+#define BENCH_SECONDS 0.2
+#define MIN_CHUNK 64
+#define MAX_CHUNK (1 << 20)
+#define CHUNKS_PER_BUFFER 4
+
+enum backend { PLAIN, MIRROR, POOLED };
+static const char *backend_names[] = { "plain", "mirror", "pooled" };
+
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Rewind an empty buffer so the next push starts half a chunk before the end */
+static void rewind_to_wrap(circular_buffer *cb, size_t chunk){
+    cb->sidx = cb->eidx = cb->max_cap - chunk / 2;
+}
+
+/* Run one case and return GB/s, or a negative value when the buffer cannot be created */
+static double bench_case(enum backend b, size_t chunk, int wrapping, double seconds, cb_pool *pool){
+    circular_buffer cb;
+    size_t capacity = chunk * CHUNKS_PER_BUFFER;
+    int ret;
+    switch(b){
+        case MIRROR:
+            ret = cb_init_mirror(&cb, capacity);
+            break;
+        case POOLED:
+            ret = cb_init_pooled(&cb, capacity, pool);
+            break;
+        default:
+            ret = cb_init(&cb, capacity);
+    }
+    if(ret != CB_SUCCESS){
+        return -1;
+    }
+
+    char *in = malloc(chunk), *out = malloc(chunk);
+    memset(in, 0x5a, chunk);
+    memset(out, 0, chunk);
+
+    unsigned long long bytes = 0;
+    long batch = MAX((long)((64 << 20) / chunk), 1);
+    double start = now_seconds(), elapsed;
+    do{
+        for(long i = 0; i < batch; i++){
+            if(wrapping){
+                rewind_to_wrap(&cb, chunk);
+            }
+            cb_push_back(&cb, in, chunk);
+            cb_pop_front(&cb, out, chunk);
+        }
+        bytes += batch * chunk;
+        elapsed = now_seconds() - start;
+    }while(elapsed < seconds);
+
+    if(out[chunk - 1] != in[chunk - 1]){
+        fprintf(stderr, "%s: data mismatch at chunk size %zu\n", backend_names[b], chunk);
+        exit(EXIT_FAILURE);
+    }
+    free(in);
+    free(out);
+    cb_destroy(&cb);
+    return bytes / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]){
+    double seconds = argc > 1 ? atof(argv[1]) : BENCH_SECONDS;
+    cb_pool pool;
+    if(cb_pool_init(&pool, (size_t)CHUNKS_PER_BUFFER * MAX_CHUNK, 0) != CB_SUCCESS){
+        perror("Failed to Create Pool");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %-10s %10s %10s\n", "Backend", "Pattern", "Chunk", "GB/s");
+    for(int b = PLAIN; b <= POOLED; b++){
+        for(int wrapping = 0; wrapping <= 1; wrapping++){
+            for(size_t chunk = MIN_CHUNK; chunk <= MAX_CHUNK; chunk *= 4){
+                double gbps = bench_case(b, chunk, wrapping, seconds, &pool);
+                if(gbps < 0){
+                    printf("%-8s %-10s %10zu %10s\n", backend_names[b], wrapping ? "wrapping" : "contiguous", chunk, "n/a");
+                    continue;
+                }
+                printf("%-8s %-10s %10zu %10.2f\n", backend_names[b], wrapping ? "wrapping" : "contiguous", chunk, gbps);
+            }
+        }
+    }
+    cb_pool_destroy(&pool);
+    return 0;
+}
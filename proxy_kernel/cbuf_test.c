@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "cbuf.h"
+
+/* Property tests for cbuf.c: every operation is checked against a reference FIFO model
+ * Usage: cbuf_test [iterations] [seed]
+ * Exits non-zero on the first mismatch.
+ */
+
+#define ITERATIONS 20000
+#define MODEL_SIZE (1 << 22)     // Reference FIFO, larger than any tested capacity
+#define TEST_POOL_CHUNKS 16      // Resizes reach twice the largest pooled capacity and hold both copies
+
+#define CHECK(cond, ...) do{ \
+    if(!(cond)){ \
+        fprintf(stderr, "%s:%d: %s failed: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        exit(EXIT_FAILURE); \
+    } \
+}while(0)
+
+enum backend { PLAIN, MIRROR, POOLED };
+static const char *backend_names[] = { "plain", "mirror", "pooled" };
+
+/*Reference model: bytes pushed and not popped yet, in order*/
+struct model{
+    unsigned char *data;
+    size_t head;            // Next byte to pop
+    size_t tail;            // Next byte to push
+    unsigned char next;     // Value of the next pushed byte
+};
+
+static size_t model_used(struct model *m){
+    return m->tail - m->head;
+}
+
+static int buffer_init(circular_buffer *cb, enum backend b, size_t capacity, cb_pool *pool){
+    switch(b){
+        case MIRROR:
+            return cb_init_mirror(cb, capacity);
+        case POOLED:
+            return cb_init_pooled(cb, capacity, pool);
+        default:
+            return cb_init(cb, capacity);
+    }
+}
+
+/* Check the buffer state against the model */
+static void check_state(circular_buffer *cb, struct model *m, cb_pool *pool){
+    size_t used = model_used(m);
+    CHECK(cb_used_cp(cb) == (long)used, "used %ld, model %zu", cb_used_cp(cb), used);
+    CHECK(cb_free_cp(cb) == (long)(cb->max_cap - used), "free %ld, model %zu", cb_free_cp(cb), cb->max_cap - used);
+    CHECK(cb->full == (used == cb->max_cap), "full flag %d with %zu of %zu used", cb->full, used, cb->max_cap);
+    CHECK(cb->sidx < cb->max_cap && cb->eidx < cb->max_cap, "indices %zu %zu out of %zu", cb->sidx, cb->eidx, cb->max_cap);
+    if(cb->pool != NULL){
+        size_t held = 0;
+        for(size_t i = 0; i < cb->max_cap / CB_CHUNK_SIZE; i++){
+            held += cb->chunks[i] != NULL;
+        }
+        CHECK(held == pool->in_use, "%zu chunks held, pool says %zu", held, pool->in_use);
+        CHECK(cb->reserved == 0, "%zu bytes still reserved after the operation", cb->reserved);
+        CHECK(used > 0 || held == 0, "empty buffer holds %zu chunks", held);
+    }
+}
+
+/* Sum of span lengths, spans must not be empty */
+static size_t iov_total(struct iovec *iov, int cnt){
+    size_t total = 0;
+    CHECK(cnt >= 0 && cnt <= 2, "%d spans", cnt);
+    for(int i = 0; i < cnt; i++){
+        CHECK(iov[i].iov_len > 0, "empty span %d", i);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+static void op_push_back(circular_buffer *cb, struct model *m, size_t n){
+    unsigned char *in = malloc(n + 1);
+    for(size_t i = 0; i < n; i++){
+        in[i] = m->next + i;
+    }
+    int ret = cb_push_back(cb, in, n);
+    if(model_used(m) + n <= cb->max_cap){
+        CHECK(ret == CB_SUCCESS, "push of %zu with %zu used returned %d", n, model_used(m), ret);
+        for(size_t i = 0; i < n; i++){
+            m->data[(m->tail + i) % MODEL_SIZE] = in[i];
+        }
+        m->tail += n;
+        m->next += n;
+    }
+    else{
+        CHECK(ret == CB_OVERFLOW_ERROR, "overflowing push of %zu with %zu used returned %d", n, model_used(m), ret);
+    }
+    free(in);
+}
+
+static void op_pop_front(circular_buffer *cb, struct model *m, size_t n){
+    unsigned char *out = malloc(n + 1);
+    long ret = cb_pop_front(cb, out, n);
+    size_t used = model_used(m);
+    if(used == 0 || n == 0){
+        CHECK(ret == -1, "pop of %zu with %zu used returned %ld", n, used, ret);
+    }
+    else{
+        size_t expect = n < used ? n : used;
+        CHECK(ret == (long)expect, "pop of %zu with %zu used returned %ld", n, used, ret);
+        for(size_t i = 0; i < expect; i++){
+            CHECK(out[i] == m->data[(m->head + i) % MODEL_SIZE], "byte %zu of pop differs", i);
+        }
+        m->head += expect;
+    }
+    free(out);
+}
+
+static void op_peek_push(circular_buffer *cb, struct model *m, size_t n){
+    struct iovec iov[2];
+    int cnt = cb_peek_free(cb, iov);
+    size_t total = iov_total(iov, cnt);
+    size_t free_cp = cb->max_cap - model_used(m);
+    CHECK(total <= free_cp, "peek offers %zu of %zu free", total, free_cp);
+    CHECK(free_cp == 0 || total > 0, "no span offered with %zu free", free_cp);
+    if(cb->pool == NULL){
+        CHECK(total == free_cp, "peek offers %zu of %zu free", total, free_cp);
+    }
+    n = n < total ? n : total;
+    size_t done = 0;
+    for(int i = 0; i < cnt && done < n; i++){
+        size_t len = iov[i].iov_len < n - done ? iov[i].iov_len : n - done;
+        for(size_t j = 0; j < len; j++){
+            ((unsigned char *)iov[i].iov_base)[j] = m->next;
+            m->data[(m->tail + done + j) % MODEL_SIZE] = m->next++;
+        }
+        done += len;
+    }
+    cb_commit_push(cb, n);
+    m->tail += n;
+}
+
+static void op_peek_pop(circular_buffer *cb, struct model *m, size_t n){
+    struct iovec iov[2];
+    int cnt = cb_peek_data(cb, iov);
+    size_t total = iov_total(iov, cnt);
+    size_t used = model_used(m);
+    CHECK(total <= used && (used == 0 || total > 0), "peek offers %zu of %zu used", total, used);
+    if(cb->pool == NULL){
+        CHECK(total == used, "peek offers %zu of %zu used", total, used);
+    }
+    n = n < total ? n : total;
+    size_t done = 0;
+    for(int i = 0; i < cnt && done < n; i++){
+        size_t len = iov[i].iov_len < n - done ? iov[i].iov_len : n - done;
+        for(size_t j = 0; j < len; j++){
+            CHECK(((unsigned char *)iov[i].iov_base)[j] == m->data[(m->head + done + j) % MODEL_SIZE],
+                  "byte %zu of peeked data differs", done + j);
+        }
+        done += len;
+    }
+    cb_commit_pop(cb, n);
+    m->head += n;
+}
+
+/* Move data through a non-blocking socket pair with the direct fd I/O functions, the last
+ * read finds the socket empty
+ */
+static void op_fd_roundtrip(circular_buffer *cb, struct model *m, int fds[2]){
+    long sent = cb_send_to_fd(cb, fds[0]);
+    if(model_used(m) == 0){
+        CHECK(sent == 0, "send from empty buffer returned %ld", sent);
+        return;
+    }
+    CHECK(sent > 0, "send returned %ld (%s)", sent, strerror(errno));
+    m->head += sent;   // Bytes are read back in the same order and pushed again
+    size_t back = 0;
+    while(back < (size_t)sent){
+        long n = cb_recv_from_fd(cb, fds[1]);
+        CHECK(n > 0, "recv returned %ld (%s)", n, strerror(errno));
+        back += n;
+    }
+    CHECK(back == (size_t)sent, "read back %zu of %ld", back, sent);
+    long n = cb_recv_from_fd(cb, fds[1]);
+    CHECK(n == -1 && (errno == EAGAIN || (errno == ENOBUFS && cb->full)), "recv from empty socket returned %ld (%s)",
+          n, strerror(errno));
+    for(size_t i = 0; i < back; i++){ // Rotated bytes keep their values
+        m->data[(m->tail + i) % MODEL_SIZE] = m->data[(m->head - sent + i) % MODEL_SIZE];
+    }
+    m->tail += back;
+}
+
+/* Resize to a random capacity, shrinking below the buffered data must fail and leave the buffer as is */
+static void op_resize(circular_buffer *cb, struct model *m, size_t base){
+    size_t used = model_used(m);
+    size_t capacity = 1 + rand() % (2 * base);
+    int ret = cb_resize(cb, capacity);
+    if(capacity >= used){
+        CHECK(ret == CB_SUCCESS, "resize to %zu with %zu used returned %d", capacity, used, ret);
+        CHECK(cb->max_cap >= capacity, "resized to %zu instead of %zu", cb->max_cap, capacity);
+    }
+    else if(ret == CB_SUCCESS){ // Rounded up by the backend
+        CHECK(cb->max_cap >= used, "resized to %zu with %zu used", cb->max_cap, used);
+    }
+    else{
+        CHECK(ret == CB_OVERFLOW_ERROR, "resize to %zu with %zu used returned %d", capacity, used, ret);
+    }
+}
+
+/* Random operation sizes: mostly small, sometimes around the capacity */
+static size_t random_size(size_t capacity){
+    switch(rand() % 4){
+        case 0:
+            return rand() % 64;
+        case 1:
+            return rand() % (capacity / 3 + 1);
+        case 2:
+            return capacity - rand() % (capacity / 4 + 1);
+        default:
+            return rand() % (capacity + 2);
+    }
+}
+
+static void test_random(enum backend b, size_t capacity, long iterations){
+    cb_pool pool;
+    circular_buffer cb;
+    struct model m = { malloc(MODEL_SIZE), 0, 0, 0 };
+    int fds[2];
+    CHECK(cb_pool_init(&pool, TEST_POOL_CHUNKS * CB_CHUNK_SIZE, 0) == CB_SUCCESS, "pool init");
+    CHECK(buffer_init(&cb, b, capacity, &pool) == CB_SUCCESS, "init of %zu", capacity);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0, "socketpair");
+    int bufsize = 4 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    for(long it = 0; it < iterations; it++){
+        size_t n = random_size(cb.max_cap);
+        switch(rand() % 9){
+            case 0: case 1:
+                op_push_back(&cb, &m, n);
+                break;
+            case 2: case 3:
+                op_pop_front(&cb, &m, n);
+                break;
+            case 4: case 5:
+                op_peek_push(&cb, &m, n);
+                break;
+            case 6: case 7:
+                op_peek_pop(&cb, &m, n);
+                break;
+            default:
+                if(rand() % 8 == 0){
+                    op_resize(&cb, &m, capacity);
+                }
+                else if(model_used(&m) <= 65536){ // Stay below the socket buffer
+                    op_fd_roundtrip(&cb, &m, fds);
+                }
+        }
+        check_state(&cb, &m, &pool);
+    }
+
+    cb_destroy(&cb);
+    CHECK(pool.in_use == 0, "%zu chunks leaked", pool.in_use);
+    cb_pool_destroy(&pool);
+    close(fds[0]);
+    close(fds[1]);
+    free(m.data);
+}
+
+/* Fixed sequences around the full flag and the wrap point */
+static void test_edges(enum backend b, size_t capacity){
+    cb_pool pool;
+    circular_buffer cb;
+    struct model m = { malloc(MODEL_SIZE), 0, 0, 0 };
+    CHECK(cb_pool_init(&pool, TEST_POOL_CHUNKS * CB_CHUNK_SIZE, 0) == CB_SUCCESS, "pool init");
+    CHECK(buffer_init(&cb, b, capacity, &pool) == CB_SUCCESS, "init of %zu", capacity);
+    size_t cap = cb.max_cap;
+
+    op_pop_front(&cb, &m, 1);          // Pop from empty
+    op_push_back(&cb, &m, 0);          // Empty push
+    op_push_back(&cb, &m, cap);        // Exactly full
+    check_state(&cb, &m, &pool);
+    op_push_back(&cb, &m, 1);          // Overflow by one
+    op_pop_front(&cb, &m, 0);          // Zero sized pop
+    op_pop_front(&cb, &m, cap);        // Exactly empty
+    check_state(&cb, &m, &pool);
+    for(size_t offset = 1; offset < cap && offset < 8; offset++){ // Fill and drain across the end
+        op_push_back(&cb, &m, cap - offset);
+        op_pop_front(&cb, &m, cap - offset);
+        op_push_back(&cb, &m, cap);
+        check_state(&cb, &m, &pool);
+        op_pop_front(&cb, &m, cap - 1);
+        op_pop_front(&cb, &m, 2);
+        check_state(&cb, &m, &pool);
+    }
+    op_push_back(&cb, &m, cap / 2 + 1); // Peeked spans around the end, up to full
+    op_pop_front(&cb, &m, cap / 2 + 1);
+    while(model_used(&m) < cap){
+        op_peek_push(&cb, &m, cap);
+    }
+    check_state(&cb, &m, &pool);
+    while(model_used(&m) > 0){
+        op_peek_pop(&cb, &m, cap);
+    }
+    check_state(&cb, &m, &pool);
+
+    cb_destroy(&cb);
+    CHECK(pool.in_use == 0, "%zu chunks leaked", pool.in_use);
+    cb_pool_destroy(&pool);
+    free(m.data);
+}
+
+/* Reads that get nothing (EAGAIN, then EOF) must not keep the chunks reserved for them */
+static void test_fd_empty(enum backend b, size_t capacity){
+    cb_pool pool;
+    circular_buffer cb;
+    struct model m = { malloc(MODEL_SIZE), 0, 0, 0 };
+    int fds[2];
+    CHECK(cb_pool_init(&pool, TEST_POOL_CHUNKS * CB_CHUNK_SIZE, 0) == CB_SUCCESS, "pool init");
+    CHECK(buffer_init(&cb, b, capacity, &pool) == CB_SUCCESS, "init of %zu", capacity);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0, "socketpair");
+
+    long n = cb_recv_from_fd(&cb, fds[1]);
+    CHECK(n == -1 && errno == EAGAIN, "recv from empty socket returned %ld (%s)", n, strerror(errno));
+    check_state(&cb, &m, &pool);
+    CHECK(pool.in_use == 0, "%zu chunks held after EAGAIN", pool.in_use);
+
+    op_push_back(&cb, &m, cb.max_cap / 2 + 1);
+    op_fd_roundtrip(&cb, &m, fds);
+    while(model_used(&m) > 0){
+        op_peek_pop(&cb, &m, cb.max_cap);
+    }
+    check_state(&cb, &m, &pool);
+    CHECK(pool.in_use == 0, "%zu chunks held by the drained buffer", pool.in_use);
+
+    shutdown(fds[0], SHUT_WR);
+    n = cb_recv_from_fd(&cb, fds[1]);
+    CHECK(n == 0, "recv at end of file returned %ld (%s)", n, strerror(errno));
+    check_state(&cb, &m, &pool);
+    CHECK(pool.in_use == 0, "%zu chunks held after EOF", pool.in_use);
+
+    cb_destroy(&cb);
+    cb_pool_destroy(&pool);
+    close(fds[0]);
+    close(fds[1]);
+    free(m.data);
+}
+
+/* An exhausted pool stops the buffer from growing: pushes fail whole, reads get ENOBUFS, and the
+ * buffer takes data again once chunks are given back
+ */
+static void test_pool_exhausted(void){
+    cb_pool pool;
+    circular_buffer cb;
+    struct model m = { malloc(MODEL_SIZE), 0, 0, 0 };
+    struct iovec iov[2];
+    int fds[2];
+    CHECK(cb_pool_init(&pool, CB_CHUNK_SIZE, 0) == CB_SUCCESS, "pool init");
+    CHECK(cb_init_pooled(&cb, 3 * CB_CHUNK_SIZE, &pool) == CB_SUCCESS, "init");
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0, "socketpair");
+
+    op_push_back(&cb, &m, CB_CHUNK_SIZE / 2);
+    int ret = cb_push_back(&cb, "x", CB_CHUNK_SIZE); // Needs a second chunk
+    CHECK(ret == CB_OVERFLOW_ERROR, "push beyond the pool returned %d", ret);
+    check_state(&cb, &m, &pool);
+    CHECK(cb_can_push(&cb), "room left in the held chunk");
+    op_push_back(&cb, &m, CB_CHUNK_SIZE / 2);
+    check_state(&cb, &m, &pool);
+
+    CHECK(!cb_can_push(&cb) && cb_free_cp(&cb) > 0, "exhausted pool reported as pushable");
+    CHECK(cb_peek_free(&cb, iov) == 0, "span offered without a chunk");
+    long n = cb_recv_from_fd(&cb, fds[1]);
+    CHECK(n == -1 && errno == ENOBUFS, "recv with an exhausted pool returned %ld (%s)", n, strerror(errno));
+    check_state(&cb, &m, &pool);
+    CHECK(pool.exhausted > 0 && pool.in_use == 1, "exhausted %llu, %zu in use", pool.exhausted, pool.in_use);
+
+    op_pop_front(&cb, &m, CB_CHUNK_SIZE);
+    check_state(&cb, &m, &pool);
+    CHECK(cb_can_push(&cb) && pool.in_use == 0, "chunk not given back");
+    op_push_back(&cb, &m, CB_CHUNK_SIZE);
+    check_state(&cb, &m, &pool);
+
+    cb_destroy(&cb);
+    CHECK(pool.in_use == 0, "%zu chunks leaked", pool.in_use);
+    cb_pool_destroy(&pool);
+    close(fds[0]);
+    close(fds[1]);
+    free(m.data);
+}
+
+/*SPSC: one producer and one consumer thread move a counting byte sequence*/
+struct spsc_job{
+    spsc_buffer rb;
+    size_t total;
+};
+
+static void *spsc_producer(void *arg){
+    struct spsc_job *job = arg;
+    struct iovec iov[2];
+    unsigned char next = 0;
+    size_t pushed = 0;
+    while(pushed < job->total && spsc_wait_free(&job->rb) == 0){
+        int cnt = spsc_peek_free(&job->rb, iov);
+        size_t n = 0, want = 1 + rand() % 5000;
+        for(int i = 0; i < cnt && n < want && pushed + n < job->total; i++){
+            size_t len = iov[i].iov_len;
+            len = len < want - n ? len : want - n;
+            len = len < job->total - pushed - n ? len : job->total - pushed - n;
+            for(size_t j = 0; j < len; j++){
+                ((unsigned char *)iov[i].iov_base)[j] = next++;
+            }
+            n += len;
+        }
+        spsc_commit_push(&job->rb, n);
+        pushed += n;
+    }
+    spsc_close(&job->rb);
+    return NULL;
+}
+
+static void test_spsc(size_t capacity, size_t total){
+    struct spsc_job job;
+    struct iovec iov[2];
+    pthread_t producer;
+    unsigned char next = 0;
+    size_t popped = 0;
+    CHECK(spsc_init(&job.rb, capacity) == CB_SUCCESS, "spsc init of %zu", capacity);
+    job.total = total;
+    CHECK(pthread_create(&producer, NULL, spsc_producer, &job) == 0, "thread");
+    while(spsc_wait_data(&job.rb) == 0){
+        int cnt = spsc_peek_data(&job.rb, iov);
+        size_t n = 0;
+        CHECK(cnt > 0, "no data after wait");
+        for(int i = 0; i < cnt; i++){
+            for(size_t j = 0; j < iov[i].iov_len; j++){
+                CHECK(((unsigned char *)iov[i].iov_base)[j] == next, "byte %zu differs", popped + n + j);
+                next++;
+            }
+            n += iov[i].iov_len;
+        }
+        CHECK(spsc_used_cp(&job.rb) >= n, "used %zu below peeked %zu", spsc_used_cp(&job.rb), n);
+        spsc_commit_pop(&job.rb, n);
+        popped += n;
+    }
+    pthread_join(producer, NULL);
+    CHECK(popped == total, "popped %zu of %zu", popped, total);
+    spsc_destroy(&job.rb);
+}
+
+int main(int argc, char *argv[]){
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    size_t capacities[] = { 1, 2, 3, 7, 64, 4095, 4096, 65536, 146000, 3 * CB_CHUNK_SIZE + 5 };
+
+    srand(seed);
+    for(int b = PLAIN; b <= POOLED; b++){
+        for(size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++){
+            size_t capacity = capacities[i];
+            if(b == POOLED && capacity > 4 * CB_CHUNK_SIZE){
+                continue;
+            }
+            test_edges(b, capacity);
+            test_fd_empty(b, capacity);
+            test_random(b, capacity, capacity < 4096 ? iterations / 10 : iterations / 4);
+            printf("%-6s capacity %7zu: ok\n", backend_names[b], capacity);
+        }
+    }
+    test_pool_exhausted();
+    printf("pool exhaustion: ok\n");
+    test_spsc(4096, 64 << 20);
+    test_spsc(146000, 256 << 20);
+    printf("spsc: ok\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "hist.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Bucket holding a value: values below HIST_SUB_BUCKETS are exact, above that
+ * every power of two range is split into HIST_SUB_BUCKETS equal sub-buckets
+ */
+static unsigned hist_index(unsigned long long value){
+    if(value < HIST_SUB_BUCKETS){
+        return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (unsigned)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Largest value falling into a bucket */
+static unsigned long long hist_bucket_max(unsigned index){
+    if(index < HIST_SUB_BUCKETS){
+        return index;
+    }
+    unsigned shift = index / HIST_SUB_BUCKETS - 1;
+    unsigned long long sub = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+/* Clear a histogram
+ * Arguments:
+ *   latency_hist *h - histogram
+ * Return Value:
+ *   None
+ */
+void hist_reset(latency_hist *h){
+    memset(h, 0, sizeof(latency_hist));
+}
+
+/* Add count occurrences of a value
+ * Arguments:
+ *   latency_hist *h          - histogram
+ *   unsigned long long value - recorded value
+ *   unsigned long long count - weight of the value
+ * Return Value:
+ *   None
+ */
+void hist_record(latency_hist *h, unsigned long long value, unsigned long long count){
+    h->counts[hist_index(value)] += count;
+    h->total += count;
+    if(value > h->max){
+        h->max = value;
+    }
+}
+
+/* Add all counts of one histogram to another
+ * Arguments:
+ *   latency_hist *dst       - histogram receiving the counts
+ *   const latency_hist *src - histogram to add
+ * Return Value:
+ *   None
+ */
+void hist_merge(latency_hist *dst, const latency_hist *src){
+    if(src->total == 0){
+        return;
+    }
+    for(int i=0;i<HIST_BUCKETS;i++){
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    if(src->max > dst->max){
+        dst->max = src->max;
+    }
+}
+
+/* Value below which a given share of the counts falls
+ * Arguments:
+ *   const latency_hist *h - histogram
+ *   double percentile     - share in percent (0-100)
+ * Return Value:
+ *   Upper bound of the bucket reaching the percentile (capped at the exact max), 0 when empty
+ */
+unsigned long long hist_percentile(const latency_hist *h, double percentile){
+    if(h->total == 0){
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(h->total * percentile / 100.0);
+    unsigned long long seen = 0;
+    if(target == 0){
+        target = 1;
+    }
+    for(int i=0;i<HIST_BUCKETS;i++){
+        seen += h->counts[i];
+        if(seen >= target){
+            unsigned long long value = hist_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Print the usual percentiles of a histogram of nanoseconds in microseconds
+ * Arguments:
+ *   const char *label     - line prefix
+ *   const latency_hist *h - histogram
+ * Return Value:
+ *   None
+ */
+void hist_print(const char *label, const latency_hist *h){
+    if(h->total == 0){
+        return;
+    }
+    printf("%sp50: %.1f us, p90: %.1f us, p99: %.1f us, p99.9: %.1f us, Max: %.1f us\n", label,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
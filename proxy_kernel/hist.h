@@ -0,0 +1,23 @@
+#ifndef HIST_H
+#define HIST_H
+
+#define HIST_SUB_BITS    5   /* 32 linear sub-buckets per power of two, values within ~3% */
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/* HDR-style log-bucketed histogram of 64 bit values, fixed size and allocation free.
+ * Counts are weights, so a value can stand for many samples (e.g. bytes).
+ */
+typedef struct latency_hist {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;     // Sum of all counts
+    unsigned long long max;       // Largest value recorded, exact
+} latency_hist;
+
+void hist_reset(latency_hist *h);
+void hist_record(latency_hist *h, unsigned long long value, unsigned long long count);
+void hist_merge(latency_hist *dst, const latency_hist *src);
+unsigned long long hist_percentile(const latency_hist *h, double percentile);
+void hist_print(const char *label, const latency_hist *h);
+
+#endif
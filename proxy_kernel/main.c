@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -8,39 +9,795 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "cbuf.h"
-
-#define CIRCULAR_BUFFER_SIZE 146000
-#define MAX_EVENTS 10
-#define EPOLL_TIMEOUT_MILLIS 30000
-
-#define PROXY_IP "127.0.0.1"
-#define PROXY_PORT 1234
-#define REMOTE_IP "127.0.0.1"
-#define REMOTE_PORT 5678
+#include "proxy.h"
+#include "report.h"
+#include "tune.h"
 
 unsigned long long upstream = 0;
 unsigned long long downstream = 0;
-clock_t start_time,difference;
+struct timespec start_time;            // CLOCK_MONOTONIC, rates are over wall time
+
+int sessions_served = 0;
+int (*buffer_init)(circular_buffer *, size_t) = cb_init; // Circular buffer backend
+size_t buffer_size = CIRCULAR_BUFFER_SIZE;  // Capacity of each direction of a session
+int edge_triggered = 0;               // Register sessions with EPOLLET and drain until EAGAIN
+int use_uring = 0;                    // io_uring data path, falls back to epoll when unavailable
+int thread_per_direction = 0;         // Sessions relay with one thread per socket and direction
+size_t buffer_pool_size = 0;          // Per worker chunk slab, session buffers are pooled when non-zero
+int buffer_pool_hugepages = 0;        // Back the slabs with huge pages when available
+double report_period = REPORT_INTERVAL; // Seconds between per worker interval reports, 0 disables them
+size_t adapt_min = 0;                 // Bounds of BDP-adaptive buffer sizing, disabled while adapt_max is 0
+size_t adapt_max = 0;
+int adapt_socket_buffers = 0;         // Adaptive sizing also sets SO_RCVBUF/SO_SNDBUF of the sockets
+const tune_profile *client_profile = NULL;   // Socket options of the listeners and accepted clients
+const tune_profile *upstream_profile = NULL; // Socket options of the connections to the remote server
+int connect_timeout = CONNECT_TIMEOUT_MILLIS; // Milliseconds a session waits for the remote handshake
+tcpinfo_sampler upstream_sampler;      // TCP_INFO of the remote sockets, started by -L
+unsigned long long syscalls = 0;
+unsigned long long reads = 0;
+unsigned long long writes = 0;
+latency_hist up_residence;             // All workers, filled at shutdown
+latency_hist down_residence;
+latency_hist connect_latency;          // Remote handshakes of all workers
+unsigned long long connect_failures = 0;
+unsigned long long connect_timeouts = 0;
 
 void stats(){
-    clock_t difference = clock() - start_time;
-    double time_taken = ((double)difference)/CLOCKS_PER_SEC; // in seconds
-    upstream = upstream / 1000000;
-    downstream = downstream / 1000000;
-    printf("UpStream: Data: %llu MB, Rate: %lf Gbps\n",upstream,(upstream*0.008)/time_taken);
-    printf("DownStream: Data: %llu MB, Rate: %lf Gbps\n",downstream,(downstream*0.008)/time_taken);
+    report_counters total = { upstream, downstream, reads, writes, syscalls };
+    printf("Sessions Served: %d\n",sessions_served);
+    report_summary(&start_time, &total);
+    hist_print("UpStream Residence: ", &up_residence);
+    hist_print("DownStream Residence: ", &down_residence);
+    if(connect_latency.total > 0 || connect_failures > 0){ // Backend handshake cost, apart from the data path
+        printf("Remote Connects: %llu, Failures: %llu, Timeouts: %llu\n",
+                connect_latency.total,connect_failures,connect_timeouts);
+        hist_print("Remote Connect Latency: ", &connect_latency);
+    }
+    backends_print();
+}
+
+/* Initialize one direction of session buffering with the selected backend
+ * Arguments:
+ *   struct worker *w    - worker owning the session
+ *   circular_buffer *cb - buffer to initialize
+ * Return Value:
+ *   CB_SUCCESS on success
+ *   CB_MEMORY_ERROR on error
+ */
+int session_buffer_init(struct worker *w, circular_buffer *cb){
+    if(buffer_pool_size > 0){
+        return cb_init_pooled(cb, buffer_size, &w->pool);
+    }
+    return buffer_init(cb, buffer_size);
+}
+
+/* Create a socket for a remote server, tuned with the upstream profile
+ * Arguments:
+ *   int type - socket type flags, SOCK_STREAM optionally with SOCK_NONBLOCK
+ * Return Value:
+ *   Unconnected socket on success
+ *   -1 on error
+ */
+static int remote_socket(int type){
+    int remote_fd = socket(AF_INET,type,0);
+    if(remote_fd < 0){
+        perror("Failed to Create Socket for Remote Server");
+        return -1;
+    }
+    tune_apply(remote_fd, upstream_profile); // Before connect() so the window scale covers the buffers
+    return remote_fd;
+}
+
+/* Open a connection to a remote server, waiting up to connect_timeout for the handshake
+ * Arguments:
+ *   backend *b          - server to connect to
+ *   const int *stopping - the wait is abandoned once this is set by another thread
+ * Return Value:
+ *   Connected blocking socket on success
+ *   -1 on error (errno of the failed handshake is kept, ETIMEDOUT on timeout, ECANCELED when stopped)
+ */
+int remote_connect(backend *b, const int *stopping){
+    struct timespec start;
+    struct pollfd pfd;
+    int err = 0, ret;
+
+    /*Connection to the Remote Server*/
+    int remote_fd = remote_socket(SOCK_STREAM | SOCK_NONBLOCK);
+    if(remote_fd < 0){
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(connect(remote_fd,(const struct sockaddr*)&b->addr,sizeof(struct sockaddr_in))<0){
+        err = errno == EINPROGRESS ? 0 : errno;
+        pfd.fd = remote_fd;
+        pfd.events = POLLOUT;
+        while(err == 0){ // Polled in slices so a stop is noticed while the backend does not answer
+            int left = connect_timeout - (int)(elapsed_seconds(&start) * 1e3);
+            if(__atomic_load_n(stopping, __ATOMIC_RELAXED)){
+                err = ECANCELED;
+            }
+            else if(left <= 0){
+                err = ETIMEDOUT;
+            }
+            else if((ret = poll(&pfd, 1, left < CONNECT_STOP_CHECK_MILLIS ? left : CONNECT_STOP_CHECK_MILLIS)) > 0){
+                err = socket_error(remote_fd);
+                break;
+            }
+            else if(ret < 0 && errno != EINTR){
+                err = errno;
+            }
+        }
+    }
+    if(err != 0){
+        close(remote_fd);
+        errno = err;
+        return -1;
+    }
+    fcntl(remote_fd, F_SETFL, fcntl(remote_fd, F_GETFL) & ~O_NONBLOCK);
+    return remote_fd;
+}
+
+/* Pick a backend for a new session and get a connection to it without blocking
+ * Arguments:
+ *   backend **b     - set to the backend, released with backend_release() when the session ends
+ *   int *connecting - set when the handshake is still in progress
+ * Return Value:
+ *   Warm connection from the backend pool (blocking socket) when one is available,
+ *   otherwise a non-blocking socket, writable once connect() completes
+ *   -1 on error (the backend is released)
+ */
+int remote_open(backend **b, int *connecting){
+    *connecting = 0;
+    *b = backend_pick();
+    int remote_fd = upstream_pool_take(&(*b)->pool);
+    if(remote_fd >= 0){
+        return remote_fd;
+    }
+    remote_fd = remote_socket(SOCK_STREAM | SOCK_NONBLOCK);
+    if(remote_fd < 0){
+        backend_release(*b, 0, 0);
+        return -1;
+    }
+    if(connect(remote_fd,(const struct sockaddr*)&(*b)->addr,sizeof(struct sockaddr_in))<0){
+        if(errno != EINPROGRESS){
+            fprintf(stderr, "Failed to Connect to Backend %s: %s\n", (*b)->name, strerror(errno));
+            backend_connect_done(*b, errno, 0);
+            backend_release(*b, 0, 0);
+            close(remote_fd);
+            return -1;
+        }
+        *connecting = 1;
+    }
+    return remote_fd;
+}
+
+/* Take the pending error of a socket, e.g. the result of a non-blocking connect() once writable
+ * Arguments:
+ *   int fd - socket to query
+ * Return Value:
+ *   0 when no error is pending, its errno otherwise
+ */
+int socket_error(int fd){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0){
+        return errno;
+    }
+    return err;
 }
-int main(){
-    int proxy_fd = 0, client_fd = 0, remote_fd = 0;
-    struct sockaddr_in proxy_addr,client_addr,remote_addr;
-    circular_buffer client_buffer, remote_buffer;
-    /*Create Proxy Socket*/
-    proxy_fd = socket(AF_INET,SOCK_STREAM,0);
+
+/* Connect an accepted client to the remote server and start relaying
+ * The handshake with the remote server completes in the event loop, bytes
+ * the client sends meanwhile are buffered in client_buffer.
+ * Arguments:
+ *   struct worker *w                - worker the session will belong to
+ *   int client_fd                   - accepted client socket
+ *   struct sockaddr_in *client_addr - address of the client
+ * Return Value:
+ *   Newly created session on success
+ *   NULL on error (client_fd is closed, the proxy keeps serving other sessions)
+ */
+struct session *session_open(struct worker *w, int client_fd, struct sockaddr_in *client_addr){
+    int connecting;
+    backend *b;
+    int remote_fd = remote_open(&b, &connecting);
+    if(remote_fd < 0){
+        close(client_fd);
+        return NULL;
+    }
+
+    struct session *s = calloc(1, sizeof(struct session));
+    if(s == NULL){
+        perror("Failed to Allocate Session");
+        close(client_fd);
+        close(remote_fd);
+        backend_release(b, 0, 0);
+        return NULL;
+    }
+
+    /*Application Level Buffer Allocation*/
+    if (CB_SUCCESS != session_buffer_init(w, &s->client_buffer)){
+        perror("MEM error when init\n");
+        close(client_fd);
+        close(remote_fd);
+        backend_release(b, 0, 0);
+        free(s);
+        return NULL;
+    }
+    if (CB_SUCCESS != session_buffer_init(w, &s->remote_buffer)){
+        perror("MEM error when init\n");
+        cb_destroy(&s->client_buffer);
+        close(client_fd);
+        close(remote_fd);
+        backend_release(b, 0, 0);
+        free(s);
+        return NULL;
+    }
+
+    cb_residence_init(&s->client_buffer, &w->up_residence);
+    cb_residence_init(&s->remote_buffer, &w->down_residence);
+
+    s->worker = w;
+    s->client.fd = client_fd;
+    s->client.session = s;
+    s->client.rx_buffer = &s->client_buffer;
+    s->client.tx_buffer = &s->remote_buffer;
+    s->remote.fd = remote_fd;
+    s->remote.session = s;
+    s->remote.rx_buffer = &s->remote_buffer;
+    s->remote.tx_buffer = &s->client_buffer;
+    s->client.slot = -1;
+    s->remote.slot = -1;
+    s->backend = b;
+    s->connecting = connecting;
+    clock_gettime(CLOCK_MONOTONIC, &s->connect_start);
+    s->connected = s->connect_start;
+
+    if(!w->use_uring && session_epoll_start(s) != 0){
+        perror("Failed to Register Session Socket FDs to Epoll");
+        cb_destroy(&s->client_buffer);
+        cb_destroy(&s->remote_buffer);
+        close(client_fd);
+        close(remote_fd);
+        backend_release(b, 0, 0);
+        free(s);
+        return NULL;
+    }
+
+    s->id = w->next_session_id++;
+    s->next = w->sessions;
+    if(w->sessions != NULL){
+        w->sessions->prev = s;
+    }
+    w->sessions = s;
+    w->active_sessions++;
+    w->connecting_sessions += connecting;
+    tcpinfo_watch(&upstream_sampler, remote_fd, w->id, s->id);
+
+    printf("Session %d.%d: Client %s:%d <-> Remote %s, Active: %d\n",w->id,s->id,
+            inet_ntoa(client_addr->sin_addr),ntohs(client_addr->sin_port),
+            b->name,w->active_sessions);
+    if(w->use_uring){ // Once listed, a failed handshake closes the session
+        session_uring_start(s);
+    }
+    return s;
+}
+
+/* Make session sockets non-blocking and register them to the worker epoll
+ * Arguments:
+ *   struct session *s - newly opened session
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int session_epoll_start(struct session *s){
+    struct worker *w = s->worker;
+
+    /*Sockets never block the loop, partial transfers stay in the buffers.
+      Clients are accepted non-blocking, warm connections from the pool are not*/
+    if(!s->connecting){
+        fcntl(s->remote.fd, F_SETFL, fcntl(s->remote.fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    /*Registering socket fd to epoll, EPOLLOUT is only armed once a write would block
+      or to learn that the remote handshake completed*/
+    struct epoll_event client_event,remote_event;
+    s->client.interest = edge_triggered ? (EPOLLIN | EPOLLOUT | EPOLLET) : EPOLLIN;
+    s->client.readable = 1;
+    s->client.writable = 1;
+    s->remote.interest = edge_triggered ? s->client.interest : s->connecting ? EPOLLOUT : EPOLLIN;
+    s->remote.readable = !s->connecting;
+    s->remote.writable = !s->connecting;
+    client_event.events = s->client.interest;
+    client_event.data.ptr = &s->client;
+    remote_event.events = s->remote.interest;
+    remote_event.data.ptr = &s->remote;
+
+    w->syscalls += 2;
+    if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, s->client.fd, &client_event)!=0 ||
+       epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, s->remote.fd, &remote_event)!=0){
+        return -1;
+    }
+    return 0;
+}
+
+/* Accept the pending clients on the worker listener
+ * Arguments:
+ *   struct worker *w - worker whose listener is readable
+ * Return Value:
+ *   None
+ * Note: the listener is non-blocking, at most MAX_EVENTS clients are accepted per
+ *       call so a burst of connections cannot starve the established sessions
+ */
+void listener_accept(struct worker *w){
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_size;
+
+    for(int i=0;i<MAX_EVENTS;i++){
+        client_addr_size = sizeof(client_addr);
+        w->syscalls++;
+        int client_fd = accept4(w->listener.fd,(struct sockaddr*)&client_addr,&client_addr_size,
+                                thread_per_direction ? 0 : SOCK_NONBLOCK); // Relay threads block
+        if(client_fd<0)
+        {
+            if(errno == ECONNABORTED || errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                perror("Proxy Failed to Accept the Client Connection");
+            }
+            return;
+        }
+        tune_apply(client_fd, client_profile); // Most options are inherited from the listener, TCP_QUICKACK is not
+        if(thread_per_direction){
+            threaded_session_open(w, client_fd, &client_addr);
+        }
+        else{
+            session_open(w, client_fd, &client_addr);
+        }
+    }
+}
+
+/* Finish the remote handshake of a session
+ * Arguments:
+ *   struct session *s - connecting session
+ *   int err           - socket_error() of the remote socket, ETIMEDOUT when the connect timeout expired
+ * Return Value:
+ *   0 when connected, both directions can relay
+ *   -1 when the handshake failed and the session was closed
+ */
+int session_connected(struct session *s, int err){
+    struct worker *w = s->worker;
+
+    s->connecting = 0;
+    w->connecting_sessions--;
+    if(err != 0){
+        printf("Session %d.%d: Failed to Connect to Backend %s: %s\n",w->id,s->id,s->backend->name,strerror(err));
+        w->connect_failures++;
+        w->connect_timeouts += (err == ETIMEDOUT);
+        backend_connect_done(s->backend, err, 0);
+        session_close(s);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->connected);
+    double seconds = elapsed_seconds(&s->connect_start);
+    hist_record(&w->connect_latency, seconds * 1e9, 1);
+    backend_connect_done(s->backend, 0, seconds);
+    s->remote.readable = 1;
+    s->remote.writable = 1;
+    return 0;
+}
+
+/* Feed the time the backend took to send its first byte to the balancing
+ * Arguments:
+ *   struct session *s - session that received its first byte from the backend
+ * Return Value:
+ *   None
+ */
+void session_first_byte(struct session *s){
+    s->first_byte = 1;
+    backend_first_byte(s->backend, elapsed_seconds(&s->connected));
+}
+
+/* Close the sessions whose remote handshake outlived the connect timeout
+ * Arguments:
+ *   struct worker *w - worker owning the sessions
+ * Return Value:
+ *   Milliseconds until the next handshake deadline, EPOLL_TIMEOUT_MILLIS when none is pending
+ */
+int worker_expire_connects(struct worker *w){
+    int wait = EPOLL_TIMEOUT_MILLIS;
+    struct session *next;
+
+    if(w->connecting_sessions == 0){
+        return wait;
+    }
+    for(struct session *s = w->sessions; s != NULL; s = next){
+        next = s->next;
+        if(!s->connecting){
+            continue;
+        }
+        int left = connect_timeout - (int)(elapsed_seconds(&s->connect_start) * 1e3);
+        if(left <= 0){
+            session_connected(s, ETIMEDOUT);
+        }
+        else{
+            wait = MIN(wait, left);
+        }
+    }
+    return wait;
+}
+
+/* Forward the end of the stream of each direction once everything before it was relayed
+ * Arguments:
+ *   struct session *s - session to check
+ * Return Value:
+ *   1 when both directions are finished and the session was closed
+ *   0 otherwise
+ */
+int session_forward_eof(struct session *s){
+    struct endpoint *src, *dst;
+
+    if(s->connecting){ // Early client bytes and EOF wait for the handshake
+        return 0;
+    }
+    for(int i=0;i<2;i++){
+        src = i == 0 ? &s->client : &s->remote;
+        dst = i == 0 ? &s->remote : &s->client;
+        if(src->eof && !src->eof_forwarded && cb_used_cp(src->rx_buffer) == 0 && !dst->send_inflight){
+            s->worker->syscalls++;
+            shutdown(dst->fd, SHUT_WR); // Half-close, the other direction keeps running
+            src->eof_forwarded = 1;
+        }
+    }
+    if(s->client.eof_forwarded && s->remote.eof_forwarded){
+        session_close(s);
+        return 1;
+    }
+    return 0;
+}
+
+/* Tear down a session: shut down both sockets and move it to the closed list
+ * Arguments:
+ *   struct session *s - session to close
+ * Return Value:
+ *   None
+ * Note: sockets and memory are released by session_reap() once no epoll event
+ *       of the current batch or in-flight io_uring request references the session
+ */
+void session_close(struct session *s){
+    struct worker *w = s->worker;
+    if(s->closed){
+        return;
+    }
+    s->closed = 1;
+    if(s->connecting){
+        s->connecting = 0;
+        w->connecting_sessions--;
+    }
+    tcpinfo_unwatch(&upstream_sampler, s->remote.fd); // Before the fd can be closed and reused
+    shutdown(s->client.fd, SHUT_RDWR); // Also completes in-flight io_uring requests
+    shutdown(s->remote.fd, SHUT_RDWR);
+    printf("Session %d.%d Closed: UpStream: %llu B, DownStream: %llu B\n",
+            w->id,s->id,s->upstream,s->downstream);
+    backend_release(s->backend, s->upstream, s->downstream);
+
+    if(s->prev != NULL){
+        s->prev->next = s->next;
+    }
+    else{
+        w->sessions = s->next;
+    }
+    if(s->next != NULL){
+        s->next->prev = s->prev;
+    }
+    s->prev = NULL;
+    s->next = w->closed_sessions;
+    w->closed_sessions = s;
+    w->active_sessions--;
+}
+
+/* Free closed sessions that no pending event or request references anymore
+ * Arguments:
+ *   struct worker *w - worker owning the sessions
+ * Return Value:
+ *   None
+ */
+void session_reap(struct worker *w){
+    struct session **link = &w->closed_sessions;
+    while(*link != NULL){
+        struct session *s = *link;
+        if(s->client.recv_inflight || s->client.send_inflight ||
+           s->remote.recv_inflight || s->remote.send_inflight || s->connect_inflight){
+            link = &s->next;
+            continue;
+        }
+        *link = s->next;
+        if(s->client.slot >= 0){
+            uring_update_file(&w->ring, s->client.slot, -1);
+        }
+        if(s->remote.slot >= 0){
+            uring_update_file(&w->ring, s->remote.slot, -1);
+        }
+        close(s->client.fd);
+        close(s->remote.fd);
+        cb_destroy(&s->client_buffer);
+        cb_destroy(&s->remote_buffer);
+        free(s);
+    }
+}
+
+/* Check whether an endpoint can read into its buffer now
+ * Arguments:
+ *   struct endpoint *ep - endpoint to check
+ * Return Value:
+ *   1 when a read can store data
+ *   0 at EOF, when the buffer is full or when its pool has no free chunk (the worker is then
+ *   flagged so worker_pool_wake() retries once chunks are given back)
+ */
+int endpoint_rx_room(struct endpoint *ep){
+    if(ep->eof){
+        return 0;
+    }
+    if(cb_can_push(ep->rx_buffer)){
+        return 1;
+    }
+    if(cb_free_cp(ep->rx_buffer) > 0){ // Pool exhausted, TCP pushes back until chunks come back
+        ep->session->worker->pool_starved = 1;
+    }
+    return 0;
+}
+
+/* Move data from one side of a session to the other through the circular buffer
+ * Arguments:
+ *   struct endpoint *src - side data is read from
+ *   struct endpoint *dst - side data is written to
+ * Return Value:
+ *   Bytes read plus bytes written (0 when nothing could be moved)
+ *   -1 when the session has to be closed
+ */
+long endpoint_transfer(struct endpoint *src, struct endpoint *dst){
+    struct session *s = src->session;
+    circular_buffer *cb = src->rx_buffer;
+    int src_is_client = (src == &s->client);
+    long progress = 0, n;
+
+    if(src->readable && endpoint_rx_room(src)){
+        s->worker->syscalls++;
+        s->worker->reads++;
+        n = cb_recv_from_fd(cb, src->fd);
+        if(n>0){
+            progress += n;
+            if(!src_is_client && !s->first_byte){
+                session_first_byte(s);
+            }
+        }
+        else if(n == 0){ // Buffered bytes are still relayed, session_forward_eof() half-closes dst after them
+            printf("Session %d.%d: %s Terminated the Connection\n",
+                    s->worker->id,s->id,src_is_client ? "Client" : "Remote Endpoint");
+            src->eof = 1;
+            src->readable = 0;
+        }
+        else if(errno == EAGAIN){
+            src->readable = 0;
+        }
+        else if(errno != EINTR){
+            perror(src_is_client ? "Client Socket Error" : "Remote Socket Error");
+            return -1;
+        }
+    }
+
+    long pending = cb_used_cp(cb);
+    if(dst->writable && pending>0){
+        /*Only the bytes accepted by the kernel are removed from the buffer*/
+        s->worker->syscalls++;
+        s->worker->writes++;
+        n = cb_send_to_fd(cb, dst->fd);
+        if(n>0){
+            progress += n;
+            if(n < pending && cb->pool == NULL){ // Socket buffer is full, wait for EPOLLOUT
+                dst->writable = 0;                // Pooled spans end at chunk boundaries, only EAGAIN tells
+            }
+            if(src_is_client){
+                s->upstream += n;
+                s->worker->upstream += n;
+            }
+            else{
+                s->downstream += n;
+                s->worker->downstream += n;
+            }
+        }
+        else if(errno == EAGAIN){
+            dst->writable = 0;
+        }
+        else if(errno != EINTR){
+            perror(src_is_client ? "Remote Send Failure" : "Client Send Failure");
+            return -1;
+        }
+    }
+    return progress;
+}
+
+/* Register the events an endpoint is currently able to act on
+ * Arguments:
+ *   int epoll_fd        - epoll instance the endpoint is registered to
+ *   struct endpoint *ep - endpoint to update
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int endpoint_interest(int epoll_fd, struct endpoint *ep){
+    if(edge_triggered){ // Registered once for both events, readiness tracked by the flags
+        return 0;
+    }
+
+    uint32_t want = 0;
+    if(ep->session->connecting && ep == &ep->session->remote){ // Writable once the handshake completes
+        want = EPOLLOUT;
+    }
+    else{
+        if(endpoint_rx_room(ep)){ // A full buffer stops reading so TCP pushes back on the sender
+            want |= EPOLLIN;
+        }
+        if(!ep->writable && cb_used_cp(ep->tx_buffer)>0){
+            want |= EPOLLOUT;
+        }
+    }
+    if(want == ep->interest){
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = want;
+    event.data.ptr = ep;
+    ep->session->worker->syscalls++;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ep->fd, &event) != 0){
+        return -1;
+    }
+    ep->interest = want;
+    return 0;
+}
+
+/* Handle readiness on one side of a session
+ * Arguments:
+ *   struct endpoint *ep - endpoint reported by epoll
+ *   uint32_t events     - ready events
+ * Return Value:
+ *   None
+ */
+void endpoint_event(struct endpoint *ep, uint32_t events){
+    struct session *s = ep->session;
+    int epoll_fd = s->worker->epoll_fd;
+    long up, down;
+
+    if(s->connecting && ep == &s->remote){ // Any event ends the handshake, SO_ERROR tells how
+        if(session_connected(s, socket_error(ep->fd)) != 0){
+            return;
+        }
+    }
+    else if((events & EPOLLERR) && ep->eof){ // No read left to surface the error
+        errno = socket_error(ep->fd);
+        perror(ep == &s->client ? "Client Socket Error" : "Remote Socket Error");
+        session_close(s);
+        return;
+    }
+    else if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){ // Errors surface through the next read
+        ep->readable = 1;
+    }
+    if(events & EPOLLOUT){
+        ep->writable = 1;
+    }
+
+    /*Service both directions, new space or data on one side may unblock the other*/
+    do{
+        up = endpoint_transfer(&s->client, &s->remote);
+        if(up < 0){
+            session_close(s);
+            return;
+        }
+        down = endpoint_transfer(&s->remote, &s->client);
+        if(down < 0){
+            session_close(s);
+            return;
+        }
+    }while(edge_triggered && (up > 0 || down > 0));
+    if(session_forward_eof(s)){
+        return;
+    }
+
+    if(!edge_triggered){ // Level triggered epoll reports remaining input again
+        s->client.readable = 0;
+        s->remote.readable = 0;
+    }
+    if(endpoint_interest(epoll_fd, &s->client) != 0 ||
+       endpoint_interest(epoll_fd, &s->remote) != 0){
+        perror("Failed to Update Epoll Interest");
+        session_close(s);
+    }
+}
+
+/* Apply the buffer capacities decided by worker_adapt()
+ * Arguments:
+ *   struct session *s - session to resize
+ * Return Value:
+ *   None
+ * Note: a buffer is only resized while no io_uring request references it,
+ *       a shrink waits until the buffered data fits the new capacity
+ */
+void session_buffers_resize(struct session *s){
+    struct worker *w = s->worker;
+    struct endpoint *src, *dst;
+    int resized = 0;
+
+    for(int i=0;i<2;i++){
+        src = i == 0 ? &s->client : &s->remote;
+        dst = i == 0 ? &s->remote : &s->client;
+        if(src->rx_resize == 0 || src->recv_inflight || dst->send_inflight){
+            continue;
+        }
+        size_t capacity = src->rx_buffer->max_cap;
+        int ret = cb_resize(src->rx_buffer, src->rx_resize);
+        if(ret == CB_OVERFLOW_ERROR){
+            continue;
+        }
+        if(ret != CB_SUCCESS){
+            perror("Failed to Resize Session Buffer");
+            src->rx_resize = 0;
+            continue;
+        }
+        if(adapt_socket_buffers){ // Kernel doubles the values for its bookkeeping
+            int size = MIN(src->rx_resize, (size_t)1 << 30);
+            w->syscalls += 2;
+            setsockopt(src->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            setsockopt(dst->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+        if(src->rx_buffer->max_cap > capacity){
+            w->buffers_grown++;
+        }
+        else if(src->rx_buffer->max_cap < capacity){
+            w->buffers_shrunk++;
+        }
+        w->largest_buffer = MAX(w->largest_buffer, src->rx_buffer->max_cap);
+        src->rx_resize = 0;
+        resized = 1;
+    }
+
+    /*New space is only noticed by epoll once serviced, io_uring completions re-arm themselves*/
+    if(resized && !w->use_uring){
+        endpoint_event(&s->client, 0);
+    }
+}
+
+/* Create a listening socket on the proxy address
+ * Arguments:
+ *   None
+ * Return Value:
+ *   Listening socket, SO_REUSEPORT lets every worker bind its own
+ * Note: exits the process on error, only called during startup
+ */
+int listener_open(){
+    struct sockaddr_in proxy_addr;
+    int proxy_fd = socket(AF_INET,SOCK_STREAM,0);
     if(proxy_fd < 0){
         perror("Failed to Create Socket for Proxy Server");
         exit(EXIT_FAILURE);
     }
+
+    int opt = 1;
+    if (setsockopt(proxy_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(proxy_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
     proxy_addr.sin_family=AF_INET;
     proxy_addr.sin_port=htons(PROXY_PORT);
     if (inet_pton(AF_INET, PROXY_IP, &(proxy_addr.sin_addr)) <= 0) {
@@ -52,221 +809,458 @@ int main(){
         perror("Failed to Bind to Proxy Server");
         exit(EXIT_FAILURE);
     }
-    
-    if(listen(proxy_fd,1) != 0){
+
+    if(tune_apply(proxy_fd, client_profile) != 0){ // Accepted sockets inherit the options
+        fprintf(stderr, "Continuing Without the Rejected Options\n");
+    }
+
+    if(listen(proxy_fd,LISTEN_BACKLOG) != 0){
         perror("Listen Failure");
         exit(EXIT_FAILURE);
     }
-    printf("Waiting for the Client Connection...\n");
-    
-    /*Handle Client Connection to the Proxy Server*/
-    socklen_t client_addr_size = sizeof(client_addr);
-    client_fd = accept(proxy_fd,(struct sockaddr*)&client_addr,&client_addr_size);
-    if(client_fd<0)
-    {
-        perror("Proxy Failed to Accept the Client Connection");
+    return proxy_fd;
+}
+
+/* Create the listener, epoll instance and shutdown eventfd of a worker
+ * Arguments:
+ *   struct worker *w - worker to initialize
+ *   int id           - worker index
+ * Return Value:
+ *   None
+ * Note: exits the process on error, only called during startup
+ */
+void worker_init(struct worker *w, int id){
+    memset(w, 0, sizeof(struct worker));
+    w->id = id;
+    w->listener.fd = listener_open();
+
+    /*Creating epoll fd*/
+    w->epoll_fd = epoll_create1(0);
+    if(w->epoll_fd == -1){
+        perror("Failed to create epoll file descriptor\n");
         exit(EXIT_FAILURE);
     }
-    
-    printf("Connection Accepted by the Proxy Server, fd:%d\n",client_fd);
-    
-    /*Connection to the Remote Server*/
-    remote_fd = socket(AF_INET,SOCK_STREAM,0);
-    if(remote_fd < 0){
-        perror("Failed to Create Socket for Remote Server");
+    pthread_mutex_init(&w->thread_lock, NULL);
+    pthread_cond_init(&w->thread_done, NULL);
+    w->shutdown_fd = eventfd(0, 0);
+    if(w->shutdown_fd == -1){
+        perror("Failed to create shutdown eventfd\n");
         exit(EXIT_FAILURE);
     }
 
-    remote_addr.sin_family=AF_INET;
-    remote_addr.sin_port=htons(REMOTE_PORT);
-    if (inet_pton(AF_INET, REMOTE_IP, &(remote_addr.sin_addr)) <= 0) {
-        perror("Failed to convert IP address");
+    /*Registering listening socket to epoll, sessions are added as clients arrive*/
+    struct epoll_event proxy_event,shutdown_event,timer_event;
+    proxy_event.events = EPOLLIN;
+    proxy_event.data.ptr = &w->listener;
+    shutdown_event.events = EPOLLIN;
+    shutdown_event.data.ptr = NULL;
+    if(epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listener.fd, &proxy_event)!=0 ||
+       epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->shutdown_fd, &shutdown_event)!=0){
+        perror("Failed to Register Proxy Socket FD to Epoll");
         exit(EXIT_FAILURE);
     }
 
-    if(connect(remote_fd,(const struct sockaddr*)&remote_addr,sizeof(struct sockaddr_in))<0){
-        perror("Failed to Connect to the REmote Server");
+    /*Interval reports, the timer is read through the ring when the worker runs on io_uring*/
+    report_start(&w->report);
+    w->timer_fd = report_timer_create(report_period > 0 ? report_period :
+                                      adapt_max > 0 ? REPORT_INTERVAL : 0); // Adaptive sizing samples on the same timer
+    timer_event.events = EPOLLIN;
+    timer_event.data.ptr = &w->report;
+    if(w->timer_fd >= 0 && epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &timer_event)!=0){
+        perror("Failed to Register Report Timer to Epoll");
         exit(EXIT_FAILURE);
     }
-    printf("Connection to Remote Server Successful\n");
 
-    /*Application Level Buffer Allocation*/
-    if (CB_SUCCESS != cb_init(&client_buffer, CIRCULAR_BUFFER_SIZE)){
-        perror("MEM error when init\n");
+    if(buffer_pool_size > 0 &&
+       cb_pool_init(&w->pool, buffer_pool_size, buffer_pool_hugepages) != CB_SUCCESS){
+        perror("Failed to Allocate Buffer Pool");
         exit(EXIT_FAILURE);
     }
-    
-    if (CB_SUCCESS != cb_init(&remote_buffer, CIRCULAR_BUFFER_SIZE)){
-        perror("MEM error when init\n");
-        exit(EXIT_FAILURE);
+
+    if(use_uring && worker_uring_init(w) != 0){
+        perror("io_uring Unavailable, Falling Back to Epoll");
     }
+    if(!w->use_uring){ // Accepts are drained until EAGAIN, io_uring accepts wait in the ring instead
+        fcntl(w->listener.fd, F_SETFL, fcntl(w->listener.fd, F_GETFL) | O_NONBLOCK);
+    }
+}
 
-    /*Creating epoll fd*/
-    int epoll_fd = epoll_create1(0);
-    if(epoll_fd == -1){
-        perror("Failed to create epoll file descriptor\n");
-        exit(EXIT_FAILURE);
+/* Print the interval report of a worker
+ * Arguments:
+ *   struct worker *w - worker whose report timer expired
+ * Return Value:
+ *   None
+ */
+void worker_report(struct worker *w){
+    report_counters now = { w->upstream, w->downstream, w->reads, w->writes,
+                            w->syscalls + w->ring.enters };
+    size_t up_queued = 0, down_queued = 0, capacity = 0;
+    char label[32];
+
+    for(struct session *s = w->sessions; s != NULL; s = s->next){
+        up_queued += cb_used_cp(&s->client_buffer);
+        down_queued += cb_used_cp(&s->remote_buffer);
+        capacity += s->client_buffer.max_cap;
+    }
+    if(thread_per_direction){
+        threaded_sessions_sample(w, &now, &up_queued, &down_queued, &capacity);
+    }
+    if(capacity == 0 && now.upstream == w->report.prev.upstream &&
+       now.downstream == w->report.prev.downstream){ // Idle, only move the interval start
+        report_interval(&w->report, NULL, &now, 0, 0, 0);
+        return;
+    }
+    snprintf(label, sizeof(label), "Worker %d ", w->id);
+    report_interval(&w->report, label, &now, up_queued, down_queued, capacity);
+    if(w->pool.slab != NULL){
+        printf("Worker %d Buffer Pool: %zu/%zu Chunks in Use, Peak: %zu, Exhausted: %llu\n", w->id,
+                w->pool.in_use, w->pool.chunks, w->pool.peak, w->pool.exhausted);
     }
-    /*Registering socket fd to epoll*/
-    struct epoll_event client_event,remote_event; 
-    client_event.events = EPOLLIN | EPOLLOUT;
-    client_event.data.fd = client_fd;
-    remote_event.events = EPOLLIN | EPOLLOUT;
-    remote_event.data.fd = remote_fd;
 
-   
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event)!=0){
-        perror("Failed to Register Client Socket FD to Epoll");
-        close(client_fd);
-        close(remote_fd);
-        close(epoll_fd);
-        close(proxy_fd);
-        exit(EXIT_FAILURE);
+    /*Residence time of the bytes written during the interval*/
+    snprintf(label, sizeof(label), "Worker %d Residence Up: ", w->id);
+    hist_print(label, &w->up_residence);
+    snprintf(label, sizeof(label), "Worker %d Residence Down: ", w->id);
+    hist_print(label, &w->down_residence);
+    hist_merge(&w->up_residence_total, &w->up_residence);
+    hist_merge(&w->down_residence_total, &w->down_residence);
+    hist_reset(&w->up_residence);
+    hist_reset(&w->down_residence);
+}
+
+/* Handle an expiration of the worker timer
+ * Arguments:
+ *   struct worker *w - worker whose timer expired
+ * Return Value:
+ *   None
+ */
+void worker_timer(struct worker *w){
+    if(adapt_max > 0){
+        worker_adapt(w);
     }
-    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, remote_fd, &remote_event)!=0){
-        perror("Failed to Register Remote Socket FD to Epoll");
-        close(client_fd);
-        close(remote_fd);
-        close(epoll_fd);
-        close(proxy_fd);
-        exit(EXIT_FAILURE);
+    if(report_period > 0){
+        worker_report(w);
     }
+}
 
-    printf("Registered Both client_fd and remote_fd to Epoll Successfully\n");
-    
-    start_time = clock();
+/* Resume the sessions that stopped reading because the buffer pool was exhausted
+ * Arguments:
+ *   struct worker *w - worker owning the pool
+ * Return Value:
+ *   None
+ * Note: called after each batch of events, chunks freed by its sends are offered to the starved sessions
+ */
+void worker_pool_wake(struct worker *w){
+    struct session *next;
+    if(!w->pool_starved || w->pool.free_cnt == 0){
+        return;
+    }
+    w->pool_starved = 0; // Set again by the sessions that still find no chunk
+    for(struct session *s = w->sessions; s != NULL; s = next){
+        next = s->next;
+        if(s->connecting){
+            continue;
+        }
+        if(w->use_uring){
+            session_uring_arm(s);
+        }
+        else{
+            endpoint_event(&s->client, 0); // Reads what edge triggered epoll already reported, re-arms EPOLLIN
+        }
+    }
+}
+
+/* Event loop of one worker, runs until its shutdown eventfd is written
+ * Arguments:
+ *   void *arg - struct worker to run
+ * Return Value:
+ *   NULL
+ */
+void *worker_run(void *arg){
+    struct worker *w = arg;
+    int running = 1;
 
     /*Poll For Packets*/
     int event_count= 0;
     struct epoll_event events[MAX_EVENTS];
-    int space_in_cb;
-    int recv_count = 0,sent_count = 0;
-    while(1)
+    while(running)
     {
-        event_count = epoll_wait(epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
+        int timeout = worker_expire_connects(w);
+        w->syscalls++;
+        event_count = epoll_wait(w->epoll_fd,events,MAX_EVENTS,timeout);
+        if(event_count == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Error waiting for the event");
+            break;
+        }
         for(int i=0;i<event_count;i++)
         {
-            if(events[i].data.fd==client_fd)
+            struct endpoint *ep = events[i].data.ptr;
+            if(ep == NULL)
             {
-                if(events[i].events & EPOLLIN)
-                {
-                    space_in_cb = cb_free_cp(&client_buffer);
-                    if(space_in_cb>0){
-                       char *buffer = malloc(CIRCULAR_BUFFER_SIZE);
-                       recv_count = read(client_fd,buffer,MIN(CIRCULAR_BUFFER_SIZE,space_in_cb));
-                       if(recv_count>0){
-                           cb_push_back(&client_buffer,buffer,recv_count);
-                       }
-                       else if(recv_count == 0){
-                            printf("Client Terminated the Connection\n");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            stats();
-                            free(buffer);
-                            return 0;
-                       }
-                       else{
-                            perror("Client Socket Error");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            free(buffer);
-                            exit(EXIT_FAILURE);
-                       }
-                       free(buffer);
-                    }
-                }
-                if(events[i].events & EPOLLOUT){
-                    char *buffer = malloc(CIRCULAR_BUFFER_SIZE);
-                    space_in_cb = cb_pop_front(&remote_buffer,buffer,CIRCULAR_BUFFER_SIZE);
-                    if(space_in_cb >= 0){
-                        sent_count = write(client_fd,buffer,space_in_cb);
-                        if(sent_count<0){
-                            perror("Client Send Failure");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            free(buffer);
-                            exit(EXIT_FAILURE);
-                        }
-                        else{
-                            downstream += sent_count;
-                        }
-                    }
-                    free(buffer);
-                }
+                running = 0;
             }
-            else if(events[i].data.fd==remote_fd)
+            else if(ep == &w->listener)
             {
-                if(events[i].events & EPOLLIN)
-                {
-                    space_in_cb = cb_free_cp(&remote_buffer);
-                    if(space_in_cb>0){
-                       char *buffer = malloc(CIRCULAR_BUFFER_SIZE);
-                       recv_count = read(remote_fd,buffer,MIN(CIRCULAR_BUFFER_SIZE,space_in_cb));
-                       if(recv_count>0){
-                           cb_push_back(&remote_buffer,buffer,recv_count);
-                       }
-                       else if(recv_count == 0){
-                            printf("Remote Endpoint Terminated the Connection\n");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            stats();
-                            free(buffer);
-                            return 0;
-                       }
-                       else{
-                            perror("Server 2 Socket Error");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            free(buffer);
-                            exit(EXIT_FAILURE);
-                       }
-                       free(buffer);
-                    }
-                }
-                if(events[i].events & EPOLLOUT)
-                {
-                    char *buffer = malloc(CIRCULAR_BUFFER_SIZE);
-                    space_in_cb = cb_pop_front(&client_buffer,buffer,CIRCULAR_BUFFER_SIZE);
-                    if(space_in_cb >= 0)
-                    {
-                        sent_count = write(remote_fd,buffer,space_in_cb);
-                        if(sent_count<0){
-                            perror("Remote Send Failure");
-                            close(client_fd);
-                            close(remote_fd);
-                            close(proxy_fd);
-                            close(epoll_fd);
-                            free(buffer);
-                            exit(EXIT_FAILURE);
-                        }
-                        else{
-                            upstream += sent_count;
-                        }
-                    }
-                    free(buffer);
-                }
+                listener_accept(w);
+            }
+            else if(events[i].data.ptr == &w->report)
+            {
+                report_timer_ack(w->timer_fd);
+                worker_timer(w);
+            }
+            else if(!ep->session->closed)
+            {
+                endpoint_event(ep, events[i].events);
             }
         }
+        worker_pool_wake(w);
+        session_reap(w);
+    }
+
+    /*Closing all remaining sessions*/
+    threaded_sessions_stop(w);
+    while(w->sessions != NULL){
+        session_close(w->sessions);
     }
+    session_reap(w);
+
     /*Closing Epoll FD*/
-    if(close(epoll_fd)){
+    if(close(w->epoll_fd)){
         perror("Failed to Close Epoll File Descriptor\n");
+    }
+    close(w->listener.fd);
+    close(w->shutdown_fd);
+    if(w->timer_fd >= 0){
+        close(w->timer_fd);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    int worker_count = sysconf(_SC_NPROCESSORS_ONLN); // One SO_REUSEPORT listener per CPU, -w 1 for a single one
+    int opt, sig;
+    char *end;
+    const char *profile_path = NULL, *client_profile_name = NULL, *upstream_profile_name = NULL;
+    const char *tcpinfo_path = NULL;
+    int warm_upstream_count = 0, tcpinfo_hz = TCPINFO_HZ;
+    while((opt = getopt(argc, argv, "meutw:p:Hi:b:a:Af:C:U:k:c:r:l:L:I:")) != -1){
+        switch(opt){
+            case 'm':
+                buffer_init = cb_init_mirror;
+                break;
+            case 'e':
+                edge_triggered = 1;
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 't':
+                thread_per_direction = 1;
+                break;
+            case 'p':
+                buffer_pool_size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'H':
+                buffer_pool_hugepages = 1;
+                break;
+            case 'i':
+                report_period = atof(optarg);
+                break;
+            case 'b':
+                buffer_size = strtoull(optarg, NULL, 10);
+                if(buffer_size == 0){
+                    buffer_size = CIRCULAR_BUFFER_SIZE;
+                }
+                break;
+            case 'a':
+                adapt_min = strtoull(optarg, &end, 10);
+                adapt_max = *end == ':' ? strtoull(end + 1, NULL, 10) : 0;
+                adapt_min = adapt_min > 0 ? adapt_min : ADAPT_MIN_SIZE;
+                adapt_max = adapt_max > 0 ? adapt_max : ADAPT_MAX_SIZE;
+                break;
+            case 'A':
+                adapt_socket_buffers = 1;
+                break;
+            case 'f':
+                profile_path = optarg;
+                break;
+            case 'C':
+                client_profile_name = optarg;
+                break;
+            case 'U':
+                upstream_profile_name = optarg;
+                break;
+            case 'k':
+                warm_upstream_count = atoi(optarg);
+                break;
+            case 'c':
+                connect_timeout = atoi(optarg);
+                if(connect_timeout <= 0){
+                    connect_timeout = CONNECT_TIMEOUT_MILLIS;
+                }
+                break;
+            case 'r':
+                if(backend_add(optarg) != 0){
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if(backend_policy(optarg) != 0){
+                    fprintf(stderr, "Unknown Balancing Policy \"%s\", Expected rr, least or ewma\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                tcpinfo_path = optarg;
+                break;
+            case 'I':
+                tcpinfo_hz = atoi(optarg);
+                break;
+            case 'w':
+                worker_count = atoi(optarg);
+                if(worker_count <= 0){
+                    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m | -p MB [-H]] [-e] [-u | -t] [-w workers] [-i seconds] [-b bytes] [-a min:max [-A]]\n"
+                                "       [-f profile_file [-C client_profile] [-U upstream_profile]] [-k connections] [-c millis]\n"
+                                "       [-r ip:port]... [-l rr|least|ewma] [-L tcpinfo_log [-I hz]]\n"
+                                "  -m  mirror-mapped circular buffers (capacity rounded to page size)\n"
+                                "  -p  pooled circular buffers grown by chunks from a per worker slab of MB megabytes,\n"
+                                "      sessions stop reading while it is exhausted (size it for a chunk per direction and session)\n"
+                                "  -H  back the buffer pool with huge pages when available\n"
+                                "  -e  edge-triggered epoll, drain sockets until EAGAIN\n"
+                                "  -u  io_uring data path (falls back to epoll when unavailable)\n"
+                                "  -t  thread per direction: reader and writer threads around lock-free rings\n"
+                                "  -w  number of worker threads, 0 for one per online CPU (default one per online CPU)\n"
+                                "  -i  seconds between interval reports, 0 to disable (default %.1f)\n"
+                                "  -b  circular buffer capacity per direction in bytes (default %d)\n"
+                                "  -a  resize buffers to the bandwidth-delay product from TCP_INFO within min:max bytes\n"
+                                "      (0 for the default bounds %d:%d)\n"
+                                "  -A  with -a, also size the socket buffers (disables their autotuning)\n"
+                                "  -f  socket tuning profiles, [name] sections of \"option = value\" lines\n"
+                                "  -C  profile applied to the listeners and accepted client sockets\n"
+                                "  -U  profile applied to the sockets connected to the remote server\n"
+                                "  -k  keep this many connections to each remote server open ahead of the clients\n"
+                                "  -c  milliseconds a session waits for the remote handshake (default %d)\n"
+                                "  -r  remote server to balance sessions across, repeat for several (default %s:%d)\n"
+                                "  -l  balancing policy: rr round-robin (default), least active sessions,\n"
+                                "      ewma lowest connect plus first byte latency average\n"
+                                "  -L  sample TCP_INFO of every remote socket into a ring written to this file at exit,\n"
+                                "      CSV, or raw records when the name ends in .bin (the last %d samples are kept)\n"
+                                "  -I  TCP_INFO samples per second and socket with -L (default %d)\n",
+                                argv[0], REPORT_INTERVAL, CIRCULAR_BUFFER_SIZE, ADAPT_MIN_SIZE, ADAPT_MAX_SIZE,
+                                CONNECT_TIMEOUT_MILLIS, REMOTE_IP, REMOTE_PORT, TCPINFO_SAMPLES, TCPINFO_HZ);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if(worker_count <= 0){ // sysconf() failed
+        worker_count = 1;
+    }
+    if(thread_per_direction && use_uring){
+        fprintf(stderr, "-t and -u are exclusive, using -t\n");
+        use_uring = 0;
+    }
+    client_profile = tune_select(profile_path, client_profile_name);
+    upstream_profile = tune_select(profile_path, upstream_profile_name);
+    tune_print("Client ", client_profile);
+    tune_print("Upstream ", upstream_profile);
+
+    if(thread_per_direction && adapt_max > 0){ // Relay threads own their rings while they run
+        fprintf(stderr, "-a is not supported with -t, buffers keep their size\n");
+        adapt_max = 0;
+    }
+    if(thread_per_direction && buffer_pool_size > 0){ // Relay threads move data through their own SPSC rings
+        fprintf(stderr, "-p is not supported with -t, no buffer pool is used\n");
+        buffer_pool_size = 0;
+        buffer_pool_hugepages = 0;
+    }
+
+    /*Workers inherit the blocked mask, only the main thread handles shutdown signals*/
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct worker *workers = calloc(worker_count, sizeof(struct worker));
+    if(workers == NULL){
+        perror("Failed to Allocate Workers");
         exit(EXIT_FAILURE);
     }
-    /*Making sure all FDs are closed*/
-    close(client_fd);
-    close(remote_fd);
-    close(proxy_fd);
+    for(int i=0;i<worker_count;i++){
+        worker_init(&workers[i], i);
+    }
+
+    if(tcpinfo_path != NULL && tcpinfo_start(&upstream_sampler, tcpinfo_hz, TCPINFO_SAMPLES) != 0){
+        exit(EXIT_FAILURE);
+    }
+    if(backends_start(warm_upstream_count) != 0){
+        perror("Failed to Start the Upstream Pools");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Waiting for Client Connections on %d Worker(s)...\n",worker_count);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for(int i=0;i<worker_count;i++){
+        if(pthread_create(&workers[i].thread, NULL,
+                          workers[i].use_uring ? worker_run_uring : worker_run, &workers[i]) != 0){
+            perror("Failed to Start Worker Thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sigwait(&shutdown_signals, &sig);
+
+    /*Stopping workers and aggregating their counters*/
+    uint64_t one = 1;
+    for(int i=0;i<worker_count;i++){
+        if(write(workers[i].shutdown_fd, &one, sizeof(one)) != sizeof(one)){
+            perror("Failed to Signal Worker Shutdown");
+        }
+    }
+    for(int i=0;i<worker_count;i++){
+        pthread_join(workers[i].thread, NULL);
+        printf("Worker %d: Sessions: %d, UpStream: %llu B, DownStream: %llu B, Reads: %llu, Writes: %llu, Syscalls: %llu\n",i,
+                workers[i].next_session_id,workers[i].upstream,workers[i].downstream,
+                workers[i].reads,workers[i].writes,workers[i].syscalls + workers[i].ring.enters);
+        if(workers[i].pool.slab != NULL){
+            printf("Worker %d: Buffer Pool: %zu/%zu Chunks in Use, Peak: %zu, Exhausted: %llu, %s Pages\n",i,
+                    workers[i].pool.in_use,workers[i].pool.chunks,workers[i].pool.peak,
+                    workers[i].pool.exhausted,workers[i].pool.hugepages ? "Huge" : "Normal");
+        }
+        if(adapt_max > 0){
+            printf("Worker %d: Buffer Resizes: Grown: %llu, Shrunk: %llu, Largest: %zu B\n",i,
+                    workers[i].buffers_grown,workers[i].buffers_shrunk,workers[i].largest_buffer);
+        }
+        cb_pool_destroy(&workers[i].pool);
+        syscalls += workers[i].syscalls + workers[i].ring.enters;
+        sessions_served += workers[i].next_session_id;
+        reads += workers[i].reads;
+        writes += workers[i].writes;
+        hist_merge(&up_residence, &workers[i].up_residence_total);
+        hist_merge(&up_residence, &workers[i].up_residence);
+        hist_merge(&down_residence, &workers[i].down_residence_total);
+        hist_merge(&down_residence, &workers[i].down_residence);
+        hist_merge(&connect_latency, &workers[i].connect_latency);
+        connect_failures += workers[i].connect_failures;
+        connect_timeouts += workers[i].connect_timeouts;
+        upstream += workers[i].upstream;
+        downstream += workers[i].downstream;
+    }
+    free(workers);
+    backends_stop();
     stats();
+    if(tcpinfo_path != NULL){
+        tcpinfo_stop(&upstream_sampler, tcpinfo_path);
+    }
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -8,6 +9,13 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include "uring.h"
+#include "report.h"
+#include "tune.h"
 
 #define MAX_EVENTS 10
 #define EPOLL_TIMEOUT_MILLIS 30000
@@ -16,22 +24,571 @@
 #define PROXY_PORT 1234
 #define REMOTE_IP "127.0.0.1"
 #define REMOTE_PORT 5678
+#define PIPE_SIZE 1048576 //1MB, capped by /proc/sys/fs/pipe-max-size
+#define URING_ENTRIES 64
+#define URING_BUFFERS 64         // Provided buffers per direction (power of 2)
+#define URING_BUFFER_SIZE 65536
+#define URING_TIMER 4            // user_data of timer reads, 0-3 are direction * 2 + (recv 0 / send 1)
 
 unsigned long long upstream = 0;
 unsigned long long downstream = 0;
-clock_t start_time,difference;
+unsigned long long syscalls = 0;
+unsigned long long reads = 0;
+unsigned long long writes = 0;
+interval_report report;                 // CLOCK_MONOTONIC start and previous interval sample
+int timer_fd = -1;                      // Interval report timer, registered to the relay's event loop
+uint64_t timer_expirations;             // Target of the timer read queued in io_uring mode
 
 void stats(){
-    clock_t difference = clock() - start_time;
-    double time_taken = ((double)difference)/CLOCKS_PER_SEC; // in seconds
-    upstream = upstream / 1000000;
-    downstream = downstream / 1000000;
-    printf("UpStream: Data: %llu MB, Rate: %lf Gbps\n",upstream,(upstream*0.008)/time_taken);
-    printf("DownStream: Data: %llu MB, Rate: %lf Gbps\n",downstream,(downstream*0.008)/time_taken);
+    report_counters total = { upstream, downstream, reads, writes, syscalls };
+    report_summary(&report.start, &total);
 }
-int main(){
+
+/* Print the interval report of the relay
+ * Arguments:
+ *   size_t up_queued   - bytes held by the relay towards the remote
+ *   size_t down_queued - bytes held by the relay towards the client
+ *   size_t capacity    - bytes the relay can hold per direction (0 when it holds none)
+ * Return Value:
+ *   None
+ */
+void interval_stats(size_t up_queued, size_t down_queued, size_t capacity){
+    report_counters now = { upstream, downstream, reads, writes, syscalls };
+    report_interval(&report, "", &now, up_queued, down_queued, capacity);
+}
+
+/*Kernel pipe carrying one direction of the splice() relay*/
+struct splice_pipe{
+    int rd;                 // Read end, spliced out to dst_fd
+    int wr;                 // Write end, spliced in from src_fd
+    int src_fd;
+    int dst_fd;
+    size_t size;            // Pipe capacity as granted by F_SETPIPE_SZ
+    size_t pending;         // Bytes sitting in the pipe
+    int full;               // The last splice into the pipe got EAGAIN with data pending, it fills by page
+                            // slots, not bytes, so pending < size does not mean it has room
+    int eof;                // src_fd reached end of stream
+    unsigned long long *counter;
+};
+
+/* Create the pipe for one direction of the splice() relay
+ * Arguments:
+ *   struct splice_pipe *sp - pipe to initialize
+ *   int src_fd, dst_fd     - sockets data is moved between
+ *   int pipe_size          - requested pipe capacity (in bytes)
+ *   unsigned long long *counter - byte counter reported by stats()
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int splice_pipe_init(struct splice_pipe *sp, int src_fd, int dst_fd, int pipe_size,
+                     unsigned long long *counter){
+    int fds[2];
+    if(pipe2(fds, O_NONBLOCK) != 0){
+        perror("Failed to Create Pipe");
+        return -1;
+    }
+    sp->rd = fds[0];
+    sp->wr = fds[1];
+    int granted = fcntl(sp->wr, F_SETPIPE_SZ, pipe_size);
+    if(granted < 0){
+        perror("Failed to Set Pipe Size, Using Default");
+        granted = fcntl(sp->wr, F_GETPIPE_SZ);
+    }
+    sp->size = granted;
+    sp->src_fd = src_fd;
+    sp->dst_fd = dst_fd;
+    sp->pending = 0;
+    sp->full = 0;
+    sp->eof = 0;
+    sp->counter = counter;
+    return 0;
+}
+
+/* Move as much data as possible src_fd -> pipe -> dst_fd without blocking
+ * Arguments:
+ *   struct splice_pipe *sp - direction to service
+ * Return Value:
+ *   0 on success (including backpressure)
+ *   -1 on socket error
+ */
+int splice_pipe_pump(struct splice_pipe *sp){
+    while(1){
+        ssize_t n;
+        int progress = 0;
+        if(!sp->eof && !sp->full && sp->pending < sp->size){
+            syscalls++;
+            reads++;
+            n = splice(sp->src_fd, NULL, sp->wr, NULL, sp->size - sp->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0){
+                sp->pending += n;
+                progress = 1;
+            }
+            else if(n == 0){
+                sp->eof = 1;
+            }
+            else if(errno == EAGAIN){
+                sp->full = sp->pending > 0; // With the pipe empty it can only be the socket
+            }
+            else if(errno != EINTR){
+                return -1;
+            }
+        }
+        if(sp->pending > 0){
+            syscalls++;
+            writes++;
+            n = splice(sp->rd, NULL, sp->dst_fd, NULL, sp->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0){ // Partial splices leave the remainder in the pipe
+                sp->pending -= n;
+                *(sp->counter) += n;
+                sp->full = 0;
+                progress = 1;
+            }
+            else if(n < 0 && errno != EAGAIN && errno != EINTR){
+                return -1;
+            }
+        }
+        if(!progress){
+            return 0;
+        }
+    }
+}
+
+/* Update epoll interest of a socket from the state of the pipes around it
+ * Arguments:
+ *   int epoll_fd          - epoll instance
+ *   int fd                - socket to update
+ *   struct splice_pipe *out - pipe fed by fd
+ *   struct splice_pipe *in  - pipe drained into fd
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int splice_interest(int epoll_fd, int fd, struct splice_pipe *out, struct splice_pipe *in){
+    struct epoll_event event;
+    event.events = 0;
+    event.data.fd = fd;
+    if(!out->eof && !out->full && out->pending < out->size){ // Stop reading while the pipe is full
+        event.events |= EPOLLIN;
+    }
+    if(in->pending > 0){ // Only wait for writability when data is queued
+        event.events |= EPOLLOUT;
+    }
+    syscalls++;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/* Relay both directions with splice(), data never enters user space
+ * Arguments:
+ *   int epoll_fd  - epoll instance with client_fd and remote_fd registered
+ *   int client_fd, remote_fd - connected sockets
+ *   int pipe_size - requested capacity of each pipe (in bytes)
+ * Return Value:
+ *   0 when a side terminated the connection and its data was flushed
+ *   -1 on error
+ */
+int splice_relay(int epoll_fd, int client_fd, int remote_fd, int pipe_size){
+    struct splice_pipe up, down;
+    int ret = -1;
+    if(splice_pipe_init(&up, client_fd, remote_fd, pipe_size, &upstream) != 0){
+        return -1;
+    }
+    if(splice_pipe_init(&down, remote_fd, client_fd, pipe_size, &downstream) != 0){
+        close(up.rd);
+        close(up.wr);
+        return -1;
+    }
+    printf("Splice Relay: Pipe Size %zu B\n", up.size);
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(remote_fd, F_SETFL, fcntl(remote_fd, F_GETFL) | O_NONBLOCK);
+
+    int event_count = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while(1)
+    {
+        if(splice_interest(epoll_fd, client_fd, &up, &down) != 0 ||
+           splice_interest(epoll_fd, remote_fd, &down, &up) != 0){
+            perror("Failed to Update Epoll Interest");
+            break;
+        }
+        syscalls++;
+        event_count = epoll_wait(epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
+        if(event_count == -1 && errno != EINTR){
+            perror("Error waiting for the event");
+            break;
+        }
+        int sockets_ready = 0;
+        for(int i=0;i<event_count;i++){
+            if(events[i].data.fd == timer_fd){
+                report_timer_ack(timer_fd);
+                interval_stats(up.pending, down.pending, up.size);
+            }
+            else{
+                sockets_ready = 1;
+            }
+        }
+        /*Either socket becoming ready can unblock either direction*/
+        if(sockets_ready){
+            if(splice_pipe_pump(&up) != 0){
+                perror("Upstream Splice Failure");
+                break;
+            }
+            if(splice_pipe_pump(&down) != 0){
+                perror("Downstream Splice Failure");
+                break;
+            }
+        }
+        if(up.eof && up.pending == 0){
+            printf("Client Terminated the Connection\n");
+            ret = 0;
+            break;
+        }
+        if(down.eof && down.pending == 0){
+            printf("Remote Endpoint Terminated the Connection\n");
+            ret = 0;
+            break;
+        }
+    }
+    close(up.rd);
+    close(up.wr);
+    close(down.rd);
+    close(down.wr);
+    return ret;
+}
+
+/*One direction of the io_uring relay: multishot recv into provided buffers, sends in order*/
+struct uring_dir{
+    int src;                          // Fixed file slot (or fd) data is received from
+    int dst;                          // Fixed file slot (or fd) data is sent to
+    char *buffers;                    // URING_BUFFERS * URING_BUFFER_SIZE, inside the registered slab
+    uring_buf_ring pbuf;              // Buffers the kernel picks from for recv
+    unsigned short fifo_bid[URING_BUFFERS]; // Filled buffers in arrival order
+    unsigned fifo_len[URING_BUFFERS];
+    unsigned fifo_head, fifo_count;
+    unsigned sent;                    // Bytes of the head buffer already sent
+    int recv_armed;
+    int send_inflight;
+    int eof;
+    unsigned long long *counter;
+};
+
+struct uring_relay{
+    uring ring;
+    char *slab;                       // Backing memory of both directions
+    int fixed_files;                  // Sockets registered as fixed files 0 and 1
+    int fixed_buffers;                // slab registered as fixed buffer 0
+    int multishot;                    // Kernel supports IORING_RECV_MULTISHOT
+    struct uring_dir dir[2];          // 0: Client -> Remote, 1: Remote -> Client
+};
+
+/* Queue a recv selecting buffers from the direction's buffer ring
+ * Arguments:
+ *   struct uring_relay *ur - relay state
+ *   int d                  - direction index
+ * Return Value:
+ *   None
+ */
+void uring_dir_arm_recv(struct uring_relay *ur, int d){
+    struct uring_dir *dir = &ur->dir[d];
+    if(dir->recv_armed || dir->eof || dir->fifo_count == URING_BUFFERS){
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    if(sqe == NULL){
+        return;
+    }
+    uring_prep_rw(sqe, IORING_OP_RECV, dir->src, NULL, 0, d * 2);
+    sqe->flags = IOSQE_BUFFER_SELECT | (ur->fixed_files ? IOSQE_FIXED_FILE : 0);
+    sqe->buf_group = dir->pbuf.bgid;
+    if(ur->multishot){
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    dir->recv_armed = 1;
+}
+
+/* Queue a send of the oldest filled buffer, a short send resumes where it stopped
+ * Arguments:
+ *   struct uring_relay *ur - relay state
+ *   int d                  - direction index
+ * Return Value:
+ *   None
+ */
+void uring_dir_arm_send(struct uring_relay *ur, int d){
+    struct uring_dir *dir = &ur->dir[d];
+    if(dir->send_inflight || dir->fifo_count == 0){
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    if(sqe == NULL){
+        return;
+    }
+    unsigned short bid = dir->fifo_bid[dir->fifo_head];
+    char *addr = dir->buffers + (size_t)bid * URING_BUFFER_SIZE + dir->sent;
+    unsigned len = dir->fifo_len[dir->fifo_head] - dir->sent;
+    if(ur->fixed_buffers){
+        uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, dir->dst, addr, len, d * 2 + 1);
+        sqe->buf_index = 0;
+    }
+    else{
+        uring_prep_rw(sqe, IORING_OP_SEND, dir->dst, addr, len, d * 2 + 1);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    if(ur->fixed_files){
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    dir->send_inflight = 1;
+}
+
+/* Handle a recv or send completion of one direction
+ * Arguments:
+ *   struct uring_relay *ur   - relay state
+ *   struct io_uring_cqe *cqe - completion
+ * Return Value:
+ *   0 on success
+ *   -1 on socket error
+ */
+int uring_dir_complete(struct uring_relay *ur, struct io_uring_cqe *cqe){
+    int d = cqe->user_data / 2;
+    struct uring_dir *dir = &ur->dir[d];
+
+    if(cqe->user_data % 2 == 0){ // recv
+        reads++;
+        if(!(cqe->flags & IORING_CQE_F_MORE)){ // Multishot ended (or single shot), re-arm later
+            dir->recv_armed = 0;
+        }
+        if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)){
+            unsigned tail = (dir->fifo_head + dir->fifo_count) % URING_BUFFERS;
+            dir->fifo_bid[tail] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            dir->fifo_len[tail] = cqe->res;
+            dir->fifo_count++;
+        }
+        else if(cqe->res == 0){
+            dir->eof = 1;
+        }
+        else if(cqe->res == -EINVAL && ur->multishot){ // Kernel without multishot recv
+            ur->multishot = 0;
+        }
+        else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR){
+            errno = -cqe->res;
+            return -1;
+        }
+    }
+    else{ // send
+        writes++;
+        dir->send_inflight = 0;
+        if(cqe->res < 0){
+            errno = -cqe->res;
+            return -1;
+        }
+        dir->sent += cqe->res;
+        *(dir->counter) += cqe->res;
+        if(dir->sent == dir->fifo_len[dir->fifo_head]){ // Buffer fully sent, hand it back to the kernel
+            unsigned short bid = dir->fifo_bid[dir->fifo_head];
+            uring_buf_ring_add(&dir->pbuf, dir->buffers + (size_t)bid * URING_BUFFER_SIZE,
+                               URING_BUFFER_SIZE, bid);
+            uring_buf_ring_publish(&dir->pbuf);
+            dir->fifo_head = (dir->fifo_head + 1) % URING_BUFFERS;
+            dir->fifo_count--;
+            dir->sent = 0;
+        }
+    }
+    uring_dir_arm_recv(ur, d);
+    uring_dir_arm_send(ur, d);
+    return 0;
+}
+
+/* Queue a read of the interval report timer, completes with user_data URING_TIMER
+ * Arguments:
+ *   struct uring_relay *ur - relay state
+ * Return Value:
+ *   None
+ */
+void uring_timer_arm(struct uring_relay *ur){
+    if(timer_fd < 0){
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    if(sqe != NULL){
+        uring_prep_rw(sqe, IORING_OP_READ, timer_fd, &timer_expirations, sizeof(timer_expirations), URING_TIMER);
+    }
+}
+
+/* Bytes received by one direction of the io_uring relay and not sent yet
+ * Arguments:
+ *   struct uring_dir *dir - direction
+ * Return Value:
+ *   Queued bytes
+ */
+size_t uring_dir_queued(struct uring_dir *dir){
+    size_t queued = 0;
+    for(unsigned i=0;i<dir->fifo_count;i++){
+        queued += dir->fifo_len[(dir->fifo_head + i) % URING_BUFFERS];
+    }
+    return queued - dir->sent;
+}
+
+/* Relay both directions with io_uring
+ * Received data lands in kernel selected buffers (multishot recv) and is sent
+ * from the same memory, registered once as a fixed buffer. One io_uring_enter()
+ * per loop iteration submits everything queued while handling completions.
+ * Arguments:
+ *   int client_fd, remote_fd - connected sockets
+ * Return Value:
+ *   0 when a side terminated the connection and its data was flushed
+ *   -1 on error
+ *   1 when io_uring is unavailable (nothing was transferred, caller falls back)
+ */
+int uring_relay(int client_fd, int remote_fd){
+    struct uring_relay ur;
+    unsigned long long enters_counted = 0;  // Part of ur.ring.enters already added to syscalls
+    int ret = -1;
+    memset(&ur, 0, sizeof(ur));
+
+    if(uring_init(&ur.ring, URING_ENTRIES) != 0){
+        perror("io_uring Unavailable, Falling Back to Epoll");
+        return 1;
+    }
+    size_t slab_len = 2 * (size_t)URING_BUFFERS * URING_BUFFER_SIZE;
+    ur.slab = malloc(slab_len);
+    if(ur.slab == NULL){
+        uring_exit(&ur.ring);
+        return -1;
+    }
+    for(int d=0;d<2;d++){
+        if(uring_buf_ring_init(&ur.ring, &ur.dir[d].pbuf, d, URING_BUFFERS) != 0){
+            perror("io_uring Provided Buffers Unavailable, Falling Back to Epoll");
+            if(d == 1){
+                uring_buf_ring_exit(&ur.ring, &ur.dir[0].pbuf);
+            }
+            free(ur.slab);
+            uring_exit(&ur.ring);
+            return 1;
+        }
+        ur.dir[d].buffers = ur.slab + d * (size_t)URING_BUFFERS * URING_BUFFER_SIZE;
+        for(int b=0;b<URING_BUFFERS;b++){
+            uring_buf_ring_add(&ur.dir[d].pbuf, ur.dir[d].buffers + (size_t)b * URING_BUFFER_SIZE,
+                               URING_BUFFER_SIZE, b);
+        }
+        uring_buf_ring_publish(&ur.dir[d].pbuf);
+    }
+
+    struct iovec slab_iov = { ur.slab, slab_len };
+    ur.fixed_buffers = uring_register_buffers(&ur.ring, &slab_iov, 1) == 0 &&
+                       uring_opcode_supported(&ur.ring, IORING_OP_WRITE_FIXED);
+    ur.fixed_files = uring_register_files(&ur.ring, 2) == 0 &&
+                     uring_update_file(&ur.ring, 0, client_fd) == 0 &&
+                     uring_update_file(&ur.ring, 1, remote_fd) == 0;
+    ur.multishot = 1;
+    ur.dir[0].src = ur.fixed_files ? 0 : client_fd;
+    ur.dir[0].dst = ur.fixed_files ? 1 : remote_fd;
+    ur.dir[0].counter = &upstream;
+    ur.dir[1].src = ur.dir[0].dst;
+    ur.dir[1].dst = ur.dir[0].src;
+    ur.dir[1].counter = &downstream;
+    printf("io_uring Relay: Fixed Files %s, Fixed Buffers %s\n",
+            ur.fixed_files ? "On" : "Off", ur.fixed_buffers ? "On" : "Off");
+
+    uring_dir_arm_recv(&ur, 0);
+    uring_dir_arm_recv(&ur, 1);
+    uring_timer_arm(&ur);
+    while(1)
+    {
+        if(uring_submit_and_wait(&ur.ring, 1) < 0 && errno != EINTR){
+            perror("Error waiting for completions");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        int failed = 0;
+        while((cqe = uring_peek_cqe(&ur.ring)) != NULL){
+            if(cqe->user_data == URING_TIMER){
+                uring_cqe_seen(&ur.ring);
+                syscalls += ur.ring.enters - enters_counted; // io_uring_enter() is the only data path syscall
+                enters_counted = ur.ring.enters;
+                interval_stats(uring_dir_queued(&ur.dir[0]), uring_dir_queued(&ur.dir[1]),
+                               (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+                uring_timer_arm(&ur);
+                continue;
+            }
+            if(uring_dir_complete(&ur, cqe) != 0){
+                perror(cqe->user_data / 2 == 0 ? "Upstream io_uring Failure" : "Downstream io_uring Failure");
+                failed = 1;
+            }
+            uring_cqe_seen(&ur.ring);
+        }
+        if(failed){
+            break;
+        }
+        if(ur.dir[0].eof && ur.dir[0].fifo_count == 0){
+            printf("Client Terminated the Connection\n");
+            ret = 0;
+            break;
+        }
+        if(ur.dir[1].eof && ur.dir[1].fifo_count == 0){
+            printf("Remote Endpoint Terminated the Connection\n");
+            ret = 0;
+            break;
+        }
+    }
+    syscalls += ur.ring.enters - enters_counted;
+
+    uring_buf_ring_exit(&ur.ring, &ur.dir[0].pbuf);
+    uring_buf_ring_exit(&ur.ring, &ur.dir[1].pbuf);
+    uring_exit(&ur.ring);
+    free(ur.slab);
+    return ret;
+}
+
+int main(int argc, char *argv[]){
     int proxy_fd = 0, client_fd = 0, remote_fd = 0;
     struct sockaddr_in proxy_addr,client_addr,remote_addr;
+    int splice_mode = 0, uring_mode = 0, pipe_size = PIPE_SIZE, opt;
+    double report_period = REPORT_INTERVAL;
+    const char *profile_path = NULL, *client_profile_name = NULL, *upstream_profile_name = NULL;
+    while((opt = getopt(argc, argv, "sup:i:f:C:U:")) != -1){
+        switch(opt){
+            case 's':
+                splice_mode = 1;
+                break;
+            case 'u':
+                uring_mode = 1;
+                break;
+            case 'p':
+                pipe_size = atoi(optarg);
+                break;
+            case 'i':
+                report_period = atof(optarg);
+                break;
+            case 'f':
+                profile_path = optarg;
+                break;
+            case 'C':
+                client_profile_name = optarg;
+                break;
+            case 'U':
+                upstream_profile_name = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s | -u] [-p pipe_size] [-i seconds] [-f profile_file [-C profile] [-U profile]]\n"
+                                "  -s  relay with splice() instead of read()/write()\n"
+                                "  -u  relay with io_uring (falls back to splice() with -s, read()/write() otherwise)\n"
+                                "  -p  pipe size in bytes for splice mode (default %d)\n"
+                                "  -i  seconds between interval reports, 0 to disable (default %.1f)\n"
+                                "  -f  socket tuning profiles, [name] sections of \"option = value\" lines\n"
+                                "  -C  profile applied to the client socket\n"
+                                "  -U  profile applied to the remote server socket\n",
+                                argv[0], PIPE_SIZE, REPORT_INTERVAL);
+                exit(EXIT_FAILURE);
+        }
+    }
+    const tune_profile *client_profile = tune_select(profile_path, client_profile_name);
+    const tune_profile *upstream_profile = tune_select(profile_path, upstream_profile_name);
+    tune_print("Client ", client_profile);
+    tune_print("Upstream ", upstream_profile);
+    signal(SIGPIPE, SIG_IGN); // A reset peer fails the write or send with EPIPE, stats() still prints
+
     /*Create Proxy Socket*/
     proxy_fd = socket(AF_INET,SOCK_STREAM,0);
     if(proxy_fd < 0){
@@ -49,7 +606,8 @@ int main(){
         perror("Failed to Bind to Proxy Server");
         exit(EXIT_FAILURE);
     }
-    
+    tune_apply(proxy_fd, client_profile); // Inherited by the accepted socket
+
     if(listen(proxy_fd,1) != 0){
         perror("Listen Failure");
         exit(EXIT_FAILURE);
@@ -64,7 +622,8 @@ int main(){
         perror("Proxy Failed to Accept the Client Connection");
         exit(EXIT_FAILURE);
     }
-    
+    tune_apply(client_fd, client_profile);
+
     printf("Connection Accepted by the Proxy Server, fd:%d\n",client_fd);
     
     /*Connection to the Remote Server*/
@@ -73,6 +632,7 @@ int main(){
         perror("Failed to Create Socket for Remote Server");
         exit(EXIT_FAILURE);
     }
+    tune_apply(remote_fd, upstream_profile);
 
     remote_addr.sin_family=AF_INET;
     remote_addr.sin_port=htons(REMOTE_PORT);
@@ -119,27 +679,68 @@ int main(){
     }
 
     printf("Registered Both client_fd and remote_fd to Epoll Successfully\n");
-    
-    start_time = clock();
+
+    /*Interval reports, the timer is read through the ring in io_uring mode*/
+    timer_fd = report_timer_create(report_period);
+    if(timer_fd >= 0){
+        struct epoll_event timer_event;
+        timer_event.events = EPOLLIN;
+        timer_event.data.fd = timer_fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event)!=0){
+            perror("Failed to Register Report Timer to Epoll");
+            exit(EXIT_FAILURE);
+        }
+    }
+    report_start(&report);
+
+    if(uring_mode){
+        int ret = uring_relay(client_fd, remote_fd);
+        if(ret <= 0){
+            close(client_fd);
+            close(remote_fd);
+            close(proxy_fd);
+            close(epoll_fd);
+            stats();
+            return ret == 0 ? 0 : EXIT_FAILURE;
+        }
+    }
+    if(splice_mode){ // Also the fallback of -s -u when io_uring is unavailable
+        int ret = splice_relay(epoll_fd, client_fd, remote_fd, pipe_size);
+        close(client_fd);
+        close(remote_fd);
+        close(proxy_fd);
+        close(epoll_fd);
+        stats();
+        return ret == 0 ? 0 : EXIT_FAILURE;
+    }
 
     /*Poll For Packets*/
     int event_count= 0;
     struct epoll_event events[MAX_EVENTS];
-    int space_in_cb;
     int recv_count = 0,sent_count = 0;
     while(1)
     {
+        syscalls++;
         event_count = epoll_wait(epoll_fd,events,MAX_EVENTS,EPOLL_TIMEOUT_MILLIS);
         for(int i=0;i<event_count;i++)
         {
-            if(events[i].data.fd==client_fd)
+            if(events[i].data.fd==timer_fd)
+            {
+                report_timer_ack(timer_fd);
+                interval_stats(0, 0, 0); // Every read is written out before the next one
+            }
+            else if(events[i].data.fd==client_fd)
             {
                 if(events[i].events & EPOLLIN)
                 {
                        char *buffer = malloc(4096);
                        recv_count = read(client_fd,buffer,4096);
+                       syscalls++;
+                       reads++;
                        if(recv_count>0){
                             sent_count = write(remote_fd,buffer,recv_count);
+                            syscalls++;
+                            writes++;
                             if(sent_count<0){
                                 perror("Remote Send Failure");
                                 close(client_fd);
@@ -181,8 +782,12 @@ int main(){
                 {
                        char *buffer = malloc(4096);
                        recv_count = read(remote_fd,buffer,4096);
+                       syscalls++;
+                       reads++;
                        if(recv_count>0){
                             sent_count = write(client_fd,buffer,recv_count);
+                            syscalls++;
+                            writes++;
                             if(sent_count<0){
                                 perror("Client Send Failure");
                                 close(client_fd);
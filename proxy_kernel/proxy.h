@@ -0,0 +1,211 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include "cbuf.h"
+#include "uring.h"
+#include "report.h"
+#include "tune.h"
+#include "tcpinfo.h"
+
+#define CIRCULAR_BUFFER_SIZE 146000
+#define MAX_EVENTS 64
+#define EPOLL_TIMEOUT_MILLIS 30000
+#define LISTEN_BACKLOG 128
+#define URING_ENTRIES 256
+#define URING_FILE_SLOTS 4096   // Fixed file table, indexed by fd
+#define ADAPT_MIN_SIZE 65536    // Default bounds of BDP-adaptive buffer sizing (-a)
+#define ADAPT_MAX_SIZE (64 << 20)
+#define ADAPT_HEADROOM 2        // Buffers hold this many bandwidth-delay products
+#define UPSTREAM_POOL_CHECK_SECONDS 1 // Idle pooled connections are checked for remote closes this often
+#define CONNECT_TIMEOUT_MILLIS 3000   // Default bound on the remote handshake of a session (-c)
+#define CONNECT_STOP_CHECK_MILLIS 100 // Blocking handshakes check for a stop request this often
+#define MAX_BACKENDS 32               // Remote servers sessions are balanced across (-r)
+#define BACKEND_MAX_FAILURES 3        // Consecutive connect failures that eject a backend
+#define BACKEND_EJECT_SECONDS 10      // Time an ejected backend receives no sessions
+#define BACKEND_EWMA_WEIGHT 0.2       // Weight of the newest latency sample
+
+#define PROXY_IP "127.0.0.1"
+#define PROXY_PORT 1234
+#define REMOTE_IP "127.0.0.1"
+#define REMOTE_PORT 5678
+
+struct session;
+struct worker;
+struct threaded_session;
+struct backend;
+
+/*Warm connections to one remote server, refilled by a background thread (-k)*/
+typedef struct upstream_pool{
+    struct backend *backend;          // Server the connections go to
+    int size;                         // Connections kept open, 0 when disabled
+    int *fds;                         // Idle connections, newest last
+    int count;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;             // Guards everything but size and thread
+    pthread_cond_t taken;             // Wakes the refill thread
+    unsigned long long hits;          // Sessions served a warm connection
+    unsigned long long misses;        // Sessions that connected themselves
+    unsigned long long discarded;     // Idle connections closed by the remote
+    unsigned long long connect_failures;
+    latency_hist refill_latency;      // Time to establish each pooled connection
+} upstream_pool;
+
+/*How sessions are spread across the backends (-l)*/
+enum balance_policy{
+    BALANCE_ROUND_ROBIN,              // Each backend in turn
+    BALANCE_LEAST_SESSIONS,           // Fewest active sessions
+    BALANCE_EWMA,                     // Lowest latency EWMA, weighted by active sessions
+};
+
+/*Remote server sessions can be relayed to, shared by all workers*/
+typedef struct backend{
+    struct sockaddr_in addr;
+    char name[32];                    // ip:port
+    upstream_pool pool;               // Warm connections to this backend
+    int active;                       // Sessions currently relayed
+    int failures;                     // Consecutive connect failures
+    int ejected;                      // Passed over until reinstated
+    struct timespec reinstate;        // CLOCK_MONOTONIC, end of the ejection
+    double connect_ewma;              // Seconds, handshakes
+    double first_byte_ewma;           // Seconds from connected to the first byte received from the backend
+    unsigned long long sessions;
+    unsigned long long upstream;      // Bytes of closed sessions
+    unsigned long long downstream;
+    unsigned long long connect_failures;
+    unsigned long long ejections;
+} backend;
+
+/*One side of a proxied connection, registered to epoll through data.ptr*/
+struct endpoint{
+    int fd;
+    struct session *session;     // Owning session (NULL for the listener)
+    circular_buffer *rx_buffer;  // Data read from this fd waits here
+    circular_buffer *tx_buffer;  // Data to be written to this fd waits here
+    uint32_t interest;           // Events currently registered to epoll
+    int readable;                // Not known to be drained (cleared on EAGAIN)
+    int writable;                // Not known to be full (cleared on EAGAIN or short write)
+    int slot;                    // io_uring fixed file slot, -1 when fd is used directly
+    int recv_inflight;           // io_uring recv into rx_buffer submitted
+    int send_inflight;           // io_uring send from tx_buffer submitted
+    struct iovec recv_iov[2];    // Spans of the in-flight io_uring requests
+    struct iovec send_iov[2];
+    size_t rx_resize;            // Capacity decided for rx_buffer, applied once no request references it (0: none)
+    int eof;                     // Peer finished sending, no more reads
+    int eof_forwarded;           // rx_buffer drained after eof and the other side shut down for writing
+};
+
+/*Per client state: both sockets, both directions of buffering and counters*/
+struct session{
+    int id;
+    int closed;                       // Set once torn down, freed once no event or request references it
+    int connecting;                   // Remote handshake in progress, client bytes wait in client_buffer
+    int connect_inflight;             // io_uring poll for the handshake submitted
+    struct timespec connect_start;    // CLOCK_MONOTONIC, start of the handshake
+    struct timespec connected;        // CLOCK_MONOTONIC, end of the handshake
+    int first_byte;                   // A byte was received from the backend
+    backend *backend;                 // Remote server the session is relayed to
+    struct endpoint client;
+    struct endpoint remote;
+    circular_buffer client_buffer;    // Client -> Remote
+    circular_buffer remote_buffer;    // Remote -> Client
+    unsigned long long upstream;
+    unsigned long long downstream;
+    struct worker *worker;            // Worker owning the session
+    struct session *prev, *next;
+};
+
+/*One event loop with its own listener and sessions, shares no state with other workers*/
+struct worker{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int use_uring;                    // Data path runs on ring instead of epoll_fd
+    uring ring;
+    int fixed_files;                  // Sparse fixed file table registered to ring
+    struct sockaddr_in accept_addr;   // Peer address of the in-flight io_uring accept
+    socklen_t accept_addr_len;
+    int shutdown_fd;                  // eventfd written by the main thread to stop the loop
+    struct endpoint listener;         // SO_REUSEPORT listener, the kernel spreads clients across workers
+    cb_pool pool;                     // Chunks of the pooled session buffers (-p)
+    int pool_starved;                 // A session stopped reading because pool had no free chunk
+    struct session *sessions;         // Active sessions
+    struct session *closed_sessions;  // Sessions awaiting free at the end of the epoll batch
+    int next_session_id;
+    int active_sessions;
+    int connecting_sessions;          // Sessions waiting for the remote handshake
+    struct __kernel_timespec connect_timeout; // Linked to the handshake polls queued on ring
+    unsigned long long upstream;
+    unsigned long long downstream;
+    unsigned long long syscalls;      // Data path syscalls (event waits, reads, writes, interest updates)
+    unsigned long long reads;         // Receive calls or completed io_uring receives
+    unsigned long long writes;        // Send calls or completed io_uring sends
+    int timer_fd;                     // Periodic report timer, -1 when interval reports are disabled
+    uint64_t timer_expirations;       // Target of the timer read queued on ring
+    interval_report report;
+    latency_hist up_residence;        // Time bytes spent in Client -> Remote buffers, current interval
+    latency_hist down_residence;      // Remote -> Client
+    latency_hist up_residence_total;  // Earlier intervals
+    latency_hist down_residence_total;
+    pthread_mutex_t thread_lock;      // Guards the fields below, shared with the relay threads of -t
+    pthread_cond_t thread_done;       // Signalled when a threaded session is freed
+    struct threaded_session *threaded_sessions;
+    unsigned long long thread_syscalls; // Reads and writes of finished relay threads, folded into syscalls on stop
+    unsigned long long buffers_grown; // Resizes applied by adaptive buffer sizing
+    unsigned long long buffers_shrunk;
+    size_t largest_buffer;            // Largest capacity a session buffer was resized to
+    latency_hist connect_latency;     // Remote handshakes of sessions without a warm connection (under thread_lock with -t)
+    unsigned long long connect_failures; // Handshakes refused, failed or timed out
+    unsigned long long connect_timeouts;
+};
+
+extern int use_uring;
+extern int thread_per_direction;
+extern size_t buffer_size;
+extern size_t adapt_min;
+extern size_t adapt_max;
+extern const tune_profile *client_profile;
+extern int connect_timeout;
+extern tcpinfo_sampler upstream_sampler;
+
+int remote_connect(backend *b, const int *stopping);
+int remote_open(backend **b, int *connecting);
+int socket_error(int fd);
+int backend_add(const char *spec);
+int backend_policy(const char *name);
+backend *backend_pick();
+void backend_connect_done(backend *b, int err, double seconds);
+void backend_first_byte(backend *b, double seconds);
+void backend_release(backend *b, unsigned long long upstream, unsigned long long downstream);
+int backends_start(int pool_size);
+void backends_stop();
+void backends_print();
+int upstream_pool_start(upstream_pool *pool, backend *b, int size);
+int upstream_pool_take(upstream_pool *pool);
+void upstream_pool_stop(upstream_pool *pool);
+void upstream_pool_print(upstream_pool *pool);
+struct session *session_open(struct worker *w, int client_fd, struct sockaddr_in *client_addr);
+int session_epoll_start(struct session *s);
+void session_uring_start(struct session *s);
+void session_uring_arm(struct session *s);
+int session_connected(struct session *s, int err);
+void session_first_byte(struct session *s);
+int session_forward_eof(struct session *s);
+void session_close(struct session *s);
+void session_reap(struct worker *w);
+void session_buffers_resize(struct session *s);
+int worker_uring_init(struct worker *w);
+void *worker_run_uring(void *arg);
+void threaded_session_open(struct worker *w, int client_fd, struct sockaddr_in *client_addr);
+void threaded_sessions_stop(struct worker *w);
+void threaded_sessions_sample(struct worker *w, report_counters *now,
+                              size_t *up_queued, size_t *down_queued, size_t *capacity);
+void worker_report(struct worker *w);
+void worker_adapt(struct worker *w);
+void worker_timer(struct worker *w);
+void worker_pool_wake(struct worker *w);
+
+#endif
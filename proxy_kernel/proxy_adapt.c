@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+#include "proxy.h"
+
+/*BDP-adaptive buffer sizing: each direction is sized from TCP_INFO of the sockets it connects.
+  The sending socket's delivery rate times the larger minimum RTT of the two paths estimates the
+  bandwidth-delay product (smoothed RTTs would count the queueing the buffers themselves cause), the buffer is resized to ADAPT_HEADROOM times that within [adapt_min, adapt_max].*/
+
+/* Ring capacity for one direction of a session
+ * Arguments:
+ *   struct tcp_info *src - socket the direction reads from
+ *   struct tcp_info *dst - socket the direction writes to
+ * Return Value:
+ *   Capacity in bytes, 0 when the sockets have no estimate yet
+ */
+static size_t direction_target(struct tcp_info *src, struct tcp_info *dst){
+    unsigned long long rtt_us = MAX(src->tcpi_min_rtt, dst->tcpi_min_rtt);
+    unsigned long long bdp = dst->tcpi_delivery_rate * rtt_us / 1000000;
+    if(bdp == 0){
+        return 0;
+    }
+    size_t target = (ADAPT_HEADROOM * bdp + 4095) & ~(size_t)4095;
+    return MIN(MAX(target, adapt_min), adapt_max);
+}
+
+/* Decide the capacity of the buffer an endpoint reads into
+ * Arguments:
+ *   struct endpoint *src - endpoint whose rx_buffer is sized
+ *   struct tcp_info *src_info - TCP_INFO of src
+ *   struct tcp_info *dst_info - TCP_INFO of the endpoint the buffer is written to
+ * Return Value:
+ *   None
+ */
+static void endpoint_adapt(struct endpoint *src, struct tcp_info *src_info, struct tcp_info *dst_info){
+    struct session *s = src->session;
+    size_t capacity = src->rx_buffer->max_cap;
+    size_t target = direction_target(src_info, dst_info);
+    if(src->rx_buffer->pool != NULL){ // Pooled capacities are whole chunks
+        target = (target + CB_CHUNK_SIZE - 1) / CB_CHUNK_SIZE * CB_CHUNK_SIZE;
+    }
+
+    /*Hysteresis: grow by a quarter or shrink by half at least*/
+    if(target == 0 || (target <= capacity + capacity / 4 && target >= capacity / 2) ||
+       target == src->rx_resize){
+        return;
+    }
+    printf("Session %d.%d: %s Buffer %zu -> %zu B (RTT: %.3f ms, Delivery Rate: %.2f MB/s)\n",
+            s->worker->id,s->id,src == &s->client ? "UpStream" : "DownStream",capacity,target,
+            MAX(src_info->tcpi_min_rtt, dst_info->tcpi_min_rtt) / 1000.0,
+            dst_info->tcpi_delivery_rate / 1e6);
+    src->rx_resize = target;
+}
+
+/* Sample TCP_INFO of every session of a worker and decide new buffer capacities
+ * Arguments:
+ *   struct worker *w - worker owning the sessions
+ * Return Value:
+ *   None
+ * Note: the epoll data path resizes right away, io_uring sessions resize
+ *       from their completions once no request references the buffer
+ */
+void worker_adapt(struct worker *w){
+    struct session *next;
+    for(struct session *s = w->sessions; s != NULL; s = next){
+        struct tcp_info client_info, remote_info;
+        socklen_t client_len = sizeof(client_info), remote_len = sizeof(remote_info);
+        next = s->next;   // Resizing services the session, which may close it
+
+        memset(&client_info, 0, sizeof(client_info));
+        memset(&remote_info, 0, sizeof(remote_info));
+        w->syscalls += 2;
+        if(getsockopt(s->client.fd, IPPROTO_TCP, TCP_INFO, &client_info, &client_len) != 0 ||
+           getsockopt(s->remote.fd, IPPROTO_TCP, TCP_INFO, &remote_info, &remote_len) != 0){
+            continue;
+        }
+        endpoint_adapt(&s->client, &client_info, &remote_info);
+        endpoint_adapt(&s->remote, &remote_info, &client_info);
+        if(!w->use_uring){
+            session_buffers_resize(s);
+        }
+    }
+}
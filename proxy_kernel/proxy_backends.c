@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "proxy.h"
+
+/*Remote servers the sessions are balanced across. Every worker picks from the same table,
+  health and latency are tracked passively from the handshakes and first bytes of the sessions.*/
+
+static backend backends[MAX_BACKENDS];
+static int backend_count = 0;
+static enum balance_policy policy = BALANCE_ROUND_ROBIN;
+static int next_backend = 0;          // Round-robin cursor
+static pthread_mutex_t backends_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Add a remote server to balance sessions across
+ * Arguments:
+ *   const char *spec - "ip:port"
+ * Return Value:
+ *   0 on success
+ *   -1 on error (reported on stderr)
+ */
+int backend_add(const char *spec){
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strrchr(spec, ':');
+    int port = colon != NULL ? atoi(colon + 1) : 0;
+
+    if(backend_count == MAX_BACKENDS || colon == NULL || colon - spec >= (long)sizeof(ip) ||
+       port <= 0 || port > 65535){
+        fprintf(stderr, "Invalid Backend \"%s\" or Too Many Backends, Expected ip:port\n", spec);
+        return -1;
+    }
+    memcpy(ip, spec, colon - spec);
+    ip[colon - spec] = '\0';
+
+    backend *b = &backends[backend_count];
+    memset(b, 0, sizeof(backend));
+    b->addr.sin_family = AF_INET;
+    b->addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, ip, &b->addr.sin_addr) <= 0){
+        fprintf(stderr, "Invalid Backend Address \"%s\"\n", ip);
+        return -1;
+    }
+    snprintf(b->name, sizeof(b->name), "%s:%d", ip, port);
+    backend_count++;
+    return 0;
+}
+
+/* Select how sessions are spread across the backends
+ * Arguments:
+ *   const char *name - rr, least or ewma
+ * Return Value:
+ *   0 on success
+ *   -1 for an unknown policy
+ */
+int backend_policy(const char *name){
+    if(strcmp(name, "rr") == 0){
+        policy = BALANCE_ROUND_ROBIN;
+    }
+    else if(strcmp(name, "least") == 0){
+        policy = BALANCE_LEAST_SESSIONS;
+    }
+    else if(strcmp(name, "ewma") == 0){
+        policy = BALANCE_EWMA;
+    }
+    else{
+        return -1;
+    }
+    return 0;
+}
+
+/* Latency score of a backend for BALANCE_EWMA, with the backends lock held
+ * Arguments:
+ *   backend *b - backend to score
+ * Return Value:
+ *   Expected latency times the sessions it would serve, so one fast backend does not take every new session
+ *   before its estimate catches up
+ */
+static double backend_score(backend *b){
+    return (b->connect_ewma + b->first_byte_ewma) * (b->active + 1);
+}
+
+/* Choose the backend of a new session and count the session on it
+ * Arguments:
+ *   None
+ * Return Value:
+ *   Backend to connect to, ejected backends are only used when every backend is ejected
+ */
+backend *backend_pick(){
+    struct timespec now;
+    backend *best = NULL;
+    int healthy = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&backends_lock);
+    for(int i=0;i<backend_count;i++){
+        backend *b = &backends[i];
+        if(b->ejected && (now.tv_sec > b->reinstate.tv_sec ||
+           (now.tv_sec == b->reinstate.tv_sec && now.tv_nsec >= b->reinstate.tv_nsec))){
+            b->ejected = 0;
+            b->failures = BACKEND_MAX_FAILURES - 1; // On probation, the next failure ejects it again
+            printf("Backend %s Reinstated\n", b->name);
+        }
+        healthy += !b->ejected;
+    }
+
+    for(int n=0;n<backend_count;n++){
+        int i = (next_backend + n) % backend_count; // Ties go to the next backend in turn
+        backend *b = &backends[i];
+        if(b->ejected && healthy > 0){
+            continue;
+        }
+        if(best == NULL ||
+           (policy == BALANCE_LEAST_SESSIONS && b->active < best->active) ||
+           (policy == BALANCE_EWMA && backend_score(b) < backend_score(best))){
+            best = b;
+        }
+        if(policy == BALANCE_ROUND_ROBIN){
+            break;
+        }
+    }
+    next_backend = (best - backends + 1) % backend_count;
+    best->active++;
+    best->sessions++;
+    pthread_mutex_unlock(&backends_lock);
+    return best;
+}
+
+/* Update the health and handshake latency of a backend
+ * Arguments:
+ *   backend *b     - backend connected to
+ *   int err        - 0 when connected, errno of the failed handshake otherwise
+ *   double seconds - duration of a successful handshake, negative when it is not a latency sample
+ * Return Value:
+ *   None
+ */
+void backend_connect_done(backend *b, int err, double seconds){
+    pthread_mutex_lock(&backends_lock);
+    if(err == 0){
+        b->failures = 0;
+        b->ejected = 0; // Also reinstated by a warm connection succeeding
+        if(seconds >= 0){
+            b->connect_ewma = b->connect_ewma == 0 ? seconds : // The first sample sets the estimate
+                              b->connect_ewma + BACKEND_EWMA_WEIGHT * (seconds - b->connect_ewma);
+        }
+    }
+    else{
+        b->connect_failures++;
+        if(++b->failures >= BACKEND_MAX_FAILURES && !b->ejected){
+            clock_gettime(CLOCK_MONOTONIC, &b->reinstate);
+            b->reinstate.tv_sec += BACKEND_EJECT_SECONDS;
+            b->ejected = 1;
+            b->ejections++;
+            printf("Backend %s Ejected After %d Connect Failures\n", b->name, b->failures);
+        }
+    }
+    pthread_mutex_unlock(&backends_lock);
+}
+
+/* Update the first byte latency of a backend
+ * Arguments:
+ *   backend *b     - backend of the session
+ *   double seconds - from the end of the handshake to the first byte received
+ * Return Value:
+ *   None
+ */
+void backend_first_byte(backend *b, double seconds){
+    pthread_mutex_lock(&backends_lock);
+    b->first_byte_ewma = b->first_byte_ewma == 0 ? seconds :
+                         b->first_byte_ewma + BACKEND_EWMA_WEIGHT * (seconds - b->first_byte_ewma);
+    pthread_mutex_unlock(&backends_lock);
+}
+
+/* Account a finished session to its backend
+ * Arguments:
+ *   backend *b                  - backend returned by backend_pick()
+ *   unsigned long long upstream - bytes relayed to the backend
+ *   unsigned long long downstream - bytes relayed from the backend
+ * Return Value:
+ *   None
+ */
+void backend_release(backend *b, unsigned long long upstream, unsigned long long downstream){
+    pthread_mutex_lock(&backends_lock);
+    b->active--;
+    b->upstream += upstream;
+    b->downstream += downstream;
+    pthread_mutex_unlock(&backends_lock);
+}
+
+/* Use the default remote server when none was given and start the warm connection pools
+ * Arguments:
+ *   int pool_size - warm connections kept per backend, 0 for none
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int backends_start(int pool_size){
+    if(backend_count == 0){
+        char spec[32];
+        snprintf(spec, sizeof(spec), "%s:%d", REMOTE_IP, REMOTE_PORT);
+        if(backend_add(spec) != 0){
+            return -1;
+        }
+    }
+    for(int i=0;i<backend_count;i++){
+        if(upstream_pool_start(&backends[i].pool, &backends[i], pool_size) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Stop the warm connection pools
+ * Arguments:
+ *   None
+ * Return Value:
+ *   None
+ */
+void backends_stop(){
+    for(int i=0;i<backend_count;i++){
+        upstream_pool_stop(&backends[i].pool);
+    }
+}
+
+/* Print the per backend statistics
+ * Arguments:
+ *   None
+ * Return Value:
+ *   None
+ */
+void backends_print(){
+    for(int i=0;i<backend_count;i++){
+        backend *b = &backends[i];
+        printf("Backend %s: Sessions: %llu, UpStream: %llu B, DownStream: %llu B, Connect Failures: %llu, Ejections: %llu, "
+               "Connect EWMA: %.1f us, First Byte EWMA: %.1f us\n",
+                b->name,b->sessions,b->upstream,b->downstream,b->connect_failures,b->ejections,
+                b->connect_ewma * 1e6,b->first_byte_ewma * 1e6);
+        upstream_pool_print(&b->pool);
+    }
+}
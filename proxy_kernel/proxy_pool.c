@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include "proxy.h"
+
+/*Warm upstream connections: a refill thread per backend keeps up to size connections to it open,
+  sessions take one instead of paying a handshake after accept. Shared by all workers.*/
+
+/* Check whether an idle upstream connection is still usable
+ * Arguments:
+ *   int fd - connected socket
+ * Return Value:
+ *   1 when open (data sent by the remote while idle is kept for the session)
+ *   0 when the remote closed it or it failed
+ */
+static int upstream_alive(int fd){
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* Close the idle connections the remote closed, with the pool lock held
+ * Arguments:
+ *   upstream_pool *pool - pool to check
+ * Return Value:
+ *   None
+ */
+static void upstream_pool_sweep(upstream_pool *pool){
+    for(int i=0;i<pool->count;){
+        if(upstream_alive(pool->fds[i])){
+            i++;
+            continue;
+        }
+        close(pool->fds[i]);
+        pool->fds[i] = pool->fds[--pool->count];
+        pool->discarded++;
+    }
+}
+
+/* Refill thread: connect until the pool is full, then check the idle connections periodically
+ * Arguments:
+ *   void *arg - upstream_pool to refill
+ * Return Value:
+ *   NULL
+ */
+static void *upstream_pool_run(void *arg){
+    upstream_pool *pool = arg;
+    struct timespec start, wake;
+    struct sched_param param = {0};
+
+    /*Refills only use idle CPU time, they must not delay the sessions they are meant to speed up*/
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->stopping){
+        if(pool->count < pool->size){
+            pthread_mutex_unlock(&pool->lock);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int fd = remote_connect(pool->backend, &pool->stopping); // Bounded by connect_timeout
+            double seconds = elapsed_seconds(&start);
+            if(fd >= 0 || errno != ECANCELED){
+                backend_connect_done(pool->backend, fd < 0 ? errno : 0, -1); // Health only, refills run at idle priority
+            }
+            pthread_mutex_lock(&pool->lock);
+            if(fd >= 0){
+                hist_record(&pool->refill_latency, seconds * 1e9, 1);
+                pool->fds[pool->count++] = fd; // Closed by upstream_pool_stop() when it raced a stop
+                continue;
+            }
+            if(pool->stopping){
+                break;
+            }
+            pool->connect_failures++;  // Remote unreachable, retry after a pause
+        }
+
+        /*Wait for a connection to be taken, a retry or the next health check*/
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += UPSTREAM_POOL_CHECK_SECONDS;
+        pthread_cond_timedwait(&pool->taken, &pool->lock, &wake);
+        upstream_pool_sweep(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Start keeping warm connections to a backend
+ * Arguments:
+ *   upstream_pool *pool - pool to start (zeroed)
+ *   backend *b          - server to connect to
+ *   int size            - connections kept open, 0 leaves the pool disabled
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int upstream_pool_start(upstream_pool *pool, backend *b, int size){
+    pool->backend = b;
+    if(size <= 0){
+        return 0;
+    }
+    pool->fds = calloc(size, sizeof(int));
+    if(pool->fds == NULL){
+        return -1;
+    }
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->taken, NULL);
+    if(pthread_create(&pool->thread, NULL, upstream_pool_run, pool) != 0){
+        free(pool->fds);
+        pool->fds = NULL;
+        pool->size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Take a warm connection to the remote server
+ * Arguments:
+ *   upstream_pool *pool - pool to take from
+ * Return Value:
+ *   Connected socket (blocking) on a hit
+ *   -1 when the pool is disabled or empty, the caller connects itself
+ */
+int upstream_pool_take(upstream_pool *pool){
+    int fd = -1;
+    if(pool->size == 0){
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while(pool->count > 0 && fd < 0){ // Newest first, the least likely to be closed by an idle timeout
+        fd = pool->fds[--pool->count];
+        if(!upstream_alive(fd)){
+            close(fd);
+            fd = -1;
+            pool->discarded++;
+        }
+    }
+    if(fd >= 0){
+        pool->hits++;
+    }
+    else{
+        pool->misses++;
+    }
+    pthread_cond_signal(&pool->taken);
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+/* Stop the refill thread and close the idle connections
+ * Arguments:
+ *   upstream_pool *pool - pool to stop
+ * Return Value:
+ *   None
+ */
+void upstream_pool_stop(upstream_pool *pool){
+    if(pool->size == 0){
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED); // Also read by remote_connect() without the lock
+    pthread_cond_signal(&pool->taken);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+    while(pool->count > 0){
+        close(pool->fds[--pool->count]);
+    }
+    free(pool->fds);
+    pool->fds = NULL;
+}
+
+/* Print the pool statistics
+ * Arguments:
+ *   upstream_pool *pool - stopped pool
+ * Return Value:
+ *   None
+ */
+void upstream_pool_print(upstream_pool *pool){
+    if(pool->size == 0){
+        return;
+    }
+    unsigned long long taken = pool->hits + pool->misses;
+    printf("Upstream Pool %s: Size: %d, Hits: %llu, Misses: %llu, Hit Rate: %.1f%%, Discarded: %llu, Connect Failures: %llu\n",
+            pool->backend->name,pool->size,pool->hits,pool->misses,taken ? 100.0 * pool->hits / taken : 0.0,
+            pool->discarded,pool->connect_failures);
+    char label[64];
+    snprintf(label, sizeof(label), "Upstream Pool %s Refill: ", pool->backend->name);
+    hist_print(label, &pool->refill_latency);
+}
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "proxy.h"
+
+#define THREAD_STACK_SIZE (256 * 1024)   // Relay threads only hold a few locals
+
+struct threaded_session;
+
+/*One direction of a threaded session: a reader thread fills ring, a writer thread drains it*/
+struct pipe_dir{
+    struct threaded_session *session;
+    spsc_buffer ring;
+    int src_fd;
+    int dst_fd;
+    unsigned long long bytes;         // Written to dst_fd by the writer thread
+    unsigned long long reads;         // Updated by the reader thread
+    unsigned long long writes;        // Updated by the writer thread
+    // Counters are updated with relaxed atomics, the worker samples them for interval reports
+};
+
+/*Session relayed by four blocking threads instead of the worker event loop*/
+struct threaded_session{
+    int id;
+    int client_fd;
+    int remote_fd;
+    int aborted;                      // Set once both sockets were shut down on error or stop
+    int connecting;                   // Remote handshake left to the upstream writer
+    struct timespec connect_start;    // CLOCK_MONOTONIC, start of the handshake
+    struct timespec connected;        // CLOCK_MONOTONIC, end of the handshake, set before the downstream reader starts
+    backend *backend;                 // Remote server the session is relayed to
+    int threads;                      // Relay threads still running, the last one frees the session
+    struct pipe_dir upstream;         // Client -> Remote
+    struct pipe_dir downstream;       // Remote -> Client
+    struct worker *worker;
+    struct threaded_session *prev, *next;
+};
+
+/* Stop both directions of a session after an error, blocked threads return promptly
+ * Arguments:
+ *   struct threaded_session *s - session to abort
+ * Return Value:
+ *   None
+ */
+static void threaded_session_abort(struct threaded_session *s){
+    if(__atomic_exchange_n(&s->aborted, 1, __ATOMIC_ACQ_REL)){
+        return;
+    }
+    shutdown(s->client_fd, SHUT_RDWR);
+    shutdown(s->remote_fd, SHUT_RDWR);
+    spsc_close(&s->upstream.ring);
+    spsc_close(&s->downstream.ring);
+}
+
+/* Called by each relay thread on exit, the last one folds counters into the worker and frees the session
+ * Arguments:
+ *   struct threaded_session *s - session the thread relayed for
+ * Return Value:
+ *   None
+ */
+static void threaded_session_release(struct threaded_session *s){
+    struct worker *w = s->worker;
+    if(__atomic_sub_fetch(&s->threads, 1, __ATOMIC_ACQ_REL) != 0){
+        return;
+    }
+
+    pthread_mutex_lock(&w->thread_lock);
+    if(s->prev != NULL){
+        s->prev->next = s->next;
+    }
+    else{
+        w->threaded_sessions = s->next;
+    }
+    if(s->next != NULL){
+        s->next->prev = s->prev;
+    }
+    w->active_sessions--;
+    w->upstream += s->upstream.bytes;
+    w->downstream += s->downstream.bytes;
+    w->reads += s->upstream.reads + s->downstream.reads;
+    w->writes += s->upstream.writes + s->downstream.writes;
+    w->thread_syscalls += s->upstream.reads + s->upstream.writes +
+                          s->downstream.reads + s->downstream.writes;
+    printf("Session %d.%d Closed: UpStream: %llu B, DownStream: %llu B\n",
+            w->id,s->id,s->upstream.bytes,s->downstream.bytes);
+    pthread_cond_signal(&w->thread_done);
+    pthread_mutex_unlock(&w->thread_lock);
+    backend_release(s->backend, s->upstream.bytes, s->downstream.bytes);
+
+    tcpinfo_unwatch(&upstream_sampler, s->remote_fd);
+    close(s->client_fd);
+    close(s->remote_fd);
+    spsc_destroy(&s->upstream.ring);
+    spsc_destroy(&s->downstream.ring);
+    free(s);
+}
+
+/* Start one relay thread of a session
+ * Arguments:
+ *   struct threaded_session *s - session to relay
+ *   void *(*routine)(void *)   - pipe_dir_reader or pipe_dir_writer
+ *   struct pipe_dir *d         - direction the thread relays
+ * Return Value:
+ *   0 on success
+ *   -1 when the thread failed to start, it is released in its place
+ */
+static int threaded_session_spawn(struct threaded_session *s, void *(*routine)(void *), struct pipe_dir *d){
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    if(pthread_create(&thread, &attr, routine, d) != 0){
+        fprintf(stderr, "Session %d.%d: Failed to Create Relay Thread\n", s->worker->id, s->id);
+        threaded_session_abort(s);
+        threaded_session_release(s);
+        ret = -1;
+    }
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/* Wait for the remote handshake of a session, the client bytes read meanwhile stay in the upstream ring
+ * Arguments:
+ *   struct threaded_session *s - connecting session
+ * Return Value:
+ *   0 when connected (the remote socket is made blocking)
+ *   -1 when the handshake failed or timed out (the session is aborted)
+ */
+static int threaded_session_connect(struct threaded_session *s){
+    struct worker *w = s->worker;
+    struct pollfd pfd = { .fd = s->remote_fd, .events = POLLOUT };
+    int ret, err;
+
+    do{
+        ret = poll(&pfd, 1, connect_timeout);
+    }while(ret < 0 && errno == EINTR);
+    err = ret == 0 ? ETIMEDOUT : ret < 0 ? errno : socket_error(s->remote_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &s->connected);
+    double seconds = elapsed_seconds(&s->connect_start);
+    pthread_mutex_lock(&w->thread_lock);
+    if(err == 0){
+        hist_record(&w->connect_latency, seconds * 1e9, 1);
+    }
+    else{
+        w->connect_failures++;
+        w->connect_timeouts += (err == ETIMEDOUT);
+    }
+    pthread_mutex_unlock(&w->thread_lock);
+    backend_connect_done(s->backend, err, seconds);
+
+    if(err != 0){
+        printf("Session %d.%d: Failed to Connect to Backend %s: %s\n",w->id,s->id,s->backend->name,strerror(err));
+        threaded_session_abort(s);
+        return -1;
+    }
+    fcntl(s->remote_fd, F_SETFL, fcntl(s->remote_fd, F_GETFL) & ~O_NONBLOCK);
+    return 0;
+}
+
+/* Reader thread: blocking reads from src_fd straight into the free spans of the ring
+ * Arguments:
+ *   void *arg - struct pipe_dir to fill
+ * Return Value:
+ *   NULL
+ */
+static void *pipe_dir_reader(void *arg){
+    struct pipe_dir *d = arg;
+    struct threaded_session *s = d->session;
+    int first_byte = (d == &s->upstream); // Only bytes from the backend are timed
+    struct iovec iov[2];
+
+    while(spsc_wait_free(&d->ring) == 0){
+        int cnt = spsc_peek_free(&d->ring, iov);
+        __atomic_fetch_add(&d->reads, 1, __ATOMIC_RELAXED);
+        ssize_t n = readv(d->src_fd, iov, cnt);
+        if(n > 0){
+            spsc_commit_push(&d->ring, n);
+            if(!first_byte){
+                first_byte = 1;
+                backend_first_byte(s->backend, elapsed_seconds(&s->connected));
+            }
+        }
+        else if(n == 0){
+            spsc_close(&d->ring);     // EOF, the writer flushes what is left and half-closes dst_fd
+            break;
+        }
+        else if(errno != EINTR){
+            threaded_session_abort(d->session);
+            break;
+        }
+    }
+    threaded_session_release(d->session);
+    return NULL;
+}
+
+/* Writer thread: blocking writes from the data spans of the ring to dst_fd
+ * The upstream writer of a connecting session first completes the handshake
+ * and then starts the downstream reader, the only other user of the remote socket.
+ * Arguments:
+ *   void *arg - struct pipe_dir to drain
+ * Return Value:
+ *   NULL
+ */
+static void *pipe_dir_writer(void *arg){
+    struct pipe_dir *d = arg;
+    struct threaded_session *s = d->session;
+    struct iovec iov[2];
+
+    if(d == &s->upstream && s->connecting){
+        if(threaded_session_connect(s) == 0){
+            threaded_session_spawn(s, pipe_dir_reader, &s->downstream);
+        }
+        else{
+            threaded_session_release(s); // In place of the downstream reader
+        }
+    }
+
+    while(spsc_wait_data(&d->ring) == 0){
+        int cnt = spsc_peek_data(&d->ring, iov);
+        __atomic_fetch_add(&d->writes, 1, __ATOMIC_RELAXED);
+        ssize_t n = writev(d->dst_fd, iov, cnt);
+        if(n > 0){
+            spsc_commit_pop(&d->ring, n);
+            __atomic_fetch_add(&d->bytes, n, __ATOMIC_RELAXED);
+        }
+        else if(n < 0 && errno != EINTR){
+            threaded_session_abort(d->session);
+            break;
+        }
+    }
+
+    /*Ring closed and drained: forward the EOF, the other direction keeps running*/
+    shutdown(d->dst_fd, SHUT_WR);
+    threaded_session_release(d->session);
+    return NULL;
+}
+
+/* Connect an accepted client to the remote server and relay it with one reader and one writer thread per direction
+ * Arguments:
+ *   struct worker *w - worker that accepted the client
+ *   int client_fd - accepted client socket, closed on error
+ *   struct sockaddr_in *client_addr - peer address of the client
+ * Return Value:
+ *   None
+ * Note: sockets are blocking once connected, the SPSC rings are the only state shared between threads.
+ *       The worker only starts the handshake, the upstream writer waits for it.
+ */
+void threaded_session_open(struct worker *w, int client_fd, struct sockaddr_in *client_addr){
+    int connecting;
+    backend *b;
+    int remote_fd = remote_open(&b, &connecting);
+    if(remote_fd < 0){
+        close(client_fd);
+        return;
+    }
+
+    struct threaded_session *s = calloc(1, sizeof(struct threaded_session));
+    if(s == NULL ||
+       spsc_init(&s->upstream.ring, buffer_size) != CB_SUCCESS ||
+       spsc_init(&s->downstream.ring, buffer_size) != CB_SUCCESS){
+        perror("Failed to Allocate Session");
+        if(s != NULL){
+            spsc_destroy(&s->upstream.ring);
+            spsc_destroy(&s->downstream.ring);
+            free(s);
+        }
+        close(client_fd);
+        close(remote_fd);
+        backend_release(b, 0, 0);
+        return;
+    }
+    s->client_fd = client_fd;
+    s->remote_fd = remote_fd;
+    s->worker = w;
+    s->upstream.session = s;
+    s->upstream.src_fd = client_fd;
+    s->upstream.dst_fd = remote_fd;
+    s->downstream.session = s;
+    s->downstream.src_fd = remote_fd;
+    s->downstream.dst_fd = client_fd;
+    s->threads = 4;
+    s->backend = b;
+    s->connecting = connecting;
+    clock_gettime(CLOCK_MONOTONIC, &s->connect_start);
+    s->connected = s->connect_start;
+    s->id = w->next_session_id++;
+
+    pthread_mutex_lock(&w->thread_lock);
+    s->next = w->threaded_sessions;
+    if(w->threaded_sessions != NULL){
+        w->threaded_sessions->prev = s;
+    }
+    w->threaded_sessions = s;
+    w->active_sessions++;
+    tcpinfo_watch(&upstream_sampler, remote_fd, w->id, s->id);
+    printf("Session %d.%d: Client %s:%d <-> Remote %s, Active: %d\n",w->id,s->id,
+            inet_ntoa(client_addr->sin_addr),ntohs(client_addr->sin_port),
+            b->name,w->active_sessions);
+    pthread_mutex_unlock(&w->thread_lock);
+
+    /*The downstream reader of a connecting session is started by the upstream writer*/
+    threaded_session_spawn(s, pipe_dir_reader, &s->upstream);
+    threaded_session_spawn(s, pipe_dir_writer, &s->downstream);
+    if(!connecting){
+        threaded_session_spawn(s, pipe_dir_reader, &s->downstream);
+    }
+    if(threaded_session_spawn(s, pipe_dir_writer, &s->upstream) != 0 && connecting){
+        threaded_session_release(s); // Nor will the downstream reader start
+    }
+}
+
+/* Abort all threaded sessions of a worker and wait until their threads are gone
+ * Arguments:
+ *   struct worker *w - stopping worker
+ * Return Value:
+ *   None
+ */
+void threaded_sessions_stop(struct worker *w){
+    pthread_mutex_lock(&w->thread_lock);
+    for(struct threaded_session *s = w->threaded_sessions; s != NULL; s = s->next){
+        threaded_session_abort(s);
+    }
+    while(w->threaded_sessions != NULL){
+        pthread_cond_wait(&w->thread_done, &w->thread_lock);
+    }
+    pthread_mutex_unlock(&w->thread_lock);
+    w->syscalls += w->thread_syscalls;
+}
+
+/* Add the live counters and ring fill of the threaded sessions of a worker to a report sample
+ * Arguments:
+ *   struct worker *w      - worker owning the sessions
+ *   report_counters *now  - sample taken from the worker counters
+ *   size_t *up_queued     - bytes buffered towards the remote
+ *   size_t *down_queued   - bytes buffered towards the client
+ *   size_t *capacity      - total ring capacity per direction
+ * Return Value:
+ *   None
+ */
+void threaded_sessions_sample(struct worker *w, report_counters *now,
+                              size_t *up_queued, size_t *down_queued, size_t *capacity){
+    pthread_mutex_lock(&w->thread_lock);
+    now->upstream = w->upstream;
+    now->downstream = w->downstream;
+    now->reads = w->reads;
+    now->writes = w->writes;
+    now->syscalls += w->thread_syscalls;
+    for(struct threaded_session *s = w->threaded_sessions; s != NULL; s = s->next){
+        struct pipe_dir *dirs[2] = {&s->upstream, &s->downstream};
+        for(int i=0;i<2;i++){
+            unsigned long long reads = __atomic_load_n(&dirs[i]->reads, __ATOMIC_RELAXED);
+            unsigned long long writes = __atomic_load_n(&dirs[i]->writes, __ATOMIC_RELAXED);
+            *(i == 0 ? &now->upstream : &now->downstream) += __atomic_load_n(&dirs[i]->bytes, __ATOMIC_RELAXED);
+            *(i == 0 ? up_queued : down_queued) += spsc_used_cp(&dirs[i]->ring);
+            now->reads += reads;
+            now->writes += writes;
+            now->syscalls += reads + writes;
+        }
+        *capacity += s->upstream.ring.max_cap;
+    }
+    pthread_mutex_unlock(&w->thread_lock);
+}
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "proxy.h"
+
+/*Operation encoded in the low bits of io_uring user_data, endpoints are 8 byte aligned.
+  Reads of the worker eventfds use URING_OP_SHUTDOWN, with the worker report as pointer for the timer*/
+#define URING_OP_SHUTDOWN 0
+#define URING_OP_RECV     1
+#define URING_OP_SEND     2
+#define URING_OP_ACCEPT   3
+#define URING_OP_CONNECT  4   // Poll for the remote handshake of a session
+#define URING_OP_TIMEOUT  5   // Connect timeout linked to that poll, carries no endpoint
+#define URING_OP_MASK     7
+
+/* Create the io_uring instance of a worker and its fixed file table
+ * Arguments:
+ *   struct worker *w - worker initialized by worker_init()
+ * Return Value:
+ *   0 on success (w->use_uring is set)
+ *   -1 when io_uring is unavailable, the worker stays on epoll
+ */
+int worker_uring_init(struct worker *w){
+    if(uring_init(&w->ring, URING_ENTRIES) != 0){
+        return -1;
+    }
+    if(!uring_opcode_supported(&w->ring, IORING_OP_RECV) ||
+       !uring_opcode_supported(&w->ring, IORING_OP_SEND) ||
+       !uring_opcode_supported(&w->ring, IORING_OP_ACCEPT) ||
+       !uring_opcode_supported(&w->ring, IORING_OP_POLL_ADD) ||
+       !uring_opcode_supported(&w->ring, IORING_OP_LINK_TIMEOUT)){
+        uring_exit(&w->ring);
+        memset(&w->ring, 0, sizeof(uring));
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    /*Registered files save the fd table lookup and refcount on every request*/
+    if(uring_register_files(&w->ring, URING_FILE_SLOTS) != 0){
+        perror("io_uring Fixed Files Unavailable");
+    }
+    else{
+        w->fixed_files = 1;
+    }
+    w->connect_timeout.tv_sec = connect_timeout / 1000;
+    w->connect_timeout.tv_nsec = (connect_timeout % 1000) * 1000000LL;
+    w->use_uring = 1;
+    return 0;
+}
+
+/* Install an endpoint socket in the worker fixed file table
+ * Arguments:
+ *   struct worker *w    - worker owning the ring
+ *   struct endpoint *ep - endpoint to register
+ * Return Value:
+ *   None (ep->slot stays -1 when the fd cannot be registered)
+ */
+static void endpoint_uring_register(struct worker *w, struct endpoint *ep){
+    ep->slot = -1;
+    if(!w->fixed_files || ep->fd >= URING_FILE_SLOTS){
+        return;
+    }
+    if(uring_update_file(&w->ring, ep->fd, ep->fd) == 0){
+        ep->slot = ep->fd;
+    }
+}
+
+/* Point a request at an endpoint socket, through the fixed file table when registered
+ * Arguments:
+ *   struct io_uring_sqe *sqe - request to update
+ *   struct endpoint *ep      - endpoint the request operates on
+ * Return Value:
+ *   None
+ */
+static void sqe_set_endpoint(struct io_uring_sqe *sqe, struct endpoint *ep){
+    if(ep->slot >= 0){
+        sqe->fd = ep->slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+/* Queue the requests an endpoint can make progress with
+ * A recv into rx_buffer and a send from tx_buffer are kept in flight whenever
+ * there is free space and pending data respectively. The spans of the two
+ * requests never overlap, so the circular buffer is only updated on completion.
+ * No recv is queued while rx_buffer waits for a resize, so the pending send drains it.
+ * Nothing is queued on the remote endpoint until its handshake completed.
+ * Arguments:
+ *   struct endpoint *ep - endpoint to service
+ * Return Value:
+ *   None
+ */
+static void endpoint_uring_arm(struct endpoint *ep){
+    struct session *s = ep->session;
+    struct worker *w = s->worker;
+    struct io_uring_sqe *sqe;
+    int iovcnt;
+
+    if(s->closed || (s->connecting && ep == &s->remote)){
+        return;
+    }
+    if(!ep->recv_inflight && !ep->eof && ep->rx_resize == 0){
+        iovcnt = cb_peek_free(ep->rx_buffer, ep->recv_iov);
+        if(iovcnt == 0 && cb_free_cp(ep->rx_buffer) > 0){ // Pool exhausted, worker_pool_wake() arms the recv later
+            w->pool_starved = 1;
+        }
+        else if(iovcnt > 0 && (sqe = uring_get_sqe(&w->ring)) != NULL){
+            if(iovcnt == 1){
+                uring_prep_rw(sqe, IORING_OP_RECV, ep->fd, ep->recv_iov[0].iov_base,
+                              ep->recv_iov[0].iov_len, (uintptr_t)ep | URING_OP_RECV);
+            }
+            else{
+                uring_prep_rw(sqe, IORING_OP_READV, ep->fd, ep->recv_iov, iovcnt,
+                              (uintptr_t)ep | URING_OP_RECV);
+            }
+            sqe_set_endpoint(sqe, ep);
+            ep->recv_inflight = 1;
+        }
+        else if(iovcnt > 0){ // Ring full, the chunk reserved for the recv goes back
+            cb_commit_push(ep->rx_buffer, 0);
+        }
+    }
+    if(!ep->send_inflight && (iovcnt = cb_peek_data(ep->tx_buffer, ep->send_iov)) > 0){
+        sqe = uring_get_sqe(&w->ring);
+        if(sqe != NULL){
+            if(iovcnt == 1){
+                uring_prep_rw(sqe, IORING_OP_SEND, ep->fd, ep->send_iov[0].iov_base,
+                              ep->send_iov[0].iov_len, (uintptr_t)ep | URING_OP_SEND);
+                sqe->msg_flags = MSG_NOSIGNAL;
+            }
+            else{
+                uring_prep_rw(sqe, IORING_OP_WRITEV, ep->fd, ep->send_iov, iovcnt,
+                              (uintptr_t)ep | URING_OP_SEND);
+            }
+            sqe_set_endpoint(sqe, ep);
+            ep->send_inflight = 1;
+        }
+    }
+}
+
+/* Queue a poll for the remote handshake of a session, linked to the worker connect timeout
+ * Arguments:
+ *   struct session *s - connecting session
+ * Return Value:
+ *   0 on success
+ *   -1 when the ring is full
+ */
+static int session_uring_connect(struct session *s){
+    struct worker *w = s->worker;
+    /*The poll must not be flushed before its link flag is set, so both entries are reserved up front.
+      Without room for both the kernel's own SYN retries bound the handshake.*/
+    int linked = uring_reserve_sqes(&w->ring, 2) == 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if(sqe == NULL){
+        return -1;
+    }
+    uring_prep_rw(sqe, IORING_OP_POLL_ADD, s->remote.fd, NULL, 0, (uintptr_t)&s->remote | URING_OP_CONNECT);
+    sqe->poll32_events = POLLOUT;
+    sqe_set_endpoint(sqe, &s->remote);
+    s->connect_inflight = 1;
+
+    if(linked){
+        sqe->flags |= IOSQE_IO_LINK;
+        uring_prep_rw(uring_get_sqe(&w->ring), IORING_OP_LINK_TIMEOUT, -1, &w->connect_timeout, 1, URING_OP_TIMEOUT);
+    }
+    return 0;
+}
+
+/* Queue the requests both sides of a session are able to make
+ * Arguments:
+ *   struct session *s - established session
+ * Return Value:
+ *   None
+ */
+void session_uring_arm(struct session *s){
+    endpoint_uring_arm(&s->client);
+    endpoint_uring_arm(&s->remote);
+}
+
+/* Register a new session with the worker ring and start both directions
+ * Arguments:
+ *   struct session *s - newly opened session
+ * Return Value:
+ *   None (the session is closed when its handshake cannot be waited for)
+ */
+void session_uring_start(struct session *s){
+    endpoint_uring_register(s->worker, &s->client);
+    endpoint_uring_register(s->worker, &s->remote);
+    if(s->connecting){ // Requests on a non-blocking socket would complete with -EAGAIN instead of waiting
+        fcntl(s->remote.fd, F_SETFL, fcntl(s->remote.fd, F_GETFL) & ~O_NONBLOCK);
+        if(session_uring_connect(s) != 0){
+            session_connected(s, EBUSY);
+            return;
+        }
+    }
+    session_uring_arm(s);
+}
+
+/* Queue an accept on the worker listener
+ * Arguments:
+ *   struct worker *w - worker owning the listener
+ * Return Value:
+ *   None
+ */
+static void listener_uring_arm(struct worker *w){
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if(sqe == NULL){
+        perror("Failed to Queue Accept");
+        return;
+    }
+    w->accept_addr_len = sizeof(w->accept_addr);
+    uring_prep_rw(sqe, IORING_OP_ACCEPT, w->listener.fd, &w->accept_addr, 0,
+                  (uintptr_t)&w->listener | URING_OP_ACCEPT);
+    sqe->addr2 = (uintptr_t)&w->accept_addr_len;
+}
+
+/* Handle the completion of a recv, send or handshake poll of a session endpoint
+ * Arguments:
+ *   struct endpoint *ep - endpoint the request was issued on
+ *   int op              - URING_OP_RECV, URING_OP_SEND or URING_OP_CONNECT
+ *   int res             - request result (bytes, poll mask or -errno)
+ * Return Value:
+ *   None
+ */
+static void endpoint_uring_complete(struct endpoint *ep, int op, int res){
+    struct session *s = ep->session;
+    struct endpoint *peer = (ep == &s->client) ? &s->remote : &s->client;
+    int is_client = (ep == &s->client);
+
+    if(op == URING_OP_CONNECT){
+        s->connect_inflight = 0;
+        if(s->closed){
+            return;
+        }
+        s->worker->syscalls++;
+        if(session_connected(s, res == -ECANCELED ? ETIMEDOUT : res < 0 ? -res : socket_error(ep->fd)) != 0){
+            return;
+        }
+    }
+    else if(op == URING_OP_RECV){
+        ep->recv_inflight = 0;
+        s->worker->reads++;
+        if(s->closed){
+            return;
+        }
+        cb_commit_push(ep->rx_buffer, res > 0 ? res : 0); // Releases the reservation of a recv that got nothing
+        if(res > 0){
+            if(!is_client && !s->first_byte){
+                session_first_byte(s);
+            }
+        }
+        else if(res == 0){ // No more recvs, session_forward_eof() half-closes the peer once rx_buffer drained
+            printf("Session %d.%d: %s Terminated the Connection\n",
+                    s->worker->id,s->id,is_client ? "Client" : "Remote Endpoint");
+            ep->eof = 1;
+        }
+        else if(res != -EAGAIN && res != -EINTR){
+            errno = -res;
+            perror(is_client ? "Client Socket Error" : "Remote Socket Error");
+            session_close(s);
+            return;
+        }
+    }
+    else{
+        ep->send_inflight = 0;
+        s->worker->writes++;
+        if(s->closed){
+            return;
+        }
+        if(res > 0){
+            /*Only the bytes accepted by the kernel are removed from the buffer*/
+            cb_commit_pop(ep->tx_buffer, res);
+            if(is_client){
+                s->downstream += res;
+                s->worker->downstream += res;
+            }
+            else{
+                s->upstream += res;
+                s->worker->upstream += res;
+            }
+        }
+        else if(res != -EAGAIN && res != -EINTR){
+            errno = -res;
+            perror(is_client ? "Client Send Failure" : "Remote Send Failure");
+            session_close(s);
+            return;
+        }
+    }
+    session_buffers_resize(s);
+    endpoint_uring_arm(ep);
+    endpoint_uring_arm(peer);
+    session_forward_eof(s);
+}
+
+/* Queue a read of the worker report timer
+ * Arguments:
+ *   struct worker *w - worker owning the timer
+ * Return Value:
+ *   None
+ */
+static void timer_uring_arm(struct worker *w){
+    if(w->timer_fd < 0){
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if(sqe == NULL){
+        perror("Failed to Queue Report Timer Read");
+        return;
+    }
+    uring_prep_rw(sqe, IORING_OP_READ, w->timer_fd, &w->timer_expirations, sizeof(w->timer_expirations),
+                  (uintptr_t)&w->report | URING_OP_SHUTDOWN);
+}
+
+/* io_uring event loop of one worker, runs until its shutdown eventfd is written
+ * Every iteration publishes all requests queued while handling the previous
+ * batch of completions and waits for the next one with a single io_uring_enter().
+ * Arguments:
+ *   void *arg - struct worker to run
+ * Return Value:
+ *   NULL
+ */
+void *worker_run_uring(void *arg){
+    struct worker *w = arg;
+    uint64_t shutdown_count;
+    int running = 1;
+
+    listener_uring_arm(w);
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if(sqe != NULL){
+        uring_prep_rw(sqe, IORING_OP_READ, w->shutdown_fd, &shutdown_count, sizeof(shutdown_count),
+                      URING_OP_SHUTDOWN);
+    }
+    timer_uring_arm(w);
+
+    while(running)
+    {
+        if(uring_submit_and_wait(&w->ring, 1) < 0 && errno != EINTR){
+            perror("Error waiting for completions");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(&w->ring)) != NULL){
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&w->ring);
+
+            struct endpoint *ep = (struct endpoint *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+            int op = user_data & URING_OP_MASK;
+            if(op == URING_OP_SHUTDOWN && ep == NULL){
+                running = 0;
+            }
+            else if(op == URING_OP_SHUTDOWN){ // Report timer, the timerfd is non-blocking
+                if(res != -EAGAIN){
+                    worker_timer(w);
+                }
+                timer_uring_arm(w);
+            }
+            else if(op == URING_OP_TIMEOUT){
+                // Connect timeout expired or was cancelled by the handshake, the poll completion handles both
+            }
+            else if(op == URING_OP_ACCEPT){
+                if(res >= 0){
+                    tune_apply(res, client_profile);
+                    session_open(w, res, &w->accept_addr);
+                }
+                else{
+                    errno = -res;
+                    perror("Proxy Failed to Accept the Client Connection");
+                }
+                listener_uring_arm(w);
+            }
+            else{
+                endpoint_uring_complete(ep, op, res);
+            }
+        }
+        worker_pool_wake(w);
+        session_reap(w);
+    }
+
+    /*Closing all remaining sessions, shutdown() completes their in-flight requests*/
+    while(w->sessions != NULL){
+        session_close(w->sessions);
+    }
+    while(w->closed_sessions != NULL){
+        if(uring_submit_and_wait(&w->ring, 1) < 0 && errno != EINTR){
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(&w->ring)) != NULL){
+            uint64_t user_data = cqe->user_data;
+            int op = user_data & URING_OP_MASK;
+            uring_cqe_seen(&w->ring);
+            if(op == URING_OP_RECV || op == URING_OP_SEND || op == URING_OP_CONNECT){
+                endpoint_uring_complete((struct endpoint *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK),
+                                        op, -ECANCELED);
+            }
+        }
+        session_reap(w);
+    }
+
+    uring_exit(&w->ring);
+    close(w->epoll_fd);
+    close(w->listener.fd);
+    close(w->shutdown_fd);
+    if(w->timer_fd >= 0){
+        close(w->timer_fd);
+    }
+    return NULL;
+}
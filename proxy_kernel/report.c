@@ -0,0 +1,139 @@
+#include "report.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+/* Seconds elapsed on CLOCK_MONOTONIC
+ * Arguments:
+ *   const struct timespec *since - earlier CLOCK_MONOTONIC time
+ * Return Value:
+ *   Elapsed time (in seconds)
+ */
+double elapsed_seconds(const struct timespec *since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Start interval reporting from zeroed counters
+ * Arguments:
+ *   interval_report *r - reporting state
+ * Return Value:
+ *   None
+ */
+void report_start(interval_report *r){
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    r->last = r->start;
+    r->prev = (report_counters){0};
+}
+
+/* Create a periodic CLOCK_MONOTONIC timerfd to be added to an event loop
+ * Arguments:
+ *   double interval - period (in seconds)
+ * Return Value:
+ *   Timer file descriptor on success (non-blocking)
+ *   -1 on error or when interval is not positive
+ */
+int report_timer_create(double interval){
+    if(interval <= 0){
+        return -1;
+    }
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timer_fd < 0){
+        perror("Failed to Create Report Timer");
+        return -1;
+    }
+    struct itimerspec timer_expiry;
+    timer_expiry.it_interval.tv_sec = (time_t)interval;
+    timer_expiry.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+    timer_expiry.it_value = timer_expiry.it_interval;
+    if(timerfd_settime(timer_fd, 0, &timer_expiry, NULL) != 0){
+        perror("Failed to Start the Report Timer");
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+/* Consume the expirations of a report timer so level-triggered epoll stops reporting it
+ * Arguments:
+ *   int timer_fd - timer from report_timer_create()
+ * Return Value:
+ *   Number of expirations since the last call (0 if none)
+ */
+int report_timer_ack(int timer_fd){
+    uint64_t expirations = 0;
+    if(read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        return 0;
+    }
+    return expirations;
+}
+
+/* Print the activity since the previous report and remember the current sample
+ * Arguments:
+ *   interval_report *r         - reporting state
+ *   const char *label          - prefix identifying the relay (worker), NULL only records the sample
+ *   const report_counters *now - cumulative counters
+ *   size_t up_queued           - bytes buffered towards the remote
+ *   size_t down_queued         - bytes buffered towards the client
+ *   size_t capacity            - buffer capacity per direction, 0 when nothing is buffered (no fill level)
+ * Return Value:
+ *   None
+ */
+void report_interval(interval_report *r, const char *label, const report_counters *now,
+                     size_t up_queued, size_t down_queued, size_t capacity){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    double from = (r->last.tv_sec - r->start.tv_sec) + (r->last.tv_nsec - r->start.tv_nsec) / 1e9;
+    double to = (t.tv_sec - r->start.tv_sec) + (t.tv_nsec - r->start.tv_nsec) / 1e9;
+    double secs = to - from;
+    unsigned long long up = now->upstream - r->prev.upstream;
+    unsigned long long down = now->downstream - r->prev.downstream;
+    unsigned long long reads = now->reads - r->prev.reads;
+    unsigned long long writes = now->writes - r->prev.writes;
+    unsigned long long calls = now->syscalls - r->prev.syscalls;
+
+    if(label != NULL && secs > 0){
+        printf("%s[%7.2f-%7.2f s] Up: %9.3f MB %7.3f Gbps, Down: %9.3f MB %7.3f Gbps, "
+               "Reads: %llu, Writes: %llu, %.0f B/Syscall",
+               label, from, to, up / 1e6, up * 8 / secs / 1e9, down / 1e6, down * 8 / secs / 1e9,
+               reads, writes, calls ? (double)(up + down) / calls : 0.0);
+        if(capacity > 0){
+            printf(", Fill: Up %.1f%% Down %.1f%%", up_queued * 100.0 / capacity, down_queued * 100.0 / capacity);
+        }
+        printf("\n");
+    }
+    r->last = t;
+    r->prev = *now;
+}
+
+/* Print the totals of a finished relay with rates over CLOCK_MONOTONIC wall time and the process CPU time
+ * Arguments:
+ *   const struct timespec *start - CLOCK_MONOTONIC time the relay started
+ *   const report_counters *total - cumulative counters
+ * Return Value:
+ *   None
+ */
+void report_summary(const struct timespec *start, const report_counters *total){
+    double secs = elapsed_seconds(start);
+    unsigned long long bytes = total->upstream + total->downstream;
+    printf("Elapsed: %.3f s\n", secs);
+    printf("UpStream: Data: %.3f MB, Rate: %.3f Gbps\n", total->upstream / 1e6,
+            secs > 0 ? total->upstream * 8 / secs / 1e9 : 0.0);
+    printf("DownStream: Data: %.3f MB, Rate: %.3f Gbps\n", total->downstream / 1e6,
+            secs > 0 ? total->downstream * 8 / secs / 1e9 : 0.0);
+    printf("Reads: %llu, Writes: %llu, Syscalls: %llu\n", total->reads, total->writes, total->syscalls);
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0){
+        double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        printf("CPU: User: %.3f s, System: %.3f s, Utilization: %.1f%%\n", user, sys,
+                secs > 0 ? (user + sys) * 100 / secs : 0.0);
+    }
+    if(bytes > 0){
+        printf("Syscalls per GB: %.1f, Bytes per Syscall: %.0f\n", total->syscalls * 1e9 / bytes,
+                total->syscalls ? (double)bytes / total->syscalls : 0.0);
+    }
+}
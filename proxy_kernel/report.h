@@ -0,0 +1,33 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define REPORT_INTERVAL 1.0   /* Default seconds between interval reports, 0 disables them */
+
+/* Cumulative counters of a relay, sampled at every report */
+typedef struct report_counters {
+    unsigned long long upstream;      // Bytes written towards the remote
+    unsigned long long downstream;    // Bytes written towards the client
+    unsigned long long reads;         // Receive calls (or completed io_uring receives)
+    unsigned long long writes;        // Send calls (or completed io_uring sends)
+    unsigned long long syscalls;      // All data path syscalls, including the above
+} report_counters;
+
+/* Interval reporting state, the previous sample is subtracted from the next one */
+typedef struct interval_report {
+    struct timespec start;            // CLOCK_MONOTONIC time the relay started
+    struct timespec last;             // Time of the previous sample
+    report_counters prev;
+} interval_report;
+
+double elapsed_seconds(const struct timespec *since);
+void report_start(interval_report *r);
+int report_timer_create(double interval);
+int report_timer_ack(int timer_fd);
+void report_interval(interval_report *r, const char *label, const report_counters *now,
+                     size_t up_queued, size_t down_queued, size_t capacity);
+void report_summary(const struct timespec *start, const report_counters *total);
+
+#endif
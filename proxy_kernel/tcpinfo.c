@@ -0,0 +1,246 @@
+#include "tcpinfo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>   // The glibc struct tcp_info lacks the rate and limited time fields
+
+/* Read TCP_INFO of one socket into the next ring slot, with the sampler lock held
+ * Arguments:
+ *   tcpinfo_sampler *s - sampler
+ *   int i              - watched socket
+ *   unsigned long long time_ns - time of the sampling pass
+ * Return Value:
+ *   None, sockets that fail (e.g. closed by the peer and reset) are skipped
+ */
+static void tcpinfo_sample_socket(tcpinfo_sampler *s, int i, unsigned long long time_ns){
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info)); // Older kernels fill less, the missing fields read 0
+    if(getsockopt(s->fds[i], IPPROTO_TCP, TCP_INFO, &info, &len) != 0){
+        return;
+    }
+    tcpinfo_sample *t = &s->ring[s->written++ % s->capacity];
+    t->time_ns = time_ns;
+    t->group = s->groups[i];
+    t->id = s->ids[i];
+    t->state = info.tcpi_state;
+    t->ca_state = info.tcpi_ca_state;
+    t->snd_cwnd = info.tcpi_snd_cwnd;
+    t->unacked = info.tcpi_unacked;
+    t->lost = info.tcpi_lost;
+    t->retrans = info.tcpi_retrans;
+    t->reordering = info.tcpi_reordering;
+    t->total_retrans = info.tcpi_total_retrans;
+    t->rtt = info.tcpi_rtt;
+    t->rttvar = info.tcpi_rttvar;
+    t->notsent_bytes = info.tcpi_notsent_bytes;
+    t->delivery_rate = info.tcpi_delivery_rate;
+    t->pacing_rate = info.tcpi_pacing_rate;
+    t->bytes_acked = info.tcpi_bytes_acked;
+    t->busy_time = info.tcpi_busy_time;
+    t->rwnd_limited = info.tcpi_rwnd_limited;
+    t->sndbuf_limited = info.tcpi_sndbuf_limited;
+}
+
+/* Sampling thread: one pass over the watched sockets per timer expiration
+ * Arguments:
+ *   void *arg - tcpinfo_sampler
+ * Return Value:
+ *   NULL
+ */
+static void *tcpinfo_run(void *arg){
+    tcpinfo_sampler *s = arg;
+    struct timespec now;
+    uint64_t expirations;
+
+    while(read(s->timer_fd, &expirations, sizeof(expirations)) > 0 || errno == EINTR){
+        pthread_mutex_lock(&s->lock);
+        if(s->stopping){
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long long time_ns = (now.tv_sec - s->start.tv_sec) * 1000000000ULL + now.tv_nsec - s->start.tv_nsec;
+        for(int i=0;i<s->count;i++){
+            tcpinfo_sample_socket(s, i, time_ns);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+/* Allocate the ring and start sampling
+ * Arguments:
+ *   tcpinfo_sampler *s           - sampler to start (zeroed)
+ *   int hz                       - passes over the watched sockets per second
+ *   unsigned long long capacity  - samples kept, older ones are overwritten
+ * Return Value:
+ *   0 on success
+ *   -1 on error (reported on stderr)
+ */
+int tcpinfo_start(tcpinfo_sampler *s, int hz, unsigned long long capacity){
+    if(hz <= 0 || hz > 1000000 || capacity == 0){
+        fprintf(stderr, "Invalid TCP_INFO Sampling Rate %d Hz or Capacity %llu\n", hz, capacity);
+        return -1;
+    }
+    s->ring = calloc(capacity, sizeof(tcpinfo_sample)); // Pages are only touched once written
+    if(s->ring == NULL){
+        perror("Failed to Allocate TCP_INFO Samples");
+        return -1;
+    }
+    s->capacity = capacity;
+    s->hz = hz;
+    s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(s->timer_fd < 0){
+        perror("Failed to Create TCP_INFO Timer");
+        goto error;
+    }
+    struct itimerspec timer_expiry;
+    timer_expiry.it_interval.tv_sec = 1 / hz; // 1 Hz is a whole second, tv_nsec must stay below one
+    timer_expiry.it_interval.tv_nsec = (1000000000L / hz) % 1000000000L;
+    timer_expiry.it_value = timer_expiry.it_interval;
+    if(timerfd_settime(s->timer_fd, 0, &timer_expiry, NULL) != 0){
+        perror("Failed to Start the TCP_INFO Timer");
+        close(s->timer_fd);
+        goto error;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    pthread_mutex_init(&s->lock, NULL);
+    if(pthread_create(&s->thread, NULL, tcpinfo_run, s) != 0){
+        perror("Failed to Start TCP_INFO Sampler");
+        close(s->timer_fd);
+        goto error;
+    }
+    return 0;
+
+error:
+    free(s->ring);
+    s->ring = NULL;
+    return -1;
+}
+
+/* Sample a socket until it is unwatched
+ * Arguments:
+ *   tcpinfo_sampler *s - sampler, nothing is done when it was not started
+ *   int fd             - TCP socket
+ *   unsigned group     - owner recorded with the samples (worker)
+ *   unsigned id        - socket recorded with the samples (session or stream)
+ * Return Value:
+ *   None
+ */
+void tcpinfo_watch(tcpinfo_sampler *s, int fd, unsigned group, unsigned id){
+    if(s->ring == NULL){
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    if(s->count == TCPINFO_MAX_SOCKETS){
+        s->unwatched++;
+    }
+    else{
+        s->fds[s->count] = fd;
+        s->groups[s->count] = group;
+        s->ids[s->count] = id;
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Stop sampling a socket, must be called before it is closed
+ * Arguments:
+ *   tcpinfo_sampler *s - sampler
+ *   int fd             - watched socket, unknown ones are ignored
+ * Return Value:
+ *   None
+ */
+void tcpinfo_unwatch(tcpinfo_sampler *s, int fd){
+    if(s->ring == NULL){
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    for(int i=0;i<s->count;i++){
+        if(s->fds[i] == fd){
+            s->count--;
+            s->fds[i] = s->fds[s->count];
+            s->groups[i] = s->groups[s->count];
+            s->ids[i] = s->ids[s->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Write the samples kept in the ring to a file, oldest first
+ * Arguments:
+ *   tcpinfo_sampler *s - stopped sampler
+ *   FILE *f            - log file
+ *   int binary         - raw tcpinfo_sample records instead of CSV
+ * Return Value:
+ *   0 on success
+ *   -1 on a write error
+ */
+static int tcpinfo_write(tcpinfo_sampler *s, FILE *f, int binary){
+    unsigned long long first = s->written > s->capacity ? s->written - s->capacity : 0;
+    if(!binary){
+        fprintf(f, "time_s,group,id,state,ca_state,cwnd,unacked,lost,retrans,reordering,total_retrans,"
+                   "rtt_us,rttvar_us,notsent_bytes,delivery_rate_Bps,pacing_rate_Bps,bytes_acked,"
+                   "busy_us,rwnd_limited_us,sndbuf_limited_us\n");
+    }
+    for(unsigned long long n = first; n < s->written; n++){
+        tcpinfo_sample *t = &s->ring[n % s->capacity];
+        if(binary){
+            fwrite(t, sizeof(tcpinfo_sample), 1, f);
+            continue;
+        }
+        fprintf(f, "%.6f,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                t->time_ns / 1e9, t->group, t->id, t->state, t->ca_state, t->snd_cwnd, t->unacked,
+                t->lost, t->retrans, t->reordering, t->total_retrans, t->rtt, t->rttvar, t->notsent_bytes,
+                t->delivery_rate, t->pacing_rate, t->bytes_acked, t->busy_time, t->rwnd_limited,
+                t->sndbuf_limited);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/* Stop sampling, write the log and free the ring
+ * Arguments:
+ *   tcpinfo_sampler *s - sampler, nothing is done when it was not started
+ *   const char *path   - log file, binary when the name ends in ".bin", CSV otherwise
+ * Return Value:
+ *   0 on success
+ *   -1 when the log could not be written (reported on stderr)
+ */
+int tcpinfo_stop(tcpinfo_sampler *s, const char *path){
+    int ret = 0;
+    if(s->ring == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL); // Wakes at the next expiration
+    close(s->timer_fd);
+
+    size_t len = strlen(path);
+    int binary = len >= 4 && strcmp(path + len - 4, ".bin") == 0;
+    FILE *f = fopen(path, binary ? "wb" : "w");
+    if(f == NULL || tcpinfo_write(s, f, binary) != 0){
+        perror("Failed to Write the TCP_INFO Log");
+        ret = -1;
+    }
+    if(f != NULL && fclose(f) != 0 && ret == 0){
+        perror("Failed to Write the TCP_INFO Log");
+        ret = -1;
+    }
+    printf("TCP_INFO Samples: %llu at %d Hz, Kept: %llu, Overwritten: %llu, Sockets Not Sampled: %llu, Log: %s\n",
+            s->written, s->hz, s->written < s->capacity ? s->written : s->capacity,
+            s->written > s->capacity ? s->written - s->capacity : 0, s->unwatched, path);
+    free(s->ring);
+    s->ring = NULL;
+    return ret;
+}
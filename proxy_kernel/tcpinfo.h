@@ -0,0 +1,61 @@
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+#include <pthread.h>
+
+#define TCPINFO_HZ           1000      /* Default samples per second and socket */
+#define TCPINFO_MAX_SOCKETS  1024      /* Sockets sampled at once, later ones are not sampled */
+#define TCPINFO_SAMPLES      (1 << 20) /* Default ring capacity, the newest samples are kept */
+
+/* One TCP_INFO reading. Log files ending in ".bin" hold these records back to back in host
+ * byte order, any other name gets one CSV line per record.
+ */
+typedef struct tcpinfo_sample {
+    unsigned long long time_ns;       // Since the sampler started
+    unsigned group;                   // Owner of the socket: proxy worker, 0 for the iperf client
+    unsigned id;                      // Session of the worker or stream of the client
+    unsigned state;                   // TCP_ESTABLISHED...
+    unsigned ca_state;                // TCP_CA_Open...
+    unsigned snd_cwnd;                // Segments
+    unsigned unacked;                 // Segments in flight
+    unsigned lost;
+    unsigned retrans;                 // Segments being retransmitted now, not cumulative
+    unsigned reordering;
+    unsigned total_retrans;           // Cumulative retransmitted segments
+    unsigned rtt;                     // Smoothed, us
+    unsigned rttvar;                  // us
+    unsigned notsent_bytes;           // Queued but not sent yet
+    unsigned long long delivery_rate; // Bytes per second
+    unsigned long long pacing_rate;   // Bytes per second
+    unsigned long long bytes_acked;
+    unsigned long long busy_time;     // us sending data
+    unsigned long long rwnd_limited;  // us limited by the receive window
+    unsigned long long sndbuf_limited; // us limited by the send buffer
+} tcpinfo_sample;
+
+/* Samples the watched sockets from its own thread into a preallocated ring, so the data path
+ * only pays for watch/unwatch and the log is written once at stop.
+ */
+typedef struct tcpinfo_sampler {
+    tcpinfo_sample *ring;
+    unsigned long long capacity;
+    unsigned long long written;       // Samples taken, the ring holds the last capacity of them
+    int fds[TCPINFO_MAX_SOCKETS];
+    unsigned groups[TCPINFO_MAX_SOCKETS];
+    unsigned ids[TCPINFO_MAX_SOCKETS];
+    int count;                        // Watched sockets
+    unsigned long long unwatched;     // Sockets not sampled because the table was full
+    int hz;
+    int timer_fd;
+    int stopping;
+    struct timespec start;
+    pthread_mutex_t lock;             // Protects the table, held while sampling so fds stay open
+    pthread_t thread;
+} tcpinfo_sampler;
+
+int tcpinfo_start(tcpinfo_sampler *s, int hz, unsigned long long capacity);
+void tcpinfo_watch(tcpinfo_sampler *s, int fd, unsigned group, unsigned id);
+void tcpinfo_unwatch(tcpinfo_sampler *s, int fd);
+int tcpinfo_stop(tcpinfo_sampler *s, const char *path);
+
+#endif
@@ -0,0 +1,242 @@
+#include "tune.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static tune_profile profiles[TUNE_MAX_PROFILES];
+static int profile_count = 0;
+
+/* Integer options of a profile, looked up by their config file key */
+static const struct {
+    const char *key;
+    size_t offset;
+} tune_keys[] = {
+    { "sndbuf",        offsetof(tune_profile, sndbuf) },
+    { "rcvbuf",        offsetof(tune_profile, rcvbuf) },
+    { "nodelay",       offsetof(tune_profile, nodelay) },
+    { "notsent_lowat", offsetof(tune_profile, notsent_lowat) },
+    { "quickack",      offsetof(tune_profile, quickack) },
+    { "priority",      offsetof(tune_profile, priority) },
+    { "tos",           offsetof(tune_profile, tos) },
+};
+
+/* Strip leading and trailing whitespace in place
+ * Arguments:
+ *   char *s - string to trim
+ * Return Value:
+ *   Start of the trimmed string
+ */
+static char *tune_trim(char *s){
+    while(isspace((unsigned char)*s)){
+        s++;
+    }
+    char *end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1])){
+        *--end = '\0';
+    }
+    return s;
+}
+
+/* Load the profiles of a config file, replacing the ones loaded before
+ * Arguments:
+ *   const char *path - config file: [name] sections of "key = value" lines, '#' starts a comment
+ * Return Value:
+ *   Number of profiles loaded on success
+ *   -1 on error (reported on stderr)
+ */
+int tune_load(const char *path){
+    FILE *f = fopen(path, "r");
+    if(f == NULL){
+        perror("Failed to Open Tuning Profiles");
+        return -1;
+    }
+
+    char line[256];
+    int line_no = 0;
+    tune_profile *p = NULL;
+    profile_count = 0;
+    while(fgets(line, sizeof(line), f) != NULL){
+        line_no++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL){
+            *comment = '\0';
+        }
+        char *s = tune_trim(line);
+        if(*s == '\0'){
+            continue;
+        }
+
+        if(*s == '['){ // New profile, every option unset
+            char *end = strchr(s, ']');
+            if(end == NULL || end - s - 1 <= 0 || end - s - 1 >= TUNE_NAME_LEN ||
+               profile_count == TUNE_MAX_PROFILES){
+                fprintf(stderr, "%s:%d: Invalid Profile Name or Too Many Profiles\n", path, line_no);
+                goto error;
+            }
+            p = &profiles[profile_count++];
+            memset(p, 0, sizeof(tune_profile));
+            memcpy(p->name, s + 1, end - s - 1);
+            p->sndbuf = p->rcvbuf = p->nodelay = p->notsent_lowat = -1;
+            p->quickack = p->priority = p->tos = -1;
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if(p == NULL || eq == NULL){
+            fprintf(stderr, "%s:%d: Expected \"key = value\" Inside a [profile]\n", path, line_no);
+            goto error;
+        }
+        *eq = '\0';
+        char *key = tune_trim(s), *value = tune_trim(eq + 1);
+        if(strcmp(key, "congestion") == 0){
+            if(strlen(value) == 0 || strlen(value) >= TUNE_CA_NAME_LEN){
+                fprintf(stderr, "%s:%d: Invalid Congestion Control \"%s\"\n", path, line_no, value);
+                goto error;
+            }
+            strcpy(p->congestion, value);
+            continue;
+        }
+
+        size_t i;
+        for(i = 0; i < sizeof(tune_keys) / sizeof(tune_keys[0]); i++){
+            if(strcmp(key, tune_keys[i].key) == 0){
+                break;
+            }
+        }
+        char *end;
+        errno = 0;
+        long v = strtol(value, &end, 0); // Base prefixes allowed, e.g. tos = 0x10
+        if(i == sizeof(tune_keys) / sizeof(tune_keys[0]) || *value == '\0' || *end != '\0' ||
+           errno != 0 || v < 0 || v > 0x7fffffff){
+            fprintf(stderr, "%s:%d: Unknown Option or Invalid Value \"%s = %s\"\n", path, line_no, key, value);
+            goto error;
+        }
+        *(int *)((char *)p + tune_keys[i].offset) = (int)v;
+    }
+    fclose(f);
+    return profile_count;
+
+error:
+    fclose(f);
+    profile_count = 0;
+    return -1;
+}
+
+/* Look up a loaded profile
+ * Arguments:
+ *   const char *name - profile name
+ * Return Value:
+ *   Profile on success
+ *   NULL when no profile has that name
+ */
+const tune_profile *tune_find(const char *name){
+    for(int i = 0; i < profile_count; i++){
+        if(strcmp(profiles[i].name, name) == 0){
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/* Load a config file once and look up a profile in it
+ * Arguments:
+ *   const char *path - config file, loaded on the first call with a given path
+ *   const char *name - profile name, NULL selects no profile
+ * Return Value:
+ *   Profile on success, NULL when name is NULL
+ * Note: exits the process when the file or the profile is missing, only used at startup
+ */
+const tune_profile *tune_select(const char *path, const char *name){
+    static const char *loaded = NULL;
+    if(name == NULL){
+        return NULL;
+    }
+    if(path == NULL){
+        fprintf(stderr, "Profile \"%s\" Selected Without a Profile File\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if((loaded == NULL || strcmp(loaded, path) != 0) && tune_load(path) < 0){
+        exit(EXIT_FAILURE);
+    }
+    loaded = path;
+
+    const tune_profile *p = tune_find(name);
+    if(p == NULL){
+        fprintf(stderr, "%s: No Profile Named \"%s\"\n", path, name);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Set the options of a profile on a socket
+ * Arguments:
+ *   int fd                 - TCP socket, buffers take full effect when set before listen() or connect()
+ *   const tune_profile *p  - profile to apply, NULL applies nothing
+ * Return Value:
+ *   0 on success
+ *   -1 when an option was rejected (reported on stderr, the others are still applied)
+ */
+int tune_apply(int fd, const tune_profile *p){
+    int ret = 0;
+    if(p == NULL){
+        return 0;
+    }
+
+    const struct {
+        int value, level, name;
+        const char *label;
+    } opts[] = {
+        { p->sndbuf,        SOL_SOCKET,  SO_SNDBUF,         "SO_SNDBUF" },
+        { p->rcvbuf,        SOL_SOCKET,  SO_RCVBUF,         "SO_RCVBUF" },
+        { p->nodelay,       IPPROTO_TCP, TCP_NODELAY,       "TCP_NODELAY" },
+        { p->notsent_lowat, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT" },
+        { p->quickack,      IPPROTO_TCP, TCP_QUICKACK,      "TCP_QUICKACK" },
+        { p->priority,      SOL_SOCKET,  SO_PRIORITY,       "SO_PRIORITY" },
+        { p->tos,           IPPROTO_IP,  IP_TOS,            "IP_TOS" },
+    };
+    for(size_t i = 0; i < sizeof(opts) / sizeof(opts[0]); i++){
+        if(opts[i].value >= 0 &&
+           setsockopt(fd, opts[i].level, opts[i].name, &opts[i].value, sizeof(int)) != 0){
+            fprintf(stderr, "Profile %s: Failed to Set %s to %d: %s\n",
+                    p->name, opts[i].label, opts[i].value, strerror(errno));
+            ret = -1;
+        }
+    }
+    if(p->congestion[0] != '\0' &&
+       setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)) != 0){
+        fprintf(stderr, "Profile %s: Failed to Set TCP_CONGESTION to %s: %s\n",
+                p->name, p->congestion, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Print the options set by a profile
+ * Arguments:
+ *   const char *label     - prefix of the line
+ *   const tune_profile *p - profile to print, NULL prints nothing
+ * Return Value:
+ *   None
+ */
+void tune_print(const char *label, const tune_profile *p){
+    if(p == NULL){
+        return;
+    }
+    printf("%sProfile %s:", label, p->name);
+    for(size_t i = 0; i < sizeof(tune_keys) / sizeof(tune_keys[0]); i++){
+        int v = *(const int *)((const char *)p + tune_keys[i].offset);
+        if(v >= 0){
+            printf(" %s=%d", tune_keys[i].key, v);
+        }
+    }
+    if(p->congestion[0] != '\0'){
+        printf(" congestion=%s", p->congestion);
+    }
+    printf("\n");
+}
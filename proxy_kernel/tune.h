@@ -0,0 +1,34 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#define TUNE_MAX_PROFILES  32   /* Profiles kept from a config file */
+#define TUNE_NAME_LEN      32
+#define TUNE_CA_NAME_LEN   16   /* TCP_CA_NAME_MAX of the kernel */
+
+/* Named set of socket options, loaded by tune_load() from sections like
+ *
+ *   [wan]
+ *   sndbuf = 8388608
+ *   congestion = bbr
+ *
+ * Options a profile does not mention are left at the system defaults.
+ */
+typedef struct tune_profile {
+    char name[TUNE_NAME_LEN];
+    int sndbuf;                       // SO_SNDBUF, -1 when unset (setting it disables autotuning)
+    int rcvbuf;                       // SO_RCVBUF, -1 when unset
+    int nodelay;                      // TCP_NODELAY, -1 when unset
+    int notsent_lowat;                // TCP_NOTSENT_LOWAT, -1 when unset
+    char congestion[TUNE_CA_NAME_LEN]; // TCP_CONGESTION (cubic, bbr, reno...), empty when unset
+    int quickack;                     // TCP_QUICKACK, -1 when unset
+    int priority;                     // SO_PRIORITY, -1 when unset
+    int tos;                          // IP_TOS, -1 when unset
+} tune_profile;
+
+int tune_load(const char *path);
+const tune_profile *tune_find(const char *name);
+const tune_profile *tune_select(const char *path, const char *name);
+int tune_apply(int fd, const tune_profile *p);
+void tune_print(const char *label, const tune_profile *p);
+
+#endif
@@ -0,0 +1,370 @@
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Minimal io_uring wrapper over the raw syscalls (liburing is not required)
+ * Every function returns 0 (or a count) on success and -1 with errno set on error.
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Create an io_uring instance and map its queues
+ * Arguments:
+ *   uring *r         - reference to the ring
+ *   unsigned entries - submission queue size (completion queue is twice that)
+ * Return Value:
+ *   0 on success
+ *   -1 on error (e.g. io_uring disabled by the kernel)
+ */
+int uring_init(uring *r, unsigned entries){
+    struct io_uring_params p;
+    memset(r, 0, sizeof(uring));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0){
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){ // Both rings share one mapping
+        r->sq_len = r->cq_len = (r->sq_len > r->cq_len) ? r->sq_len : r->cq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        r->cq_ptr = r->sq_ptr;
+    }
+    else{
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED){
+            munmap(r->sq_ptr, r->sq_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED){
+        if (r->cq_ptr != r->sq_ptr){
+            munmap(r->cq_ptr, r->cq_len);
+        }
+        munmap(r->sq_ptr, r->sq_len);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = r->sq_ptr + p.sq_off.head;
+    r->sq_tail = r->sq_ptr + p.sq_off.tail;
+    r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ptr + p.sq_off.array;
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = r->cq_ptr + p.cq_off.head;
+    r->cq_tail = r->cq_ptr + p.cq_off.tail;
+    r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+    r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+    // Record supported opcodes, an old kernel without probing supports none of the optional ones
+    size_t probe_len = sizeof(struct io_uring_probe) + URING_MAX_PROBE_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (probe != NULL){
+        if (sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, URING_MAX_PROBE_OPS) == 0){
+            for (int i = 0; i < probe->ops_len && i < URING_MAX_PROBE_OPS; i++){
+                if (probe->ops[i].op < URING_MAX_PROBE_OPS){
+                    r->ops[probe->ops[i].op] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+                }
+            }
+        }
+        free(probe);
+    }
+    return 0;
+}
+
+/* Tear down an io_uring instance
+ * Arguments:
+ *   uring *r - reference to the ring
+ * Return Value:
+ *   None
+ */
+void uring_exit(uring *r){
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr){
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+/* Check whether the kernel supports an io_uring opcode
+ * Arguments:
+ *   uring *r - reference to the ring
+ *   int op   - IORING_OP_* value
+ * Return Value:
+ *   1 when supported, 0 otherwise
+ */
+int uring_opcode_supported(uring *r, int op){
+    return op >= 0 && op < URING_MAX_PROBE_OPS && r->ops[op];
+}
+
+/* Make sure the next count uring_get_sqe() calls succeed without a flush in between, so linked
+ * entries are published together
+ * Arguments:
+ *   uring *r       - reference to the ring
+ *   unsigned count - entries needed
+ * Return Value:
+ *   0 on success
+ *   -1 on error (EBUSY when the kernel has not consumed enough entries)
+ */
+int uring_reserve_sqes(uring *r, unsigned count){
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head + count > r->sq_entries){
+        if (uring_submit_and_wait(r, 0) < 0){
+            return -1;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head + count > r->sq_entries){
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Get a zeroed submission queue entry, flushing the queue to the kernel when it is full
+ * Arguments:
+ *   uring *r - reference to the ring
+ * Return Value:
+ *   Submission queue entry on success
+ *   NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(uring *r){
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries){
+        if (uring_submit_and_wait(r, 0) < 0){
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries){
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+/* Publish queued entries and wait for completions with a single io_uring_enter()
+ * Arguments:
+ *   uring *r         - reference to the ring
+ *   unsigned wait_nr - minimum number of completions to wait for
+ * Return Value:
+ *   Number of entries submitted on success
+ *   -1 on error
+ */
+int uring_submit_and_wait(uring *r, unsigned wait_nr){
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0){
+        return 0;
+    }
+
+    int ret;
+    do{
+        r->enters++;
+        ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    }while (ret < 0 && errno == EINTR && wait_nr == 0);
+    return ret;
+}
+
+/* Get the next completion without waiting
+ * Arguments:
+ *   uring *r - reference to the ring
+ * Return Value:
+ *   Completion queue entry, valid until uring_cqe_seen()
+ *   NULL when no completion is pending
+ */
+struct io_uring_cqe *uring_peek_cqe(uring *r){
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/* Release the completion returned by uring_peek_cqe()
+ * Arguments:
+ *   uring *r - reference to the ring
+ * Return Value:
+ *   None
+ */
+void uring_cqe_seen(uring *r){
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Register an empty (sparse) table of fixed files
+ * Arguments:
+ *   uring *r       - reference to the ring
+ *   unsigned count - number of slots
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int uring_register_files(uring *r, unsigned count){
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return sys_io_uring_register(r->fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0 ? -1 : 0;
+}
+
+/* Install or clear one slot of the fixed file table
+ * Arguments:
+ *   uring *r      - reference to the ring
+ *   unsigned slot - table index
+ *   int fd        - file descriptor, -1 to clear the slot
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int uring_update_file(uring *r, unsigned slot, int fd){
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (unsigned long)&fd;
+    return sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0 ? -1 : 0;
+}
+
+/* Register buffers used by IORING_OP_READ_FIXED/WRITE_FIXED
+ * Arguments:
+ *   uring *r                - reference to the ring
+ *   const struct iovec *iov - buffers, referenced by index in sqe->buf_index
+ *   unsigned count          - number of buffers
+ * Return Value:
+ *   0 on success
+ *   -1 on error
+ */
+int uring_register_buffers(uring *r, const struct iovec *iov, unsigned count){
+    return sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+/* Fill a read/write style submission queue entry
+ * Arguments:
+ *   struct io_uring_sqe *sqe - entry from uring_get_sqe()
+ *   int op                   - IORING_OP_* value
+ *   int fd                   - file descriptor or fixed file slot
+ *   const void *addr         - buffer or iovec array
+ *   unsigned len             - buffer length or iovec count
+ *   unsigned long long user_data - value returned in the completion
+ * Return Value:
+ *   None
+ */
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+                   unsigned len, unsigned long long user_data){
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+/* Register a ring of kernel selected buffers
+ * Arguments:
+ *   uring *r            - reference to the ring
+ *   uring_buf_ring *br  - buffer ring to initialize
+ *   unsigned short bgid - buffer group id
+ *   unsigned entries    - number of buffers (power of 2)
+ * Return Value:
+ *   0 on success
+ *   -1 on error (kernel without IORING_REGISTER_PBUF_RING)
+ */
+int uring_buf_ring_init(uring *r, uring_buf_ring *br, unsigned short bgid, unsigned entries){
+    struct io_uring_buf_reg reg;
+    br->len = entries * sizeof(struct io_uring_buf);
+    br->br = mmap(NULL, br->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->br == MAP_FAILED){
+        return -1;
+    }
+    br->entries = entries;
+    br->bgid = bgid;
+    br->tail = 0;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)br->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        munmap(br->br, br->len);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue a buffer for the kernel, visible after uring_buf_ring_publish()
+ * Arguments:
+ *   uring_buf_ring *br - buffer ring
+ *   void *addr         - buffer
+ *   unsigned len       - buffer length
+ *   unsigned short bid - buffer id returned in completions
+ * Return Value:
+ *   None
+ */
+void uring_buf_ring_add(uring_buf_ring *br, void *addr, unsigned len, unsigned short bid){
+    struct io_uring_buf *buf = &br->br->bufs[br->tail & (br->entries - 1)];
+    buf->addr = (unsigned long)addr;
+    buf->len = len;
+    buf->bid = bid;
+    br->tail++;
+}
+
+/* Make buffers added with uring_buf_ring_add() available to the kernel
+ * Arguments:
+ *   uring_buf_ring *br - buffer ring
+ * Return Value:
+ *   None
+ */
+void uring_buf_ring_publish(uring_buf_ring *br){
+    __atomic_store_n(&br->br->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+/* Unregister and release a buffer ring
+ * Arguments:
+ *   uring *r           - reference to the ring
+ *   uring_buf_ring *br - buffer ring
+ * Return Value:
+ *   None
+ */
+void uring_buf_ring_exit(uring *r, uring_buf_ring *br){
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = br->bgid;
+    sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br->br, br->len);
+}
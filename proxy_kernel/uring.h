@@ -0,0 +1,59 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#define URING_MAX_PROBE_OPS  64   /* Opcodes covered by uring_opcode_supported() */
+
+typedef struct uring {
+    int fd;                       // io_uring instance
+    unsigned *sq_head;            // Shared submission queue indices (kernel consumes at head)
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;            // SQEs handed out by uring_get_sqe(), published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;            // Shared completion queue indices (kernel produces at tail)
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;                 // Mappings released by uring_exit()
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned char ops[URING_MAX_PROBE_OPS]; // Opcodes reported by IORING_REGISTER_PROBE
+    unsigned long long enters;    // io_uring_enter() calls, the only syscall on the data path
+} uring;
+
+/* Kernel provided buffer ring consumed by IOSQE_BUFFER_SELECT requests */
+typedef struct uring_buf_ring {
+    struct io_uring_buf_ring *br; // Ring shared with the kernel
+    size_t len;
+    unsigned entries;             // Power of 2
+    unsigned short bgid;          // Buffer group id referenced by sqe->buf_group
+    unsigned short tail;          // Local tail, published by uring_buf_ring_publish()
+} uring_buf_ring;
+
+int uring_init(uring *r, unsigned entries);
+void uring_exit(uring *r);
+int uring_opcode_supported(uring *r, int op);
+int uring_reserve_sqes(uring *r, unsigned count);
+struct io_uring_sqe *uring_get_sqe(uring *r);
+int uring_submit_and_wait(uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring *r);
+void uring_cqe_seen(uring *r);
+int uring_register_files(uring *r, unsigned count);
+int uring_update_file(uring *r, unsigned slot, int fd);
+int uring_register_buffers(uring *r, const struct iovec *iov, unsigned count);
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+                   unsigned len, unsigned long long user_data);
+int uring_buf_ring_init(uring *r, uring_buf_ring *br, unsigned short bgid, unsigned entries);
+void uring_buf_ring_add(uring_buf_ring *br, void *addr, unsigned len, unsigned short bid);
+void uring_buf_ring_publish(uring_buf_ring *br);
+void uring_buf_ring_exit(uring *r, uring_buf_ring *br);
+
+#endif